@@ -1,39 +1,185 @@
-
 #include "args.h"
 
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+/* Private function forward declarations */
+int parse_int(char *str, int *result);
+int parse_expires(struct server_args *result, char *str);
 
 
 void print_usage(char *prog_name) {
-	printf("Usage: %s port rootdir logfile\n", prog_name);
+	printf("Usage: %s [options] port rootdir logfile\n", prog_name);
+	printf("Options:\n");
+	printf("  -w workers  Number of worker threads (server_p) or pre-forked\n"
+	       "              worker processes (server_f) to serve with\n");
+	printf("  -s kb       Stack size of each worker thread, in KB, at\n"
+	       "              least %d\n", ARGS_MIN_STACK_KB);
+	printf("  -c mb       Size of the in-memory file cache in MB, 0 = off\n");
+	printf("  -d          Drop log lines rather than wait for the log to\n"
+	       "              catch up when it falls behind\n");
+	printf("  -b          Write a binary log, logconv converts it to text\n");
+	printf("  -e path=s   Let clients cache the files under path for s\n"
+	       "              seconds, may be given more than once\n");
+	printf("  -S url      Keep live stats, and serve them at url (such as\n"
+	       "              /__stats) rather than a file\n");
+	printf("  -t          Log how long each phase of a request took\n");
+	printf("  -l ms       Log requests taking at least ms milliseconds, and\n"
+	       "              their phases, to logfile.slow too\n");
+	printf("  -q n        Let up to n connections wait to be accepted\n");
+	printf("  -D s        Only accept connections once they send a request,\n"
+	       "              or after s seconds (TCP_DEFER_ACCEPT)\n");
+	printf("  -F n        Accept data with the SYN from clients with a TCP\n"
+	       "              Fast Open cookie, up to n pending at once\n");
+	printf("  -B us       Busy poll for us microseconds when reading\n"
+	       "              (SO_BUSY_POLL, may need CAP_NET_ADMIN)\n");
+}
+
+
+/*
+ * Parse a string as a base 10 integer.
+ * Returns 0 -> The string was not a valid number
+ *         1 -> Okay, the number was written into |result|
+ */
+int parse_int(char *str, int *result) {
+	char *endptr;
+
+	*result = strtol(str, &endptr, 10);
+	if (strlen(str) == 0 || *endptr != '\0') {
+		/* 
+		 * Bad number
+		 * Note: Should just use strtonum... but the lab machines don't have
+		 * that function for some reason, so this serves as a roundabout way 
+		 * of determining if the arg was a valid number.
+		 */
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Parse an -e argument, prefix=seconds, into the next of |result|'s
+ * expires_ settings.
+ * Returns 0 -> The argument was malformed, or there were too many
+ *         1 -> Okay
+ */
+int parse_expires(struct server_args *result, char *str) {
+	char *equals;
+	int max_age;
+
+	equals = strrchr(str, '=');
+	if (!equals || equals == str || result->expires_count >= ARGS_EXPIRES_MAX)
+		return 0;
+	if (!parse_int(equals + 1, &max_age) || max_age < 0)
+		return 0;
+
+	/* The prefix is the start of the argument */
+	*equals = '\0';
+	result->expires_prefix[result->expires_count] = str;
+	result->expires_max_age[result->expires_count] = max_age;
+	++result->expires_count;
+	return 1;
 }
 
 
 int parse_args(struct server_args *result, int argc, char *argv[]) {
-	/* Must have exactly 4 arguments */
-	if (argc != 4) {
+	int opt;
+
+	/* Get the options, anything not given is left as 0 */
+	memset(result, 0x0, sizeof(struct server_args));
+	result->cache_mb = ARGS_DEFAULT_CACHE_MB;
+	result->slow_ms = -1;
+	while ((opt = getopt(argc, argv, "w:s:c:dbe:S:tl:q:D:F:B:")) != -1) {
+		switch (opt) {
+		case 'w':
+			if (!parse_int(optarg, &result->workers) || result->workers < 1)
+				return ARGS_ERROR;
+			break;
+		case 's':
+			if (!parse_int(optarg, &result->stack_kb) ||
+				result->stack_kb < ARGS_MIN_STACK_KB)
+			{
+				return ARGS_ERROR;
+			}
+			break;
+		case 'c':
+			if (!parse_int(optarg, &result->cache_mb) || result->cache_mb < 0)
+				return ARGS_ERROR;
+			break;
+		case 'd':
+			result->log_drop = 1;
+			break;
+		case 'b':
+			result->log_binary = 1;
+			break;
+		case 'e':
+			if (!parse_expires(result, optarg))
+				return ARGS_ERROR;
+			break;
+		case 'S':
+			if (optarg[0] != '/')
+				return ARGS_ERROR;
+			result->stats_path = optarg;
+			break;
+		case 't':
+			result->log_timing = 1;
+			break;
+		case 'l':
+			if (!parse_int(optarg, &result->slow_ms) || result->slow_ms < 0)
+				return ARGS_ERROR;
+			break;
+		case 'q':
+			if (!parse_int(optarg, &result->tuning.backlog) ||
+				result->tuning.backlog < 1)
+			{
+				return ARGS_ERROR;
+			}
+			break;
+		case 'D':
+			if (!parse_int(optarg, &result->tuning.defer_accept) ||
+				result->tuning.defer_accept < 1)
+			{
+				return ARGS_ERROR;
+			}
+			break;
+		case 'F':
+			if (!parse_int(optarg, &result->tuning.fastopen) ||
+				result->tuning.fastopen < 1)
+			{
+				return ARGS_ERROR;
+			}
+			break;
+		case 'B':
+			if (!parse_int(optarg, &result->tuning.busy_poll) ||
+				result->tuning.busy_poll < 1)
+			{
+				return ARGS_ERROR;
+			}
+			break;
+		default:
+			/* Unknown option */
+			return ARGS_ERROR;
+		}
+	}
+
+	/* Must have exactly 3 arguments after the options */
+	if (argc - optind != 3) {
 		return ARGS_ERROR;
 	}
 
 	/* Get the port */
-	char *endptr;
-	result->port = strtol(argv[1], &endptr, 10);
-	if (strlen(argv[1]) == 0 || *endptr != '\0') {
-		/* 
-		 * Bad port
-		 * Note: Should just use strtonum... but the lab machines don't have
-		 * that function for some reason, so this serves as a roundabout way of
-		 * determining if the first arg was a valid number.
-		 */
+	if (!parse_int(argv[optind], &result->port)) {
 		return ARGS_ERROR;
 	}
 
 	/* Get the paths */
-	result->server_root = argv[2];
-	result->log_file = argv[3];
+	result->server_root = argv[optind + 1];
+	result->log_file = argv[optind + 2];
 
 	return ARGS_OKAY;
-}
\ No newline at end of file
+}
@@ -1,20 +1,82 @@
-
 #ifndef ARGS_H_
 #define ARGS_H_
 
+#include "server_common.h"
+
 
 /* Status codes returned by parse_args */
 #define ARGS_OKAY   0
 #define ARGS_ERROR -1
 
+/* Size of the in-memory file cache if not given with -c, in MB */
+#define ARGS_DEFAULT_CACHE_MB 32
+
+/*
+ * The smallest stack that worker threads may be given with -s, in KB. A
+ * request takes about 10 KB of it, this leaves room for the C library.
+ */
+#define ARGS_MIN_STACK_KB 32
+
+/* How many times -e may be given */
+#define ARGS_EXPIRES_MAX 16
+
 
 /*
  * A structure representing the arguments passed to our server.
+ * The optional settings are 0 when they were not given, in which case the
+ * server uses it's own default for them, unless noted otherwise.
  */
 struct server_args {
 	int port;
 	char *server_root;
 	char *log_file;
+
+	/* -w: How many worker threads / pre-forked processes to serve with */
+	int workers;
+
+	/* -s: The stack size for worker threads, in KB, ARGS_MIN_STACK_KB+ */
+	int stack_kb;
+
+	/* 
+	 * -c: Size of the in-memory file cache in MB, 0 to disable it. Defaults
+	 * to ARGS_DEFAULT_CACHE_MB.
+	 */
+	int cache_mb;
+
+	/* -d: Drop log lines rather than wait when the log can't keep up */
+	int log_drop;
+
+	/* -b: Write the log in the compact binary format (see logconv) */
+	int log_binary;
+
+	/* 
+	 * -e: Paths that clients may cache the files under for a while, given
+	 * as prefix=seconds, once for each path.
+	 */
+	char *expires_prefix[ARGS_EXPIRES_MAX];
+	int expires_max_age[ARGS_EXPIRES_MAX];
+	int expires_count;
+
+	/* -S: The URL to serve live stats at, NULL to not keep any */
+	char *stats_path;
+
+	/* -t: Log how long each phase of a request took, with it's line */
+	int log_timing;
+
+	/*
+	 * -l: Log the requests that take at least this many milliseconds to a
+	 * slow request log too, -1 (the default) to not keep one.
+	 */
+	int slow_ms;
+
+	/*
+	 * How to tune the listening socket, all 0 (the defaults) unless asked:
+	 * -q: The accept queue's length
+	 * -D: Seconds to wait for a connection's request, with TCP_DEFER_ACCEPT
+	 * -F: How many TCP Fast Open requests may be pending
+	 * -B: Microseconds to busy poll for when reading, with SO_BUSY_POLL
+	 */
+	struct server_tuning tuning;
 };
 
 
@@ -34,4 +96,4 @@ void print_usage(char *prog_name);
 int parse_args(struct server_args *result, int argc, char *argv[]);
 
 
-#endif
\ No newline at end of file
+#endif
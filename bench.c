@@ -0,0 +1,1026 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * bench: Load test one or more running servers with the same requests, and
+ * compare how they did side by side.
+ * Usage: bench [options] [name=]host:port ...
+ * Each connection makes one request at a time. In the closed loop (the
+ * default) it makes the next as soon as the last is answered, so the
+ * servers set the pace. In the open loop (-R) requests are due at a fixed
+ * rate whether or not the server keeps up, and their latency is measured
+ * from when they were due rather than when they could be sent, so that a
+ * server that stalls isn't flattered by the requests it held up.
+ * With -g it makes a synthetic server root instead, see bench_generate.
+ */
+
+
+/* Defaults for the options */
+#define BENCH_CONNS    16
+#define BENCH_THREADS  1
+#define BENCH_SECONDS  10
+#define BENCH_FILES    1000
+
+/* How many servers may be compared, and requests in the mix */
+#define BENCH_TARGET_MAX 8
+#define BENCH_MIX_MAX    65536
+
+/* Room for a request, and a response's header */
+#define REQUEST_MAX 4200
+#define HEADER_MAX  8192
+
+/* How long a connection waits to try again after failing, in ns */
+#define RETRY_DELAY 10000000 /* 10 ms */
+
+/*
+ * Latencies are kept in microseconds in a histogram with HIST_SUB buckets
+ * for each power of two, which is exact below HIST_SUB and within about
+ * 3% above it.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* States for a connection to be in */
+#define CONN_IDLE       0 /* Waiting until it's next request is due */
+#define CONN_CONNECTING 1
+#define CONN_SENDING    2
+#define CONN_READING    3
+
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+/*
+ * How a run against one server went.
+ */
+struct bench_result {
+	struct histogram latency;
+	uint64_t requests;   /* Answered, whatever the status */
+	uint64_t bad_status; /* Of those, how many were 4xx or 5xx */
+	uint64_t errors;     /* Failed to connect, or cut off */
+	uint64_t connects;
+	uint64_t bytes;
+	double seconds;
+};
+
+/*
+ * A server to run against.
+ */
+struct bench_target {
+	const char *label;
+	char host[64];
+	struct sockaddr_in addr;
+	struct bench_result result;
+};
+
+/*
+ * The state of one connection, and the request it's making.
+ */
+struct bench_conn {
+	int fd;
+	int state;
+	int made;          /* Requests made on this connection so far */
+	int close_after;   /* This is it's last request */
+	uint64_t due;      /* When the next request is due, ns */
+	uint64_t start;    /* When the current one was due, or sent */
+	char request[REQUEST_MAX];
+	size_t request_length;
+	size_t request_sent;
+	char header[HEADER_MAX];
+	size_t header_length;
+	int header_done;
+	int status;
+	int server_closes;
+	size_t body_left;
+	size_t received;
+};
+
+/*
+ * A thread's share of the connections, and what it has measured.
+ */
+struct bench_thread {
+	pthread_t thread;
+	struct bench_target *target;
+	struct bench_conn *conns;
+	int conn_count;
+	int epfd;
+	uint64_t interval; /* Between each connection's requests, open loop */
+	uint64_t end;
+	uint32_t random;
+	struct bench_result result;
+};
+
+/*
+ * A request in the mix, chosen with probability in proportion to it's
+ * weight. |cumulative| is the sum of the weights up to and including it.
+ */
+struct mix_entry {
+	char *path;
+	double cumulative;
+};
+
+
+/* The options, the same for every server */
+int conns = BENCH_CONNS;
+int threads = BENCH_THREADS;
+int seconds = BENCH_SECONDS;
+double rate = 0;      /* Requests per second for the open loop, 0 = closed */
+int per_conn = 0;     /* Requests to make on a connection, 0 = no limit */
+uint32_t seed = 2463534242u;
+struct mix_entry *mix;
+int mix_count;
+
+
+/* Private function forwards declarations */
+void print_usage(char *prog_name);
+uint64_t now_ns();
+uint32_t next_random(uint32_t *state);
+int hist_index(uint64_t value);
+uint64_t hist_value(int index);
+void hist_add(struct histogram *hist, uint64_t value);
+void hist_merge(struct histogram *into, struct histogram *from);
+uint64_t hist_percentile(struct histogram *hist, double percentile);
+int mix_add(const char *path, double weight);
+int mix_load(const char *filename);
+const char *mix_pick(uint32_t *random);
+int parse_target(struct bench_target *target, char *arg);
+void conn_close(struct bench_conn *conn);
+void conn_fail(struct bench_thread *thread, struct bench_conn *conn,
+	uint64_t now);
+void conn_start(struct bench_thread *thread, struct bench_conn *conn,
+	uint64_t now);
+void conn_finish(struct bench_thread *thread, struct bench_conn *conn,
+	uint64_t now);
+int conn_parse_header(struct bench_conn *conn, char *end);
+void conn_step(struct bench_thread *thread, struct bench_conn *conn,
+	uint32_t events);
+void *bench_thread_main(void *arg);
+void bench_run(struct bench_target *target);
+void print_results(struct bench_target *targets, int count);
+double random_normal(uint32_t *random);
+size_t random_file_size(uint32_t *random);
+int bench_generate(const char *root, const char *mix_file, int files);
+
+
+void print_usage(char *prog_name) {
+	printf("Usage: %s [options] [name=]host:port ...\n", prog_name);
+	printf("       %s -g rootdir -m mixfile [-n files]\n", prog_name);
+	printf("Options:\n");
+	printf("  -c conns    Connections to make requests on at once\n");
+	printf("  -t threads  Threads to share the connections between\n");
+	printf("  -d seconds  How long to run against each server\n");
+	printf("  -R rate     Open loop, at this many requests a second\n"
+	       "              altogether, rather than as fast as answered\n");
+	printf("  -k n        Requests to make on each connection before\n"
+	       "              making a new one, 0 = as many as the server lets\n");
+	printf("  -u path[=w] Add a path to the request mix, with weight w\n");
+	printf("  -m file     Add the paths in a file to the request mix, one\n"
+	       "              on each line with an optional weight after it\n");
+	printf("  -g dir      Make a server root of synthetic files in dir to\n"
+	       "              run against, and write it's mix to the -m file\n");
+	printf("  -n files    How many files -g makes\n");
+	printf("  -s seed     Seed for the random choices\n");
+}
+
+
+/*
+ * Get a monotonic time in nanoseconds.
+ */
+uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Get the next of a sequence of pseudo-random numbers (xorshift32).
+ */
+uint32_t next_random(uint32_t *state) {
+	uint32_t x;
+
+	x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+
+/*
+ * Get the histogram bucket that |value| goes in: Values below HIST_SUB
+ * have one each, then each power of two is split into HIST_SUB.
+ */
+int hist_index(uint64_t value) {
+	int shift;
+
+	if (value < HIST_SUB)
+		return (int)value;
+	shift = (63 - __builtin_clzll(value)) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (int)((value >> shift) - HIST_SUB);
+}
+
+
+/*
+ * Get the highest value that goes in bucket |index|.
+ */
+uint64_t hist_value(int index) {
+	int shift;
+
+	if (index < HIST_SUB)
+		return index;
+	shift = index / HIST_SUB - 1;
+	return (((uint64_t)HIST_SUB + index % HIST_SUB + 1) << shift) - 1;
+}
+
+
+void hist_add(struct histogram *hist, uint64_t value) {
+	++hist->counts[hist_index(value)];
+	++hist->total;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+
+void hist_merge(struct histogram *into, struct histogram *from) {
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		into->counts[i] += from->counts[i];
+	into->total += from->total;
+	if (from->max > into->max)
+		into->max = from->max;
+}
+
+
+/*
+ * Get the value that |percentile| percent of the histogram is at or below.
+ */
+uint64_t hist_percentile(struct histogram *hist, double percentile) {
+	uint64_t wanted;
+	uint64_t seen;
+	int i;
+
+	if (hist->total == 0)
+		return 0;
+	wanted = (uint64_t)ceil(hist->total * percentile / 100.0);
+	if (wanted == 0)
+		wanted = 1;
+	seen = 0;
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += hist->counts[i];
+		if (seen >= wanted)
+			break;
+	}
+
+	/* The top bucket is only as high as the highest value in it */
+	return (hist_value(i) > hist->max) ? hist->max : hist_value(i);
+}
+
+
+/*
+ * Add a path to the request mix.
+ * Returns 0 -> The mix is full, or the path is too long to request
+ *         1 -> Okay
+ */
+int mix_add(const char *path, double weight) {
+	double total;
+
+	if (mix_count == BENCH_MIX_MAX || strlen(path) > REQUEST_MAX - 128 ||
+		weight <= 0)
+	{
+		return 0;
+	}
+	if (!mix)
+		mix = malloc(BENCH_MIX_MAX * sizeof(struct mix_entry));
+
+	total = (mix_count > 0) ? mix[mix_count - 1].cumulative : 0;
+	mix[mix_count].path = strdup(path);
+	mix[mix_count].cumulative = total + weight;
+	++mix_count;
+	return 1;
+}
+
+
+/*
+ * Add the paths listed in a file to the request mix, each on a line of it's
+ * own with an optional weight after it. Lines starting with # are skipped.
+ * Returns 0 -> The file couldn't be read, or a line was bad
+ *         1 -> Okay
+ */
+int mix_load(const char *filename) {
+	char line[REQUEST_MAX];
+	char path[REQUEST_MAX];
+	double weight;
+	FILE *in;
+	int fields;
+	int okay;
+
+	if (!(in = fopen(filename, "r")))
+		return 0;
+
+	okay = 1;
+	while (okay && fgets(line, sizeof(line), in)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		weight = 1;
+		fields = sscanf(line, "%4095s %lf", path, &weight);
+		okay = (fields >= 1) && mix_add(path, weight);
+	}
+
+	fclose(in);
+	return okay;
+}
+
+
+/*
+ * Choose a path from the request mix, by weight.
+ */
+const char *mix_pick(uint32_t *random) {
+	double point;
+	int low;
+	int high;
+
+	point = (next_random(random) / 4294967296.0) *
+		mix[mix_count - 1].cumulative;
+	low = 0;
+	high = mix_count - 1;
+	while (low < high) {
+		int middle = (low + high) / 2;
+
+		if (mix[middle].cumulative > point)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return mix[low].path;
+}
+
+
+/*
+ * Parse a server to run against, as [name=]host:port, the host being an
+ * IPv4 address or "localhost".
+ * Returns 0 -> The argument was malformed
+ *         1 -> Okay
+ */
+int parse_target(struct bench_target *target, char *arg) {
+	char *equals;
+	char *colon;
+	int port;
+
+	memset(target, 0x0, sizeof(struct bench_target));
+	target->label = arg;
+	if ((equals = strchr(arg, '='))) {
+		*equals = '\0';
+		arg = equals + 1;
+	}
+
+	colon = strrchr(arg, ':');
+	if (!colon || colon == arg || (colon - arg) >= (int)sizeof(target->host))
+		return 0;
+	port = atoi(colon + 1);
+	if (port <= 0 || port > 65535)
+		return 0;
+	memcpy(target->host, arg, colon - arg);
+	target->host[colon - arg] = '\0';
+
+	target->addr.sin_family = AF_INET;
+	target->addr.sin_port = htons(port);
+	if (!strcmp(target->host, "localhost"))
+		target->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	else if (inet_pton(AF_INET, target->host, &target->addr.sin_addr) != 1)
+		return 0;
+	return 1;
+}
+
+
+void conn_close(struct bench_conn *conn) {
+	if (conn->fd >= 0) {
+		close(conn->fd);
+		conn->fd = -1;
+	}
+	conn->made = 0;
+}
+
+
+/*
+ * Count a failed request, and wait a little before trying again, so that a
+ * server that's down isn't hammered in the closed loop. In the open loop
+ * the next request is due when it was anyway.
+ */
+void conn_fail(struct bench_thread *thread, struct bench_conn *conn,
+	uint64_t now)
+{
+	++thread->result.errors;
+	conn_close(conn);
+	conn->state = CONN_IDLE;
+	if (rate == 0)
+		conn->due = now + RETRY_DELAY;
+}
+
+
+/*
+ * Make the connection's next request, connecting first if need be.
+ */
+void conn_start(struct bench_thread *thread, struct bench_conn *conn,
+	uint64_t now)
+{
+	struct epoll_event event;
+	int length;
+	int one;
+
+	/*
+	 * In the open loop it's late from when it was due, and the one after
+	 * is due an interval later, however late this one is.
+	 */
+	if (rate > 0) {
+		conn->start = conn->due;
+		conn->due += thread->interval;
+	} else {
+		conn->start = now;
+	}
+
+	/* Put the request together */
+	conn->close_after = (per_conn > 0) && (conn->made + 1 >= per_conn);
+	length = snprintf(conn->request, sizeof(conn->request),
+		"GET %s HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"User-Agent: bench\r\n"
+		"%s"
+		"\r\n",
+		mix_pick(&thread->random), thread->target->host,
+		conn->close_after ? "Connection: close\r\n" : "");
+	conn->request_length = length;
+	conn->request_sent = 0;
+	conn->header_length = 0;
+	conn->header_done = 0;
+	conn->received = 0;
+	conn->state = CONN_SENDING;
+
+	/* Start a new connection, the request goes once it's made */
+	if (conn->fd < 0) {
+		conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (conn->fd < 0) {
+			conn_fail(thread, conn, now);
+			return;
+		}
+		one = 1;
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		++thread->result.connects;
+
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.ptr = conn;
+		epoll_ctl(thread->epfd, EPOLL_CTL_ADD, conn->fd, &event);
+		if (connect(conn->fd, (struct sockaddr *)&thread->target->addr,
+			sizeof(struct sockaddr_in)) < 0)
+		{
+			if (errno != EINPROGRESS) {
+				conn_fail(thread, conn, now);
+				return;
+			}
+			conn->state = CONN_CONNECTING;
+			return;
+		}
+	}
+
+	conn_step(thread, conn, 0);
+}
+
+
+/*
+ * Count a complete response, and get ready for the next request.
+ */
+void conn_finish(struct bench_thread *thread, struct bench_conn *conn,
+	uint64_t now)
+{
+	hist_add(&thread->result.latency, (now - conn->start) / 1000);
+	++thread->result.requests;
+	if (conn->status >= 400)
+		++thread->result.bad_status;
+	thread->result.bytes += conn->received;
+
+	/* Close it if that was it's last request */
+	++conn->made;
+	if (conn->close_after || conn->server_closes)
+		conn_close(conn);
+	conn->state = CONN_IDLE;
+	if (rate == 0)
+		conn->due = now;
+}
+
+
+/*
+ * Parse the status, length, and Connection header of the response header
+ * in |conn|, which ends at |end|.
+ * Returns 0 -> The header was malformed
+ *         1 -> Okay
+ */
+int conn_parse_header(struct bench_conn *conn, char *end) {
+	char *line;
+	char saved;
+
+	if (sscanf(conn->header, "HTTP/1.%*d %d", &conn->status) != 1)
+		return 0;
+
+	/* Don't look past the header, into the body */
+	saved = *end;
+	*end = '\0';
+
+	/* A 304 never has a body, anything else says how long it's is */
+	conn->body_left = 0;
+	conn->server_closes = 0;
+	line = conn->header;
+	while ((line = strchr(line, '\n'))) {
+		++line;
+		if (!strncasecmp(line, "Content-Length:", 15) && conn->status != 304)
+			conn->body_left = strtoul(line + 15, NULL, 10);
+		else if (!strncasecmp(line, "Connection: close", 17))
+			conn->server_closes = 1;
+	}
+
+	*end = saved;
+	return 1;
+}
+
+
+/*
+ * Take a connection as far through it's request as it can go without
+ * blocking, after |events| happened on it's socket.
+ */
+void conn_step(struct bench_thread *thread, struct bench_conn *conn,
+	uint32_t events)
+{
+	char discard[65536];
+	socklen_t length;
+	ssize_t done;
+	char *blank;
+	int error;
+
+	for (;;) {
+		switch (conn->state) {
+		case CONN_CONNECTING:
+			/* Wait for it to be made, then send the request */
+			if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+				return;
+			length = sizeof(error);
+			if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error,
+				&length) < 0 || error != 0)
+			{
+				conn_fail(thread, conn, now_ns());
+				return;
+			}
+			conn->state = CONN_SENDING;
+			break;
+
+		case CONN_SENDING:
+			done = send(conn->fd, conn->request + conn->request_sent,
+				conn->request_length - conn->request_sent, MSG_NOSIGNAL);
+			if (done < 0 && errno == EAGAIN)
+				return;
+			if (done <= 0) {
+				conn_fail(thread, conn, now_ns());
+				return;
+			}
+			conn->request_sent += done;
+			if (conn->request_sent == conn->request_length)
+				conn->state = CONN_READING;
+			break;
+
+		case CONN_READING:
+			/* The header, then the body, which isn't kept */
+			if (!conn->header_done) {
+				done = recv(conn->fd, conn->header + conn->header_length,
+					sizeof(conn->header) - 1 - conn->header_length, 0);
+			} else {
+				done = recv(conn->fd, discard,
+					(conn->body_left < sizeof(discard)) ?
+						conn->body_left : sizeof(discard), 0);
+			}
+			if (done < 0 && errno == EAGAIN)
+				return;
+			if (done <= 0) {
+				conn_fail(thread, conn, now_ns());
+				return;
+			}
+			conn->received += done;
+
+			if (!conn->header_done) {
+				/* Is all of the header here yet? */
+				conn->header_length += done;
+				conn->header[conn->header_length] = '\0';
+				blank = strstr(conn->header, "\n\n");
+				if (!blank)
+					blank = strstr(conn->header, "\n\r\n");
+				if (!blank) {
+					if (conn->header_length == sizeof(conn->header) - 1) {
+						conn_fail(thread, conn, now_ns());
+						return;
+					}
+					break;
+				}
+				blank += (blank[1] == '\n') ? 2 : 3;
+				if (!conn_parse_header(conn, blank)) {
+					conn_fail(thread, conn, now_ns());
+					return;
+				}
+
+				/* Some of the body may have come in with it */
+				done = (conn->header + conn->header_length) - blank;
+				if ((size_t)done > conn->body_left) {
+					/* Only one request is made at a time */
+					conn_fail(thread, conn, now_ns());
+					return;
+				}
+				conn->body_left -= done;
+				conn->header_done = 1;
+			} else {
+				conn->body_left -= done;
+			}
+
+			if (conn->body_left == 0) {
+				conn_finish(thread, conn, now_ns());
+				return;
+			}
+			break;
+
+		default:
+			return;
+		}
+	}
+}
+
+
+/*
+ * Make requests on a thread's share of the connections until the end of
+ * the run.
+ */
+void *bench_thread_main(void *arg) {
+	struct bench_thread *thread = arg;
+	struct epoll_event events[256];
+	struct bench_conn *conn;
+	uint64_t now;
+	uint64_t next;
+	int timeout;
+	int count;
+	int i;
+
+	for (;;) {
+		/* Start the requests that are due, and see when the next is */
+		now = now_ns();
+		if (now >= thread->end)
+			break;
+		next = thread->end;
+		for (i = 0; i < thread->conn_count; ++i) {
+			conn = &thread->conns[i];
+			if (conn->state != CONN_IDLE)
+				continue;
+			if (conn->due <= now)
+				conn_start(thread, conn, now);
+			if (conn->state == CONN_IDLE && conn->due < next)
+				next = conn->due;
+		}
+
+		/* Then wait for that, or for the servers */
+		now = now_ns();
+		timeout = (next > now) ? (int)((next - now + 999999) / 1000000) : 0;
+		count = epoll_wait(thread->epfd, events, 256, timeout);
+		for (i = 0; i < count; ++i)
+			conn_step(thread, events[i].data.ptr, events[i].events);
+	}
+
+	for (i = 0; i < thread->conn_count; ++i)
+		conn_close(&thread->conns[i]);
+	return NULL;
+}
+
+
+/*
+ * Run against a server for the length of the run, and gather up what each
+ * thread measured into it's result.
+ */
+void bench_run(struct bench_target *target) {
+	struct bench_thread *workers;
+	struct bench_conn *all;
+	uint64_t start;
+	uint64_t interval;
+	int first;
+	int i;
+	int j;
+
+	workers = calloc(threads, sizeof(struct bench_thread));
+	all = calloc(conns, sizeof(struct bench_conn));
+	interval = (rate > 0) ? (uint64_t)(conns * 1e9 / rate) : 0;
+	start = now_ns();
+
+	/* Share the connections out, and spread the open loop's requests */
+	first = 0;
+	for (i = 0; i < threads; ++i) {
+		struct bench_thread *thread = &workers[i];
+
+		thread->target = target;
+		thread->conns = all + first;
+		thread->conn_count = conns / threads + (i < conns % threads);
+		thread->epfd = epoll_create1(0);
+		thread->interval = interval;
+		thread->end = start + (uint64_t)seconds * 1000000000;
+		thread->random = (seed + i * 7919) | 1;
+		for (j = 0; j < thread->conn_count; ++j) {
+			thread->conns[j].fd = -1;
+			thread->conns[j].due = start + interval * (first + j) / conns;
+		}
+		first += thread->conn_count;
+		pthread_create(&thread->thread, NULL, bench_thread_main, thread);
+	}
+
+	memset(&target->result, 0x0, sizeof(struct bench_result));
+	for (i = 0; i < threads; ++i) {
+		struct bench_result *from = &workers[i].result;
+
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].epfd);
+		hist_merge(&target->result.latency, &from->latency);
+		target->result.requests += from->requests;
+		target->result.bad_status += from->bad_status;
+		target->result.errors += from->errors;
+		target->result.connects += from->connects;
+		target->result.bytes += from->bytes;
+	}
+	target->result.seconds = (now_ns() - start) / 1e9;
+
+	free(all);
+	free(workers);
+}
+
+
+/*
+ * Print how each server did, in a column each.
+ */
+void print_results(struct bench_target *targets, int count) {
+	static const double percentiles[5] = { 50, 90, 99, 99.9, 99.99 };
+	struct bench_result *result;
+	int i;
+	int j;
+
+	printf("\n%-16s", "");
+	for (i = 0; i < count; ++i)
+		printf(" %16.16s", targets[i].label);
+	printf("\n%-16s", "requests/s");
+	for (i = 0; i < count; ++i) {
+		result = &targets[i].result;
+		printf(" %16.1f", result->requests / result->seconds);
+	}
+	printf("\n%-16s", "MB/s");
+	for (i = 0; i < count; ++i) {
+		result = &targets[i].result;
+		printf(" %16.2f", result->bytes / result->seconds / 1048576);
+	}
+	printf("\n%-16s", "requests");
+	for (i = 0; i < count; ++i)
+		printf(" %16llu", (unsigned long long)targets[i].result.requests);
+	printf("\n%-16s", "4xx/5xx");
+	for (i = 0; i < count; ++i)
+		printf(" %16llu", (unsigned long long)targets[i].result.bad_status);
+	printf("\n%-16s", "errors");
+	for (i = 0; i < count; ++i)
+		printf(" %16llu", (unsigned long long)targets[i].result.errors);
+	printf("\n%-16s", "connections");
+	for (i = 0; i < count; ++i)
+		printf(" %16llu", (unsigned long long)targets[i].result.connects);
+
+	for (j = 0; j < 5; ++j) {
+		printf("\nlatency p%-7g", percentiles[j]);
+		for (i = 0; i < count; ++i) {
+			printf(" %13.3f ms", hist_percentile(&targets[i].result.latency,
+				percentiles[j]) / 1000.0);
+		}
+	}
+	printf("\n%-16s", "latency max");
+	for (i = 0; i < count; ++i)
+		printf(" %13.3f ms", targets[i].result.latency.max / 1000.0);
+	printf("\n");
+}
+
+
+/*
+ * Get a normally distributed random number, mean 0 and deviation 1.
+ */
+double random_normal(uint32_t *random) {
+	double u;
+	double v;
+
+	u = (next_random(random) + 1.0) / 4294967297.0;
+	v = next_random(random) / 4294967296.0;
+	return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+
+/*
+ * Get a size for a synthetic file, the way web content is spread: Mostly
+ * lognormal around 8 KB, with a heavy (Pareto) tail of big files.
+ */
+size_t random_file_size(uint32_t *random) {
+	double size;
+	double u;
+
+	if (next_random(random) % 100 < 7) {
+		u = (next_random(random) + 1.0) / 4294967297.0;
+		size = 128 * 1024 / pow(u, 1 / 1.2);
+	} else {
+		size = exp(log(8 * 1024) + 1.3 * random_normal(random));
+	}
+	if (size > 32 * 1024 * 1024)
+		size = 32 * 1024 * 1024;
+	return (size_t)size + 1;
+}
+
+
+/*
+ * Fill a directory with synthetic files to serve, spread over a few
+ * subdirectories with the usual kinds of names, and write the request mix
+ * for them to |mix_file|. How often each is asked for follows Zipf's law,
+ * in a random order so that it has nothing to do with their sizes.
+ * Returns 0 -> Something couldn't be written
+ *         1 -> Okay
+ */
+int bench_generate(const char *root, const char *mix_file, int files) {
+	static const char *extensions[5] = { "html", "css", "js", "png", "jpg" };
+	char path[PATH_MAX];
+	char block[4096];
+	size_t size;
+	size_t n;
+	uint32_t random;
+	int *rank;
+	FILE *out;
+	FILE *mix_out;
+	int i;
+	int j;
+
+	random = seed | 1;
+	for (i = 0; i < (int)sizeof(block); ++i)
+		block[i] = 'a' + next_random(&random) % 26;
+	if (!(mix_out = fopen(mix_file, "w")))
+		return 0;
+	mkdir(root, 0755);
+
+	/* Shuffle the popularity ranks */
+	rank = malloc(files * sizeof(int));
+	for (i = 0; i < files; ++i)
+		rank[i] = i + 1;
+	for (i = files - 1; i > 0; --i) {
+		j = next_random(&random) % (i + 1);
+		n = rank[i];
+		rank[i] = rank[j];
+		rank[j] = n;
+	}
+
+	fprintf(mix_out, "# %d files in %s\n", files, root);
+	for (i = 0; i < files; ++i) {
+		snprintf(path, sizeof(path), "%s/d%d", root, i % 10);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/d%d/f%d.%s", root, i % 10, i,
+			extensions[i % 5]);
+		if (!(out = fopen(path, "w"))) {
+			fclose(mix_out);
+			free(rank);
+			return 0;
+		}
+		for (size = random_file_size(&random); size > 0; size -= n) {
+			n = (size < sizeof(block)) ? size : sizeof(block);
+			fwrite(block, 1, n, out);
+		}
+		fclose(out);
+		fprintf(mix_out, "/d%d/f%d.%s %.6f\n", i % 10, i, extensions[i % 5],
+			1.0 / rank[i]);
+	}
+
+	free(rank);
+	return fclose(mix_out) == 0;
+}
+
+
+/* Main program entry point */
+int main(int argc, char *argv[]) {
+	struct bench_target targets[BENCH_TARGET_MAX];
+	char *generate;
+	char *mix_file;
+	char *equals;
+	int files;
+	int count;
+	int opt;
+	int i;
+
+	generate = NULL;
+	mix_file = NULL;
+	files = BENCH_FILES;
+	while ((opt = getopt(argc, argv, "c:t:d:R:k:u:m:g:n:s:")) != -1) {
+		switch (opt) {
+		case 'c':
+			conns = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'R':
+			rate = atof(optarg);
+			break;
+		case 'k':
+			per_conn = atoi(optarg);
+			break;
+		case 'u':
+			if ((equals = strrchr(optarg, '=')))
+				*equals = '\0';
+			if (!mix_add(optarg, equals ? atof(equals + 1) : 1)) {
+				fprintf(stderr, "Bad path %s.\n", optarg);
+				return -1;
+			}
+			break;
+		case 'm':
+			mix_file = optarg;
+			break;
+		case 'g':
+			generate = optarg;
+			break;
+		case 'n':
+			files = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			print_usage(argv[0]);
+			return -1;
+		}
+	}
+
+	/* Make a server root, rather than running */
+	if (generate) {
+		if (!mix_file || files <= 0) {
+			print_usage(argv[0]);
+			return -1;
+		}
+		if (!bench_generate(generate, mix_file, files)) {
+			fprintf(stderr, "Could not generate %s.\n", generate);
+			return -1;
+		}
+		printf("Made %d files in %s, their mix is in %s\n", files,
+			generate, mix_file);
+		return 0;
+	}
+
+	/* Check the rest of the options, and get the servers */
+	count = argc - optind;
+	if (count < 1 || count > BENCH_TARGET_MAX || conns <= 0 ||
+		threads <= 0 || threads > conns || seconds <= 0 || rate < 0 ||
+		per_conn < 0)
+	{
+		print_usage(argv[0]);
+		return -1;
+	}
+	for (i = 0; i < count; ++i) {
+		if (!parse_target(&targets[i], argv[optind + i])) {
+			fprintf(stderr, "Bad server %s.\n", argv[optind + i]);
+			return -1;
+		}
+	}
+	if (mix_file && !mix_load(mix_file)) {
+		fprintf(stderr, "Could not read the mix from %s.\n", mix_file);
+		return -1;
+	}
+	if (mix_count == 0)
+		mix_add("/index.html", 1);
+
+	/* Run against each in turn */
+	for (i = 0; i < count; ++i) {
+		printf("%s: %d connections, %d s, %s...\n", targets[i].label,
+			conns, seconds, (rate > 0) ? "open loop" : "closed loop");
+		fflush(stdout);
+		bench_run(&targets[i]);
+	}
+	print_results(targets, count);
+	return 0;
+}
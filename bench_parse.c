@@ -0,0 +1,556 @@
+#include "server_http.h"
+#include "http_request.h"
+#include "http_scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define BENCH_TSC
+#endif
+
+/*
+ * bench_parse: Time the request lexer, and the functions that each request
+ * goes through on it's way to a file, for each way of scanning that the CPU
+ * supports where that matters.
+ * Usage: bench_parse [rounds]
+ * Each benchmark makes |rounds| passes over a corpus of inputs, either the
+ * ones that browsers, tools and crawlers really send ("real") or ones made
+ * to be as slow as possible, such as very long headers and deep ../ paths
+ * ("worst", which get a tenth of the rounds). The lexer goes through
+ * http_conn_recv on pipelined copies of a browser request, the same as a
+ * connection would, without a socket.
+ * The results are one line per benchmark, tab separated, always in the
+ * same order so that runs can be diffed:
+ *   benchmark corpus scan ops bytes/op ns/op cycles/byte allocs/op
+ * Where scan is "-" for the functions that don't scan, and cycles are time
+ * stamp counter ticks (0 if there isn't one). Allocations are counted by
+ * the __wrap_ functions here, the makefile links malloc, calloc and realloc
+ * through them.
+ */
+
+/* How many copies of the request there are in the buffer */
+#define BENCH_COPIES 64
+
+/* Rounds to run if not given */
+#define BENCH_ROUNDS 20000
+
+/* The most inputs a corpus can have */
+#define BENCH_CORPUS_MAX 32
+
+/* The functions there are to time, for bench_corpus */
+#define BENCH_PARSE_METHOD 0
+#define BENCH_PARSE_HEADER 1
+#define BENCH_SIZE_T       2
+#define BENCH_CHECK_PATH   3
+
+
+/* A request as a desktop browser sends it, around 700 bytes */
+const char *bench_request =
+	"GET /assets/js/app.bundle.min.js?v=20240611 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+		"\"Not-A.Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+		"AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 "
+		"Safari/537.36\r\n"
+	"sec-ch-ua-platform: \"Windows\"\r\n"
+	"Accept: */*\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: script\r\n"
+	"Referer: https://www.example.com/products/overview\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+	"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; "
+		"theme=dark; _ga=GA1.2.1234567890.1700000000\r\n"
+	"If-None-Match: \"ce802d-6ad3afeb-6\"\r\n"
+	"\r\n";
+
+
+/* Request lines from browsers, curl, crawlers and monitoring */
+const char *real_methods[] = {
+	"GET / HTTP/1.1\r\n",
+	"GET /index.html HTTP/1.1\r\n",
+	"GET /assets/js/app.bundle.min.js?v=20240611 HTTP/1.1\r\n",
+	"GET /images/products/2024/hero-banner@2x.webp HTTP/1.1\r\n",
+	"GET /favicon.ico HTTP/1.1\r\n",
+	"GET /robots.txt HTTP/1.0\r\n",
+	"GET /search?q=http+server&page=2&sort=relevance&lang=en HTTP/1.1\r\n",
+	"HEAD /health HTTP/1.1\r\n",
+	"POST /api/v1/events HTTP/1.1\r\n",
+	"GET /wp-login.php HTTP/1.1\n",
+	NULL
+};
+
+/* Headers from the same sort of clients */
+const char *real_headers[] = {
+	"Host: www.example.com\r\n",
+	"Connection: keep-alive\r\n",
+	"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+		"AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 "
+		"Safari/537.36\r\n",
+	"User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10.15; rv:125.0) "
+		"Gecko/20100101 Firefox/125.0\r\n",
+	"User-Agent: curl/8.5.0\r\n",
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+		"image/avif,image/webp,*/*;q=0.8\r\n",
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n",
+	"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n",
+	"Referer: https://www.example.com/products/overview\r\n",
+	"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; "
+		"_ga=GA1.2.1234567890.1700000000\r\n",
+	"If-None-Match: \"ce802d-6ad3afeb-6\"\r\n",
+	"If-Modified-Since: Sat, 29 Oct 1994 19:43:31 GMT\r\n",
+	"Range: bytes=0-1023\r\n",
+	"sec-ch-ua-mobile: ?0\r\n",
+	"Upgrade-Insecure-Requests: 1\r\n",
+	"Content-Length: 348\r\n",
+	NULL
+};
+
+/* Content-Length values that get sent */
+const char *real_sizes[] = {
+	"0", "7", "348", "1024", "65536", "1048576", "104857600", NULL
+};
+
+/* Paths that get asked for, and the usual tries at getting out of root */
+const char *real_paths[] = {
+	"/",
+	"/index.html",
+	"/assets/js/app.bundle.min.js",
+	"/images/products/2024/hero-banner@2x.webp",
+	"/docs/guide/../reference/./http.html",
+	"/../../etc/passwd",
+	"/static\\css\\site.css",
+	"/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t/u/v/w/x/y/z.txt",
+	NULL
+};
+
+/* Times to format, from the epoch to well after now */
+const time_t real_times[] = {
+	0, 784111777, 1000000000, 1700000000, 1718064000, 2000000000,
+};
+
+
+/* How many allocations there have been, see __wrap_malloc */
+long allocations;
+
+/* Keeps the results of what's being timed from being optimized away */
+volatile size_t bench_sink;
+
+
+/* Private to their own files, but worth timing */
+int check_path(char *path);
+void format_date(char *buffer, size_t len, time_t t);
+
+
+/* Private function forwards declarations */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+double bench_now();
+unsigned long long bench_cycles();
+char *bench_repeat(const char *start, const char *unit, int count,
+	const char *end);
+int bench_copy(char **items, const char **corpus);
+void bench_report(const char *name, const char *corpus, const char *scan,
+	long ops, size_t bytes, double seconds, unsigned long long cycles,
+	long allocs);
+double bench_lex(char *input, char *copy, size_t size, int rounds);
+void bench_lexer(int rounds);
+void bench_corpus(int what, char **items, int count, int rounds);
+void bench_function(const char *name, int what, const char *corpus,
+	const char *scan, char **items, int count, int rounds);
+void bench_format_date(int rounds);
+
+
+/*
+ * Count the allocations made on the way to the real functions.
+ */
+void *__wrap_malloc(size_t size) {
+	++allocations;
+	return __real_malloc(size);
+}
+
+
+void *__wrap_calloc(size_t count, size_t size) {
+	++allocations;
+	return __real_calloc(count, size);
+}
+
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	++allocations;
+	return __real_realloc(ptr, size);
+}
+
+
+/*
+ * Get a monotonic time in seconds.
+ */
+double bench_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Read the time stamp counter, if there is one.
+ */
+unsigned long long bench_cycles() {
+#ifdef BENCH_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+
+/*
+ * Make a string of |start|, |count| copies of |unit|, then |end|.
+ */
+char *bench_repeat(const char *start, const char *unit, int count,
+	const char *end)
+{
+	size_t start_length;
+	size_t unit_length;
+	char *result;
+	char *ptr;
+	int i;
+
+	start_length = strlen(start);
+	unit_length = strlen(unit);
+	result = malloc(start_length + unit_length * count + strlen(end) + 1);
+	memcpy(result, start, start_length);
+	ptr = result + start_length;
+	for (i = 0; i < count; ++i) {
+		memcpy(ptr, unit, unit_length);
+		ptr += unit_length;
+	}
+	strcpy(ptr, end);
+	return result;
+}
+
+
+/*
+ * Copy a NULL terminated |corpus| into |items|, which check_path needs
+ * since it writes to the path.
+ * Returns: How many there are
+ */
+int bench_copy(char **items, const char **corpus) {
+	int count;
+
+	for (count = 0; corpus[count]; ++count)
+		items[count] = strdup(corpus[count]);
+	return count;
+}
+
+
+/*
+ * Write out a line of results, for |ops| calls on |bytes| each.
+ */
+void bench_report(const char *name, const char *corpus, const char *scan,
+	long ops, size_t bytes, double seconds, unsigned long long cycles,
+	long allocs)
+{
+	printf("%s\t%s\t%s\t%ld\t%lu\t%.1f\t%.3f\t%.3f\n", name, corpus, scan,
+		ops, (unsigned long)bytes, seconds * 1e9 / ops,
+		bytes ? (double)cycles / ((double)bytes * ops) : 0.0,
+		(double)allocs / ops);
+}
+
+
+/*
+ * Lex |rounds| rounds of the copies of the request in |input|, using |copy|
+ * as the connection's buffer (the lexer writes into it).
+ * Returns: The time taken in seconds, or -1 if a request didn't lex.
+ */
+double bench_lex(char *input, char *copy, size_t size, int rounds) {
+	struct http_conn conn;
+	char *buffer;
+	size_t capacity;
+	double start;
+	int round;
+	int i;
+
+	start = bench_now();
+	for (round = 0; round < rounds; ++round) {
+		/* Serve the copies out of our own buffer */
+		memcpy(copy, input, size);
+		http_conn_init(&conn, -1, "127.0.0.1");
+		buffer = conn.buffer;
+		capacity = conn.buffer_capacity;
+		conn.buffer = copy;
+		conn.buffer_capacity = size;
+		conn.buffer_size = size;
+
+		for (i = 0; i < BENCH_COPIES; ++i) {
+			if (http_conn_recv(&conn) != HTTP_CONN_DONE)
+				return -1;
+			conn.keep_alive = 1;
+			http_conn_next(&conn);
+		}
+
+		conn.buffer = buffer;
+		conn.buffer_capacity = capacity;
+		http_conn_destroy(&conn);
+	}
+
+	return bench_now() - start;
+}
+
+
+/*
+ * Time the lexer with each way of scanning, less what refilling the buffer
+ * each round costs, which isn't the lexer's.
+ */
+void bench_lexer(int rounds) {
+	static const int hows[3] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+	unsigned long long cycles;
+	char *input;
+	char *copy;
+	size_t length;
+	size_t size;
+	double copy_time;
+	double time;
+	double start;
+	long allocs;
+	int i;
+
+	/* The pipelined copies, and room for the lexer to work on them */
+	length = strlen(bench_request);
+	size = length * BENCH_COPIES;
+	input = malloc(size + 1);
+	copy = malloc(size + 1);
+	for (i = 0; i < BENCH_COPIES; ++i)
+		memcpy(input + i * length, bench_request, length);
+
+	start = bench_now();
+	for (i = 0; i < rounds; ++i) {
+		memcpy(copy, input, size);
+		__asm__ __volatile__("" : : "r"(copy) : "memory");
+	}
+	copy_time = bench_now() - start;
+
+	for (i = 0; i < 3; ++i) {
+		if (!scan_use(hows[i]))
+			continue;
+
+		/* Warm up, then time it */
+		bench_lex(input, copy, size, rounds / 10 + 1);
+		allocs = allocations;
+		cycles = bench_cycles();
+		time = bench_lex(input, copy, size, rounds);
+		cycles = bench_cycles() - cycles;
+		allocs = allocations - allocs;
+		if (time < 0) {
+			fprintf(stderr, "%s failed to lex the request\n", scan_name());
+			exit(-1);
+		}
+
+		/* Take the copying out of the cycles in the same proportion */
+		bench_report("http_conn_recv", "pipelined", scan_name(),
+			(long)rounds * BENCH_COPIES, length, time - copy_time,
+			cycles * ((time - copy_time) / time), allocs);
+	}
+
+	free(input);
+	free(copy);
+}
+
+
+/*
+ * Run one of the functions over each of the |count| inputs in |items|,
+ * |rounds| times over.
+ */
+void bench_corpus(int what, char **items, int count, int rounds) {
+	struct http_method method;
+	struct http_header header;
+	size_t lengths[BENCH_CORPUS_MAX];
+	size_t value;
+	int round;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		lengths[i] = strlen(items[i]);
+
+	for (round = 0; round < rounds; ++round) {
+		for (i = 0; i < count; ++i) {
+			switch (what) {
+			case BENCH_PARSE_METHOD:
+				bench_sink += parse_method(&method, items[i], lengths[i]);
+				bench_sink += method.url.length;
+				break;
+			case BENCH_PARSE_HEADER:
+				bench_sink += parse_header(&header, items[i], lengths[i]);
+				bench_sink += header.value.length;
+				break;
+			case BENCH_SIZE_T:
+				header.value.ptr = items[i];
+				header.value.length = lengths[i];
+				if (header_value_as_size_t(&header, &value, HTTP_BODY_MAX))
+					bench_sink += value;
+				break;
+			case BENCH_CHECK_PATH:
+				bench_sink += check_path(items[i]);
+				break;
+			}
+		}
+	}
+}
+
+
+/*
+ * Warm up and time one of the functions over a corpus, and report it.
+ */
+void bench_function(const char *name, int what, const char *corpus,
+	const char *scan, char **items, int count, int rounds)
+{
+	unsigned long long cycles;
+	size_t bytes;
+	double time;
+	long allocs;
+	int i;
+
+	bytes = 0;
+	for (i = 0; i < count; ++i)
+		bytes += strlen(items[i]);
+
+	bench_corpus(what, items, count, rounds / 10 + 1);
+	allocs = allocations;
+	cycles = bench_cycles();
+	time = bench_now();
+	bench_corpus(what, items, count, rounds);
+	time = bench_now() - time;
+	cycles = bench_cycles() - cycles;
+	allocs = allocations - allocs;
+
+	bench_report(name, corpus, scan, (long)rounds * count, bytes / count,
+		time, cycles, allocs);
+}
+
+
+/*
+ * Time format_date, which takes a time rather than a string. The bytes are
+ * those of the date written.
+ */
+void bench_format_date(int rounds) {
+	unsigned long long cycles;
+	char date[64];
+	size_t count;
+	double time;
+	long allocs;
+	int round;
+	int i;
+
+	count = sizeof(real_times) / sizeof(time_t);
+	for (round = 0; round < rounds / 10 + 1; ++round) {
+		for (i = 0; i < count; ++i)
+			format_date(date, sizeof(date), real_times[i]);
+	}
+
+	allocs = allocations;
+	cycles = bench_cycles();
+	time = bench_now();
+	for (round = 0; round < rounds; ++round) {
+		for (i = 0; i < count; ++i) {
+			format_date(date, sizeof(date), real_times[i]);
+			bench_sink += date[0];
+		}
+	}
+	time = bench_now() - time;
+	cycles = bench_cycles() - cycles;
+	allocs = allocations - allocs;
+
+	bench_report("format_date", "real", "-", (long)rounds * count,
+		strlen(date), time, cycles, allocs);
+}
+
+
+/* Main program entry point */
+int main(int argc, char *argv[]) {
+	static const int hows[3] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+	char *methods[BENCH_CORPUS_MAX];
+	char *headers[BENCH_CORPUS_MAX];
+	char *sizes[BENCH_CORPUS_MAX];
+	char *paths[BENCH_CORPUS_MAX];
+	char *worst_methods[2];
+	char *worst_headers[2];
+	char *worst_sizes[2];
+	char *worst_paths[2];
+	int method_count;
+	int header_count;
+	int size_count;
+	int path_count;
+	int rounds;
+	int i;
+
+	rounds = BENCH_ROUNDS;
+	if (argc > 2 || (argc == 2 && (rounds = atoi(argv[1])) <= 0)) {
+		printf("Usage: %s [rounds]\n", argv[0]);
+		return -1;
+	}
+
+	method_count = bench_copy(methods, real_methods);
+	header_count = bench_copy(headers, real_headers);
+	size_count = bench_copy(sizes, real_sizes);
+	path_count = bench_copy(paths, real_paths);
+
+	/* A 4 KB url, and a request line that's nearly all spaces */
+	worst_methods[0] = bench_repeat("GET /", "abcdefghijklmnop", 256,
+		" HTTP/1.1\r\n");
+	worst_methods[1] = bench_repeat("GET", " ", 4096,
+		"/index.html HTTP/1.1\r\n");
+
+	/* An 8 KB cookie, and a header nearly as long as a request can be */
+	worst_headers[0] = bench_repeat("Cookie: ", "k=0123456789abcdef; ",
+		410, "\r\n");
+	worst_headers[1] = bench_repeat("X-Padding: ", "a",
+		HTTP_REQUEST_MAX - 64, "\r\n");
+
+	/* Too big for a size_t, and a long run of leading zeros */
+	worst_sizes[0] = bench_repeat("", "9", 40, "");
+	worst_sizes[1] = bench_repeat("", "0", 4096, "1");
+
+	/* Deep ../ paths, that stay within the root, and that get out of it */
+	worst_paths[0] = bench_repeat("", "/a/..", 800, "/index.html");
+	worst_paths[1] = bench_repeat("", "/a\\..\\..", 800, "/index.html");
+
+	printf("benchmark\tcorpus\tscan\tops\tbytes/op\tns/op\tcycles/byte\t"
+		"allocs/op\n");
+	bench_lexer(rounds);
+
+	/* The parsers scan, time them with each way of scanning */
+	for (i = 0; i < 3; ++i) {
+		if (!scan_use(hows[i]))
+			continue;
+
+		bench_function("parse_method", BENCH_PARSE_METHOD, "real",
+			scan_name(), methods, method_count, rounds);
+		bench_function("parse_method", BENCH_PARSE_METHOD, "worst",
+			scan_name(), worst_methods, 2, rounds / 10 + 1);
+		bench_function("parse_header", BENCH_PARSE_HEADER, "real",
+			scan_name(), headers, header_count, rounds);
+		bench_function("parse_header", BENCH_PARSE_HEADER, "worst",
+			scan_name(), worst_headers, 2, rounds / 10 + 1);
+	}
+
+	bench_function("header_value_as_size_t", BENCH_SIZE_T, "real", "-",
+		sizes, size_count, rounds);
+	bench_function("header_value_as_size_t", BENCH_SIZE_T, "worst", "-",
+		worst_sizes, 2, rounds / 10 + 1);
+	bench_function("check_path", BENCH_CHECK_PATH, "real", "-",
+		paths, path_count, rounds);
+	bench_function("check_path", BENCH_CHECK_PATH, "worst", "-",
+		worst_paths, 2, rounds / 10 + 1);
+	bench_format_date(rounds);
+
+	return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef BINARY_LOG_H_
+#define BINARY_LOG_H_
+
+
+#include <stdint.h>
+
+
+/* Marks the start of every record, to catch a corrupt (or text) log */
+#define BINLOG_MAGIC 0xB10C
+
+/*
+ * The status of a response that was cut off while it's header was being
+ * sent, which the text log calls "Connection unexpectedly terminated".
+ */
+#define BINLOG_STATUS_TERMINATED 0
+
+
+/*
+ * The fixed-width header of a record in the binary log format, written in
+ * the server's byte order (other than the address). It is followed by the
+ * request's method, url, and version, with the lengths given.
+ * A binary log converts back to the text log with the logconv tool.
+ */
+struct binlog_record {
+	uint16_t magic;
+	uint16_t status;          /* The HTTP status code of the response */
+	uint32_t time;            /* When the response was made, unix time */
+	uint32_t addr;            /* IPv4 address, in network byte order */
+	uint16_t url_length;
+	uint8_t method_length;
+	uint8_t version_length;
+	uint64_t bytes_sent;      /* How much of the file was sent, for a 200 */
+	uint64_t bytes_total;     /* or 206, and how much there was to send */
+};
+
+
+#endif
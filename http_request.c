@@ -1,6 +1,25 @@
 
 #include "http_request.h"
 
+#include "http_scan.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+
+/* States for chunked_decode to be in */
+#define CHUNKED_SIZE     0 /* Reading the size of the next chunk */
+#define CHUNKED_EXT      1 /* Skipping to the end of the size line */
+#define CHUNKED_DATA     2 /* Reading the contents of the chunk */
+#define CHUNKED_DATA_END 3 /* Expecting the line end after the contents */
+#define CHUNKED_TRAILER  4 /* Skipping trailers, up to an empty line */
+
+
+/* Private function forwards declarations */
+int parse_range_number(char **ptr, char *after, size_t *value);
+int hex_digit(char c);
+
 
 int parse_method(struct http_method *method,
 	char *source_buffer, size_t source_length)
@@ -15,8 +34,7 @@ int parse_method(struct http_method *method,
 	start = ptr;
 
 	/* Get method */
-	while ((ptr < after) && (*ptr != ' '))
-		++ptr;
+	ptr = scan_for(ptr, after, ' ');
 	method->method.ptr = start;
 	method->method.length = (ptr - start);
 
@@ -26,8 +44,7 @@ int parse_method(struct http_method *method,
 	start = ptr;
 
 	/* Get url */
-	while ((ptr < after) && (*ptr != ' '))
-		++ptr;
+	ptr = scan_for(ptr, after, ' ');
 	method->url.ptr = start;
 	method->url.length = (ptr - start);
 
@@ -37,8 +54,7 @@ int parse_method(struct http_method *method,
 	start = ptr;
 
 	/* Get version */
-	while ((ptr < after) && (*ptr != '\n') && (*ptr != '\r'))
-		++ptr;
+	ptr = scan_for2(ptr, after, '\n', '\r');
 	method->version.ptr = start;
 	method->version.length = (ptr - start);
 
@@ -65,8 +81,7 @@ int parse_header(struct http_header *header,
 	start = ptr;
 
 	/* Get header label */
-	while ((ptr < after) && (*ptr != ':'))
-		++ptr;
+	ptr = scan_for(ptr, after, ':');
 	header->label.ptr = start;
 	header->label.length = (ptr - start);
 
@@ -77,8 +92,7 @@ int parse_header(struct http_header *header,
 
 		/* Get the header value */
 		start = ptr;
-		while ((ptr < after) && (*ptr != '\n') && (*ptr != '\r'))
-			++ptr;
+		ptr = scan_for2(ptr, after, '\n', '\r');
 		header->value.ptr = start;
 		header->value.length = (ptr - start);
 
@@ -95,21 +109,63 @@ int parse_header(struct http_header *header,
 }
 
 
+void method_to_offsets(struct http_method_offsets *offsets,
+	struct http_method *method, char *base)
+{
+	offsets->method.offset = method->method.ptr - base;
+	offsets->method.length = method->method.length;
+	offsets->url.offset = method->url.ptr - base;
+	offsets->url.length = method->url.length;
+	offsets->version.offset = method->version.ptr - base;
+	offsets->version.length = method->version.length;
+}
+
+
+void method_from_offsets(struct http_method *method,
+	struct http_method_offsets *offsets, char *base)
+{
+	method->method.ptr = base + offsets->method.offset;
+	method->method.length = offsets->method.length;
+	method->url.ptr = base + offsets->url.offset;
+	method->url.length = offsets->url.length;
+	method->version.ptr = base + offsets->version.offset;
+	method->version.length = offsets->version.length;
+}
+
+
+void header_to_offsets(struct http_header_offsets *offsets,
+	struct http_header *header, char *base)
+{
+	offsets->label.offset = header->label.ptr - base;
+	offsets->label.length = header->label.length;
+	offsets->value.offset = header->value.ptr - base;
+	offsets->value.length = header->value.length;
+}
+
+
+void header_from_offsets(struct http_header *header,
+	struct http_header_offsets *offsets, char *base)
+{
+	header->label.ptr = base + offsets->label.offset;
+	header->label.length = offsets->label.length;
+	header->value.ptr = base + offsets->value.offset;
+	header->value.length = offsets->value.length;
+}
+
+
 int header_value_as_size_t(struct http_header *header, 
 	size_t *len, size_t max_len) 
 {
-	long n;
 	size_t value;
-	int i;
+	size_t i;
 
 	/* Must have a value */
 	if (header->value.length == 0)
 		return 0;
 
 	/* Parse value */
-	n = 1;
 	value = 0;
-	for (i = header->value.length-1; i >= 0; --i) {
+	for (i = 0; i < header->value.length; ++i) {
 		char c;
 
 		/* Get the character and handle it */
@@ -118,17 +174,474 @@ int header_value_as_size_t(struct http_header *header,
 			/* Bad character */
 			return 0;
 		}
-		
-		/* Add to value */
-		value += (c - '0')*n;
-		n *= 10;
-	}
 
-	/* Check value */
-	if (value > max_len)
-		return 0;
+		/*
+		 * Add to value, checking it against the maximum before it gets
+		 * there, so that a huge value can't wrap around to a small one.
+		 */
+		if (value > (max_len - (c - '0')) / 10)
+			return 0;
+		value = value*10 + (c - '0');
+	}
 
 	/* Return */
 	*len = value;
 	return 1;
-}
\ No newline at end of file
+}
+
+
+int header_value_as_date(struct http_header *header, time_t *t) {
+	static const char *months[12] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+	};
+	char value[64];
+	char month[4];
+	struct tm tm_buf;
+	char *ptr;
+	int i;
+
+	/* Copy it out to null terminate it */
+	if (header->value.length >= sizeof(value))
+		return 0;
+	memcpy(value, header->value.ptr, header->value.length);
+	value[header->value.length] = '\0';
+
+	/* Skip the day of the week, and the comma if it has one */
+	ptr = value;
+	while ((*ptr >= 'A' && *ptr <= 'Z') || (*ptr >= 'a' && *ptr <= 'z'))
+		++ptr;
+	if (*ptr == ',')
+		++ptr;
+
+	/* The rest is the same either way */
+	memset(&tm_buf, 0x0, sizeof(tm_buf));
+	if (sscanf(ptr, " %2d %3s %4d %2d:%2d:%2d GMT", &tm_buf.tm_mday, month,
+		&tm_buf.tm_year, &tm_buf.tm_hour, &tm_buf.tm_min,
+		&tm_buf.tm_sec) != 6)
+	{
+		return 0;
+	}
+	for (i = 0; i < 12; ++i) {
+		if (!strcmp(month, months[i]))
+			break;
+	}
+	if (i == 12)
+		return 0;
+	tm_buf.tm_mon = i;
+	tm_buf.tm_year -= 1900;
+
+	*t = timegm(&tm_buf);
+	return 1;
+}
+
+
+struct http_header *find_header(struct http_header *header, char *base,
+	struct http_header_offsets *headers, int count, const char *label)
+{
+	size_t label_length;
+	int i;
+
+	/* Compare the whole label, not just a prefix of it */
+	label_length = strlen(label);
+	for (i = count - 1; i >= 0; --i) {
+		if ((headers[i].label.length == label_length) &&
+			!strncasecmp(base + headers[i].label.offset, label, label_length))
+		{
+			header_from_offsets(header, &headers[i], base);
+			return header;
+		}
+	}
+
+	/* No such header */
+	return NULL;
+}
+
+
+int header_has_token(struct http_header *header, const char *token) {
+	char *ptr;
+	char *after;
+	size_t token_length;
+
+	token_length = strlen(token);
+	ptr = header->value.ptr;
+	after = ptr + header->value.length;
+	while (ptr < after) {
+		char *start;
+		char *end;
+
+		/* Skip separators and whitespace before the element */
+		while ((ptr < after) && 
+			((*ptr == ',') || (*ptr == ' ') || (*ptr == '\t')))
+		{
+			++ptr;
+		}
+
+		/* Find the end of the element, and trim trailing whitespace */
+		start = ptr;
+		while ((ptr < after) && (*ptr != ','))
+			++ptr;
+		end = ptr;
+		while ((end > start) && ((end[-1] == ' ') || (end[-1] == '\t')))
+			--end;
+
+		/* Compare it */
+		if (((size_t)(end - start) == token_length) &&
+			!strncasecmp(start, token, token_length))
+		{
+			return 1;
+		}
+	}
+
+	/* Not in the list */
+	return 0;
+}
+
+
+/*
+ * Parse a decimal number at |*ptr|, moving |*ptr| past it.
+ * Returns 0 -> There was no number there, or it was too big
+ *         1 -> The number was written into |value|
+ */
+int parse_range_number(char **ptr, char *after, size_t *value) {
+	size_t n;
+	char *start;
+
+	n = 0;
+	start = *ptr;
+	while ((*ptr < after) && (**ptr >= '0') && (**ptr <= '9')) {
+		/* Don't let it overflow */
+		if (n > ((size_t)-1 - 9) / 10)
+			return 0;
+		n = n*10 + (**ptr - '0');
+		++*ptr;
+	}
+
+	*value = n;
+	return *ptr > start;
+}
+
+
+int header_last_token(struct http_header *header, const char *token) {
+	char *start;
+	char *end;
+	size_t token_length;
+
+	/* The last element runs from the last comma, less the whitespace */
+	token_length = strlen(token);
+	start = header->value.ptr;
+	end = start + header->value.length;
+	while ((end > start) && ((end[-1] == ' ') || (end[-1] == '\t')))
+		--end;
+	if ((size_t)(end - start) < token_length)
+		return 0;
+	start = end - token_length;
+
+	/* Compare it, and make sure that it's all of the element */
+	if (strncasecmp(start, token, token_length))
+		return 0;
+	while ((start > header->value.ptr) && 
+		((start[-1] == ' ') || (start[-1] == '\t')))
+	{
+		--start;
+	}
+	return (start == header->value.ptr) || (start[-1] == ',');
+}
+
+
+int header_accepts(struct http_header *header, const char *coding) {
+	char *ptr;
+	char *after;
+	size_t coding_length;
+	int star;
+
+	coding_length = strlen(coding);
+	ptr = header->value.ptr;
+	after = ptr + header->value.length;
+	star = 0;
+	while (ptr < after) {
+		char *start;
+		char *end;
+		int accepted;
+
+		/* Skip separators and whitespace before the element */
+		while ((ptr < after) && 
+			((*ptr == ',') || (*ptr == ' ') || (*ptr == '\t')))
+		{
+			++ptr;
+		}
+
+		/* The coding runs up to any parameters */
+		start = ptr;
+		while ((ptr < after) && (*ptr != ',') && (*ptr != ';'))
+			++ptr;
+		end = ptr;
+		while ((end > start) && ((end[-1] == ' ') || (end[-1] == '\t')))
+			--end;
+
+		/* 
+		 * Then a q=0 turns it down, any other digit than 0 in the quality
+		 * value means that it's some amount acceptable.
+		 */
+		accepted = 1;
+		while ((ptr < after) && (*ptr != ',')) {
+			if ((*ptr == 'q' || *ptr == 'Q') && (ptr + 1 < after) &&
+				(ptr[1] == '='))
+			{
+				accepted = 0;
+				for (ptr += 2; (ptr < after) && (*ptr != ','); ++ptr) {
+					if (*ptr >= '1' && *ptr <= '9')
+						accepted = 1;
+				}
+				break;
+			}
+			++ptr;
+		}
+
+		/* Compare it */
+		if (((size_t)(end - start) == coding_length) &&
+			!strncasecmp(start, coding, coding_length))
+		{
+			return accepted;
+		}
+		if ((end - start == 1) && (*start == '*'))
+			star = accepted;
+	}
+
+	/* Not listed by name, maybe as anything */
+	return star;
+}
+
+
+int header_matches_etag(struct http_header *header, const char *etag) {
+	char *ptr;
+	char *after;
+	size_t etag_length;
+
+	etag_length = strlen(etag);
+	ptr = header->value.ptr;
+	after = ptr + header->value.length;
+	while (ptr < after) {
+		char *start;
+		char *end;
+
+		/* Skip separators and whitespace before the tag */
+		while ((ptr < after) && 
+			((*ptr == ',') || (*ptr == ' ') || (*ptr == '\t')))
+		{
+			++ptr;
+		}
+
+		/* Find the end of the tag, and trim trailing whitespace */
+		start = ptr;
+		while ((ptr < after) && (*ptr != ','))
+			++ptr;
+		end = ptr;
+		while ((end > start) && ((end[-1] == ' ') || (end[-1] == '\t')))
+			--end;
+
+		/* Compare it, weak or not */
+		if ((end - start == 1) && (*start == '*'))
+			return 1;
+		if ((end - start > 2) && !strncmp(start, "W/", 2))
+			start += 2;
+		if (((size_t)(end - start) == etag_length) &&
+			!strncmp(start, etag, etag_length))
+		{
+			return 1;
+		}
+	}
+
+	/* Not in the list */
+	return 0;
+}
+
+
+int parse_range(struct http_header *header, size_t size,
+	struct http_range *ranges, int max_ranges)
+{
+	char *ptr;
+	char *after;
+	int elements;
+	int count;
+
+	/* The only unit there is, is bytes */
+	ptr = header->value.ptr;
+	after = ptr + header->value.length;
+	if ((after - ptr) < 6 || strncasecmp(ptr, "bytes=", 6))
+		return -1;
+	ptr += 6;
+
+	elements = 0;
+	count = 0;
+	while (ptr < after) {
+		size_t first;
+		size_t last;
+		size_t length;
+
+		/* Skip separators and whitespace before the element */
+		if ((*ptr == ',') || (*ptr == ' ') || (*ptr == '\t')) {
+			++ptr;
+			continue;
+		}
+		if (++elements > max_ranges)
+			return -1;
+
+		if (*ptr == '-') {
+			/* A suffix, "-n" is the last n bytes */
+			++ptr;
+			if (!parse_range_number(&ptr, after, &length))
+				return -1;
+			if (length > size)
+				length = size;
+			first = size - length;
+		} else {
+			/* "first-last", or "first-" to the end */
+			if (!parse_range_number(&ptr, after, &first))
+				return -1;
+			if ((ptr == after) || (*ptr != '-'))
+				return -1;
+			++ptr;
+			if (!parse_range_number(&ptr, after, &last))
+				last = size;
+			else if (last < first)
+				return -1;
+
+			/* Cut it short at the end of the file */
+			if (first >= size)
+				length = 0;
+			else if (last >= size)
+				length = size - first;
+			else
+				length = last - first + 1;
+		}
+
+		/* Must be followed by the end of the element */
+		while ((ptr < after) && ((*ptr == ' ') || (*ptr == '\t')))
+			++ptr;
+		if ((ptr < after) && (*ptr != ','))
+			return -1;
+
+		/* Keep it if any of it is within the file */
+		if (length > 0) {
+			ranges[count].start = first;
+			ranges[count].length = length;
+			++count;
+		}
+	}
+
+	/* "bytes=" alone isn't a range at all */
+	if (elements == 0)
+		return -1;
+	return count;
+}
+
+
+/*
+ * Get the value of a hexadecimal digit.
+ * Returns The value, or -1 if |c| isn't one
+ */
+int hex_digit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+
+void chunked_init(struct http_chunked *chunked) {
+	memset(chunked, 0x0, sizeof(struct http_chunked));
+	chunked->state = CHUNKED_SIZE;
+}
+
+
+int chunked_decode(struct http_chunked *chunked, char *data, size_t length,
+	size_t *used, size_t *decoded)
+{
+	size_t in;
+	size_t out;
+	size_t n;
+	int digit;
+
+	in = 0;
+	out = 0;
+	while (in < length) {
+		char c = data[in];
+
+		switch (chunked->state) {
+		case CHUNKED_SIZE:
+			/* Hex digits, then maybe extensions, to the end of the line */
+			if ((digit = hex_digit(c)) >= 0) {
+				if (chunked->size > ((size_t)-1 >> 4))
+					return -1;
+				chunked->size = (chunked->size << 4) | digit;
+				++chunked->digits;
+				++in;
+				break;
+			}
+			if (chunked->digits == 0 || 
+				(c != ';' && c != ' ' && c != '\t' && c != '\r' && c != '\n'))
+			{
+				return -1;
+			}
+			chunked->state = CHUNKED_EXT;
+			break;
+
+		case CHUNKED_EXT:
+			/* A zero size chunk is the last one, trailers follow */
+			++in;
+			if (c != '\n')
+				break;
+			chunked->state = (chunked->size > 0) ? 
+				CHUNKED_DATA : CHUNKED_TRAILER;
+			chunked->line_length = 0;
+			break;
+
+		case CHUNKED_DATA:
+			/* As much of the contents as is here */
+			n = length - in;
+			if (n > chunked->size)
+				n = chunked->size;
+			memmove(data + out, data + in, n);
+			in += n;
+			out += n;
+			chunked->size -= n;
+			if (chunked->size == 0)
+				chunked->state = CHUNKED_DATA_END;
+			break;
+
+		case CHUNKED_DATA_END:
+			/* \r\n, or just \n, then the next chunk */
+			++in;
+			if (c == '\r')
+				break;
+			if (c != '\n')
+				return -1;
+			chunked->state = CHUNKED_SIZE;
+			chunked->digits = 0;
+			break;
+
+		case CHUNKED_TRAILER:
+			/* An empty line (but for \r) is the end of the body */
+			++in;
+			if (c == '\n') {
+				if (chunked->line_length == 0) {
+					*used = in;
+					*decoded = out;
+					return 1;
+				}
+				chunked->line_length = 0;
+			} else if (c != '\r') {
+				++chunked->line_length;
+			}
+			break;
+		}
+	}
+
+	*used = in;
+	*decoded = out;
+	return 0;
+}
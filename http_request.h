@@ -1,5 +1,10 @@
 
+#ifndef HTTP_REQUEST_H_
+#define HTTP_REQUEST_H_
+
+
 #include <stdlib.h>
+#include <time.h>
 
 /* 
  * A non-(null terminated) string which is a pointer into a character
@@ -10,16 +15,45 @@ struct str_buffer_ptr {
 	size_t length;
 };
 
+/*
+ * A string in a character buffer given as where it starts, as an offset
+ * from some point in the buffer, rather than a pointer. It stays right
+ * when the buffer is moved, or grown with realloc.
+ */
+struct str_buffer_offset {
+	size_t offset;
+	size_t length;
+};
+
 /*
  * An Http request header, which consists of a label, and a value, 
  * stored as str_buffer_ptrs.
- * Contains a link to the next http_header for use in a linked list of
- * http_header structures.
  */
 struct http_header {
 	struct str_buffer_ptr label;
 	struct str_buffer_ptr value;
-	struct http_header *prev;
+};
+
+/*
+ * Where an http_header's label and value are in the buffer it was parsed
+ * from, as offsets, for keeping in a table while more of the buffer is
+ * read in.
+ */
+struct http_header_offsets {
+	struct str_buffer_offset label;
+	struct str_buffer_offset value;
+};
+
+/* The most ranges that a Range header may ask for */
+#define HTTP_RANGE_MAX 8
+
+/*
+ * A range of bytes of a file asked for by a Range header, |length| bytes
+ * from |start|.
+ */
+struct http_range {
+	size_t start;
+	size_t length;
 };
 
 /*
@@ -32,6 +66,15 @@ struct http_method {
 	struct str_buffer_ptr version;
 };
 
+/*
+ * Where an http_method's parts are in the buffer, as offsets.
+ */
+struct http_method_offsets {
+	struct str_buffer_offset method;
+	struct str_buffer_offset url;
+	struct str_buffer_offset version;
+};
+
 /*
  * Parse an http_method structure out of a piece of a given character buffer.
  * Returns: 
@@ -50,6 +93,30 @@ int parse_method(struct http_method *method,
 int parse_header(struct http_header *header, 
 	char *source_buffer, size_t source_length);
 
+/*
+ * The state of decoding a request body sent with Transfer-Encoding:
+ * chunked, which may come in split up anywhere.
+ */
+struct http_chunked {
+	int state;
+	size_t size;        /* Of the chunk, as it's read, then what's left */
+	int digits;         /* How many digits of the size there have been */
+	size_t line_length; /* How long the trailer line so far is */
+};
+
+/*
+ * Convert a parsed http_method or http_header, pointing into a buffer, to
+ * where it is in the buffer as offsets from |base|, and back again.
+ */
+void method_to_offsets(struct http_method_offsets *offsets,
+	struct http_method *method, char *base);
+void method_from_offsets(struct http_method *method,
+	struct http_method_offsets *offsets, char *base);
+void header_to_offsets(struct http_header_offsets *offsets,
+	struct http_header *header, char *base);
+void header_from_offsets(struct http_header *header,
+	struct http_header_offsets *offsets, char *base);
+
 /*
  * Parse a header's value converted to a size_t, with a maximum value allowed.
  * Returns:
@@ -58,4 +125,101 @@ int parse_header(struct http_header *header,
  *   1 -> The parse succeeded, and the value was written into len.
  */
 int header_value_as_size_t(struct http_header *header, 
-	size_t *len, size_t max_value);
\ No newline at end of file
+	size_t *len, size_t max_value);
+
+/*
+ * Parse a header's value as an HTTP date, either in the standard format
+ * ("Sun, 06 Nov 1994 08:49:37 GMT") or the one this server uses for it's
+ * Date header, which lacks the comma.
+ * Returns:
+ *   0 -> The parse failed, the value was not such a date
+ *   1 -> The parse succeeded, and the time was written into |t|
+ */
+int header_value_as_date(struct http_header *header, time_t *t);
+
+/*
+ * Find the header with a given label (compared case-insensitively, as
+ * header labels are in HTTP) in a table of |count| headers parsed out of
+ * a buffer, with offsets from |base|, and fill in |header| with it.
+ * Returns:
+ *   |header|, or NULL if there is no such header. If there are several,
+ *   it's the last one in the table.
+ */
+struct http_header *find_header(struct http_header *header, char *base,
+	struct http_header_offsets *headers, int count, const char *label);
+
+/*
+ * Check whether a header whose value is a comma separated list of elements
+ * (such as Connection) contains a given token, compared case-insensitively.
+ * Returns:
+ *   0 -> The token is not in the list
+ *   1 -> The token is in the list
+ */
+int header_has_token(struct http_header *header, const char *token);
+
+/*
+ * Check whether |token| is the last element of a header whose value is a
+ * comma separated list (such as Transfer-Encoding), compared
+ * case-insensitively.
+ * Returns:
+ *   0 -> The list doesn't end with the token
+ *   1 -> It does
+ */
+int header_last_token(struct http_header *header, const char *token);
+
+/*
+ * Check whether a header whose value is a list of codings with optional
+ * quality values (such as Accept-Encoding) accepts |coding|: It's listed,
+ * or * is, and not with q=0.
+ * Returns:
+ *   0 -> The coding is not acceptable
+ *   1 -> The coding is acceptable
+ */
+int header_accepts(struct http_header *header, const char *coding);
+
+/*
+ * Check whether a header whose value is a list of entity tags (such as
+ * If-None-Match) matches the quoted entity tag |etag|, with the weak
+ * comparison: A W/ in front of a tag in the list is ignored. A value of *
+ * matches any tag.
+ * Returns:
+ *   0 -> None of the tags match
+ *   1 -> One of them matches
+ */
+int header_matches_etag(struct http_header *header, const char *etag);
+
+/*
+ * Parse the byte ranges of a Range header (such as "bytes=0-99,-500") for
+ * a file of |size| bytes, into up to |max_ranges| http_ranges. Ranges that
+ * start past the end of the file are left out, and ones that go past the
+ * end are cut short.
+ * Returns:
+ *   -1 -> The header is malformed, isn't in bytes, or asks for more than
+ *         |max_ranges| ranges, and should be ignored
+ *    0 -> None of the ranges are within the file
+ *    n -> The number of ranges written into |ranges|
+ */
+int parse_range(struct http_header *header, size_t size,
+	struct http_range *ranges, int max_ranges);
+
+/*
+ * Set up an http_chunked to decode a new chunked body.
+ */
+void chunked_init(struct http_chunked *chunked);
+
+/*
+ * Decode the next |length| bytes of a chunked body at |data|, in place:
+ * The contents of the chunks are moved up to the start of |data|, and how
+ * much of it there is is written into |decoded|. How many bytes of |data|
+ * were used is written into |used|, which is all of them unless the body
+ * ended part way through. Chunk extensions and trailers are skipped.
+ * Returns:
+ *   -1 -> The body is malformed
+ *    0 -> The body isn't over yet
+ *    1 -> That was the end of the body
+ */
+int chunked_decode(struct http_chunked *chunked, char *data, size_t length,
+	size_t *used, size_t *decoded);
+
+
+#endif
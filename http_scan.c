@@ -0,0 +1,219 @@
+#include "http_scan.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+
+/* Private function forwards declarations */
+char *scan_for_scalar(char *ptr, char *after, char c);
+char *scan_for2_scalar(char *ptr, char *after, char a, char b);
+#ifdef SCAN_X86
+char *scan_for_sse2(char *ptr, char *after, char c);
+char *scan_for2_sse2(char *ptr, char *after, char a, char b);
+char *scan_for_avx2(char *ptr, char *after, char c);
+char *scan_for2_avx2(char *ptr, char *after, char a, char b);
+#endif
+char *scan_for_first(char *ptr, char *after, char c);
+char *scan_for2_first(char *ptr, char *after, char a, char b);
+void scan_pick();
+
+
+/*
+ * The way of scanning in use. They start out as functions that pick the
+ * best way on the first call. Threads racing to do that all pick the same
+ * one, so there's no need for a lock.
+ */
+char *(*scan_for_impl)(char *, char *, char) = scan_for_first;
+char *(*scan_for2_impl)(char *, char *, char, char) = scan_for2_first;
+int scan_how = SCAN_SCALAR;
+
+
+char *scan_for_scalar(char *ptr, char *after, char c) {
+	while ((ptr < after) && (*ptr != c))
+		++ptr;
+	return ptr;
+}
+
+
+char *scan_for2_scalar(char *ptr, char *after, char a, char b) {
+	while ((ptr < after) && (*ptr != a) && (*ptr != b))
+		++ptr;
+	return ptr;
+}
+
+
+#ifdef SCAN_X86
+/*
+ * Compare 16 bytes at a time against the byte, the movemask of the result
+ * has a bit set for each match. The last few bytes go one at a time.
+ */
+__attribute__((target("sse2")))
+char *scan_for_sse2(char *ptr, char *after, char c) {
+	__m128i needle;
+	__m128i chunk;
+	int mask;
+
+	needle = _mm_set1_epi8(c);
+	while (after - ptr >= 16) {
+		chunk = _mm_loadu_si128((const __m128i *)ptr);
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+		if (mask)
+			return ptr + __builtin_ctz(mask);
+		ptr += 16;
+	}
+
+	return scan_for_scalar(ptr, after, c);
+}
+
+
+__attribute__((target("sse2")))
+char *scan_for2_sse2(char *ptr, char *after, char a, char b) {
+	__m128i needle_a;
+	__m128i needle_b;
+	__m128i chunk;
+	int mask;
+
+	needle_a = _mm_set1_epi8(a);
+	needle_b = _mm_set1_epi8(b);
+	while (after - ptr >= 16) {
+		chunk = _mm_loadu_si128((const __m128i *)ptr);
+		mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(chunk, needle_a),
+			_mm_cmpeq_epi8(chunk, needle_b)));
+		if (mask)
+			return ptr + __builtin_ctz(mask);
+		ptr += 16;
+	}
+
+	return scan_for2_scalar(ptr, after, a, b);
+}
+
+
+/*
+ * The same as the SSE2 ones, 32 bytes at a time. The upper halves of the
+ * registers are cleared before handing the rest to the SSE2 ones, mixing
+ * in SSE instructions while they're dirty is very slow. The compiler does
+ * that itself on return, but not always for a tail call.
+ */
+__attribute__((target("avx2")))
+char *scan_for_avx2(char *ptr, char *after, char c) {
+	__m256i needle;
+	__m256i chunk;
+	unsigned int mask;
+
+	needle = _mm256_set1_epi8(c);
+	while (after - ptr >= 32) {
+		chunk = _mm256_loadu_si256((const __m256i *)ptr);
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+		if (mask)
+			return ptr + __builtin_ctz(mask);
+		ptr += 32;
+	}
+
+	_mm256_zeroupper();
+	return scan_for_sse2(ptr, after, c);
+}
+
+
+__attribute__((target("avx2")))
+char *scan_for2_avx2(char *ptr, char *after, char a, char b) {
+	__m256i needle_a;
+	__m256i needle_b;
+	__m256i chunk;
+	unsigned int mask;
+
+	needle_a = _mm256_set1_epi8(a);
+	needle_b = _mm256_set1_epi8(b);
+	while (after - ptr >= 32) {
+		chunk = _mm256_loadu_si256((const __m256i *)ptr);
+		mask = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(chunk, needle_a),
+			_mm256_cmpeq_epi8(chunk, needle_b)));
+		if (mask)
+			return ptr + __builtin_ctz(mask);
+		ptr += 32;
+	}
+
+	_mm256_zeroupper();
+	return scan_for2_sse2(ptr, after, a, b);
+}
+#endif
+
+
+/*
+ * Pick the best way of scanning that the CPU supports.
+ */
+void scan_pick() {
+	if (!scan_use(SCAN_AVX2) && !scan_use(SCAN_SSE2))
+		scan_use(SCAN_SCALAR);
+}
+
+
+char *scan_for_first(char *ptr, char *after, char c) {
+	scan_pick();
+	return scan_for_impl(ptr, after, c);
+}
+
+
+char *scan_for2_first(char *ptr, char *after, char a, char b) {
+	scan_pick();
+	return scan_for2_impl(ptr, after, a, b);
+}
+
+
+char *scan_for(char *ptr, char *after, char c) {
+	return scan_for_impl(ptr, after, c);
+}
+
+
+char *scan_for2(char *ptr, char *after, char a, char b) {
+	return scan_for2_impl(ptr, after, a, b);
+}
+
+
+int scan_use(int how) {
+	switch (how) {
+	case SCAN_SCALAR:
+		scan_for_impl = scan_for_scalar;
+		scan_for2_impl = scan_for2_scalar;
+		break;
+#ifdef SCAN_X86
+	case SCAN_SSE2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("sse2"))
+			return 0;
+		scan_for_impl = scan_for_sse2;
+		scan_for2_impl = scan_for2_sse2;
+		break;
+	case SCAN_AVX2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2"))
+			return 0;
+		scan_for_impl = scan_for_avx2;
+		scan_for2_impl = scan_for2_avx2;
+		break;
+#endif
+	default:
+		return 0;
+	}
+
+	scan_how = how;
+	return 1;
+}
+
+
+const char *scan_name() {
+	if (scan_for_impl == scan_for_first)
+		scan_pick();
+
+	switch (scan_how) {
+	case SCAN_SSE2:
+		return "sse2";
+	case SCAN_AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef HTTP_SCAN_H_
+#define HTTP_SCAN_H_
+
+
+#include <stddef.h>
+
+
+/* The ways of scanning there are, for scan_use */
+#define SCAN_SCALAR 0 /* One byte at a time */
+#define SCAN_SSE2   1 /* 16 bytes at a time */
+#define SCAN_AVX2   2 /* 32 bytes at a time */
+
+
+/*
+ * Find the first |c| in the bytes from |ptr| up to |after|, the way that
+ * the request lexer and parsers find the ends of lines and the separators
+ * in them. Checks 32 (AVX2) or 16 (SSE2) bytes at a time if the CPU can,
+ * which is found out the first time any of the scan functions is called.
+ * Returns: A pointer to the |c|, or |after| if there isn't one.
+ */
+char *scan_for(char *ptr, char *after, char c);
+
+
+/*
+ * Find the first of either |a| or |b|, as scan_for.
+ */
+char *scan_for2(char *ptr, char *after, char a, char b);
+
+
+/*
+ * Scan a particular way from now on rather than the best one the CPU
+ * supports, such as to compare them.
+ * Returns: 0 -> The CPU can't scan that way, nothing was changed
+ *          1 -> Okay
+ */
+int scan_use(int how);
+
+
+/*
+ * Get the name of the way of scanning in use, "scalar", "sse2" or "avx2".
+ */
+const char *scan_name();
+
+
+#endif
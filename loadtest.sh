@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# Load test server_f, server_p, server_e and server_u side by side with
+# bench, on a synthetic server root made the first time. Any arguments are
+# passed on to bench, such as -c 64 -d 20, or -R 5000 for an open loop at
+# that rate.
+
+ROOT=/tmp/bench_root
+MIX=/tmp/bench_root.mix
+PORT=8100
+
+if [ ! -f $MIX ]; then
+	./bench -g $ROOT -m $MIX || exit 1
+fi
+
+# Start each server on a port of it's own
+TARGETS=""
+PIDS=""
+for server in server_f server_p server_e server_u
+do
+	./$server $PORT $ROOT /dev/null &
+	PIDS="$PIDS $!"
+	TARGETS="$TARGETS $server=127.0.0.1:$PORT"
+	PORT=$((PORT + 1))
+done
+sleep 1
+
+./bench -m $MIX "$@" $TARGETS
+
+kill -INT $PIDS
+wait
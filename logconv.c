@@ -0,0 +1,168 @@
+#include "binary_log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+/*
+ * logconv: Convert a log written by a server started with -b back into the
+ * text log format it would have written otherwise.
+ * Usage: logconv [binary log file]
+ * Reads the standard input if no file is given, writes the text log to the
+ * standard output.
+ */
+
+
+/* Private function forwards declarations */
+int read_record(FILE *in, struct binlog_record *header, char *method,
+	char *url, char *version);
+const char *status_text(int status);
+void print_record(struct binlog_record *header, char *method, char *url,
+	char *version);
+
+
+/*
+ * Read the next record, and it's method, url and version, from the log.
+ * Returns:  1 -> A record was read
+ *           0 -> The end of the log was reached
+ *          -1 -> The log is truncated or corrupt
+ */
+int read_record(FILE *in, struct binlog_record *header, char *method,
+	char *url, char *version)
+{
+	size_t got;
+
+	/* The fixed width part */
+	got = fread(header, 1, sizeof(struct binlog_record), in);
+	if (got == 0 && feof(in))
+		return 0;
+	if (got != sizeof(struct binlog_record) || header->magic != BINLOG_MAGIC)
+		return -1;
+
+	/* Then the strings */
+	if (fread(method, 1, header->method_length, in) != header->method_length ||
+		fread(url, 1, header->url_length, in) != header->url_length ||
+		fread(version, 1, header->version_length, in) !=
+			header->version_length)
+	{
+		return -1;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Get the text that the server logs for a response with a given status.
+ * 200 and 206 responses log how much was sent after it.
+ */
+const char *status_text(int status) {
+	switch (status) {
+	case 200:
+		return "200 OK";
+	case 206:
+		return "206 Partial Content";
+	case 304:
+		return "304 Not Modified";
+	case 400:
+		return "400 Bad Request";
+	case 403:
+		return "403 Forbidden";
+	case 404:
+		return "404 Not Found";
+	case 405:
+		return "405 Method Not Allowed";
+	case 416:
+		return "416 Range Not Satisfiable";
+	case 431:
+		return "431 Request Header Fields Too Large";
+	case 500:
+		return "500 Internal Server Error";
+	default:
+		return NULL;
+	}
+}
+
+
+/*
+ * Print a record as a line of the text log.
+ */
+void print_record(struct binlog_record *header, char *method, char *url,
+	char *version)
+{
+	char date[64];
+	char addr[INET_ADDRSTRLEN];
+	struct in_addr in;
+	const char *text;
+	time_t t;
+
+	/* The date, formatted as in the responses */
+	t = header->time;
+	if (0 == strftime(date, sizeof(date), "%a %d %b %Y %T GMT", gmtime(&t)))
+		date[0] = '\0';
+
+	/* The address */
+	in.s_addr = header->addr;
+	if (!inet_ntop(AF_INET, &in, addr, sizeof(addr)))
+		addr[0] = '\0';
+
+	/* The request */
+	printf("%s\t%s\t%.*s %.*s %.*s\t", date, addr,
+		header->method_length, method,
+		header->url_length, url,
+		header->version_length, version);
+
+	/* And how it went */
+	if (header->status == BINLOG_STATUS_TERMINATED) {
+		printf("Connection unexpectedly terminated while "
+			"sending response header.\n");
+	} else if (header->status == 200 || header->status == 206) {
+		printf("%s %llu/%llu\n", status_text(header->status),
+			(unsigned long long)header->bytes_sent,
+			(unsigned long long)header->bytes_total);
+	} else if ((text = status_text(header->status))) {
+		printf("%s\n", text);
+	} else {
+		printf("%d\n", header->status);
+	}
+}
+
+
+/* Main program entry point */
+int main(int argc, char *argv[]) {
+	static char url[0x10000];
+	char method[0x100];
+	char version[0x100];
+	struct binlog_record header;
+	FILE *in;
+	long offset;
+	int status;
+
+	/* Get the log to read */
+	if (argc > 2) {
+		printf("Usage: %s [binary log file]\n", argv[0]);
+		return -1;
+	} else if (argc == 2) {
+		if (!(in = fopen(argv[1], "rb"))) {
+			fprintf(stderr, "Could not open %s.\n", argv[1]);
+			return -1;
+		}
+	} else {
+		in = stdin;
+	}
+
+	/* Convert every record */
+	offset = 0;
+	while ((status = read_record(in, &header, method, url, version)) > 0) {
+		print_record(&header, method, url, version);
+		offset += sizeof(header) + header.method_length + header.url_length +
+			header.version_length;
+	}
+	if (status < 0)
+		fprintf(stderr, "Bad or truncated record at offset %ld.\n", offset);
+
+	if (in != stdin)
+		fclose(in);
+	return (status < 0) ? -1 : 0;
+}
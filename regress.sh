@@ -0,0 +1,67 @@
+#!/bin/bash
+
+# Regression checks for server_f, server_p, server_e and server_u, run
+# against each of them in turn on a small server root made in /tmp. Says
+# which checks failed, and exits non-zero if any did.
+
+ROOT=/tmp/regress_root
+PORT=8200
+FAILED=0
+
+mkdir -p $ROOT
+printf 'hello\n' > $ROOT/small.txt
+head -c 16777216 /dev/zero > $ROOT/big.bin
+
+# Send a request (printf escapes and all) on a new connection, and print
+# the response. It's written from a subshell, so that if the server died
+# only that is killed by the SIGPIPE.
+request() {
+	exec 3<>/dev/tcp/127.0.0.1/$PORT 2> /dev/null || return
+	(printf "$1" >&3) 2> /dev/null
+	timeout 5 cat <&3
+	exec 3<&- 3>&-
+}
+
+# Say that a check failed
+fail() {
+	echo "$server: $1"
+	FAILED=1
+}
+
+for server in server_f server_p server_e server_u
+do
+	./$server $PORT $ROOT /dev/null > /dev/null &
+	PID=$!
+	sleep 1
+
+	# A client hanging up part way through a download mustn't kill it
+	for i in 1 2 3 4 5 6 7 8 9 10
+	do
+		exec 3<>/dev/tcp/127.0.0.1/$PORT 2> /dev/null || break
+		(printf 'GET /big.bin HTTP/1.0\r\n\r\n' >&3) 2> /dev/null
+		head -c 1000 <&3 > /dev/null
+		exec 3<&- 3>&-
+	done
+	sleep 1
+	if ! kill -0 $PID 2> /dev/null; then
+		fail "died when a client closed part way through a download"
+		PORT=$((PORT + 1))
+		continue
+	fi
+	request 'GET /small.txt HTTP/1.0\r\n\r\n' | grep -q '200 OK' ||
+		fail "stopped answering after a client closed mid-download"
+
+	# A stray CRLF between persistent requests is skipped, so both are
+	# answered
+	COUNT=$(request 'GET /small.txt HTTP/1.1\r\nHost: x\r\n\r\n\r\n'\
+'GET /small.txt HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n' |
+		grep -c '200 OK')
+	[ "$COUNT" = 2 ] ||
+		fail "answered $COUNT of 2 requests with a CRLF between them"
+
+	kill -INT $PID
+	wait $PID
+	PORT=$((PORT + 1))
+done
+
+exit $FAILED
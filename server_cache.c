@@ -0,0 +1,592 @@
+#include "server_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+/* Size of the hash table, must be a power of two */
+#define CACHE_BUCKETS 4096
+
+/* Number of counters in each row of the sketch, must be a power of two */
+#define SKETCH_WIDTH 8192
+#define SKETCH_ROWS 4
+
+/* Halve the sketch's counters after this many additions, so it ages */
+#define SKETCH_RESET (SKETCH_WIDTH * 10)
+
+/* Largest single file to cache, as a fraction of the whole cache */
+#define MAX_ENTRY_FRACTION 8
+
+/* The changes to a watched directory that invalidate entries */
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE | \
+	IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Private function forward declarations */
+unsigned int sketch_index(unsigned int hash, int row);
+void sketch_increment(struct content_cache *cache, unsigned int hash);
+unsigned int sketch_estimate(struct content_cache *cache, unsigned int hash);
+struct cache_entry *cache_find(struct content_cache *cache,
+	const char *path, unsigned int hash);
+void cache_lru_unlink(struct content_cache *cache, struct cache_entry *entry);
+void cache_lru_push(struct content_cache *cache, struct cache_entry *entry);
+void cache_remove(struct content_cache *cache, struct cache_entry *entry);
+void cache_remove_all(struct content_cache *cache);
+void cache_free_entry(struct cache_entry *entry);
+int cache_admit(struct content_cache *cache, unsigned int hash, size_t size);
+int cache_watch_dir(struct content_cache *cache, const char *path);
+void cache_handle_event(struct content_cache *cache,
+	struct inotify_event *event);
+void cache_invalidate(struct content_cache *cache, const char *dir,
+	const char *name);
+void *cache_watch_main(void *arg);
+
+
+/*
+ * FNV-1a hash of a path
+ */
+unsigned int server_cache_hash(const char *path) {
+	unsigned int hash;
+
+	hash = 2166136261u;
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+/*
+ * Get the index of a hash's counter in a given row of the sketch, each row
+ * mixes the hash differently so that collisions in one row aren't
+ * collisions in the others.
+ */
+unsigned int sketch_index(unsigned int hash, int row) {
+	static const unsigned int seeds[SKETCH_ROWS] = {
+		0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu
+	};
+
+	hash *= seeds[row];
+	hash ^= hash >> 15;
+	return row * SKETCH_WIDTH + (hash & (SKETCH_WIDTH - 1));
+}
+
+
+/*
+ * Count one more request for a hash in the sketch
+ */
+void sketch_increment(struct content_cache *cache, unsigned int hash) {
+	int row;
+
+	for (row = 0; row < SKETCH_ROWS; ++row) {
+		unsigned char *counter = &cache->sketch[sketch_index(hash, row)];
+		if (*counter < 255)
+			++*counter;
+	}
+
+	/* Age the counts, so that files which used to be hot don't stay hot */
+	if (++cache->sketch_additions >= SKETCH_RESET) {
+		unsigned int i;
+
+		for (i = 0; i < SKETCH_WIDTH * SKETCH_ROWS; ++i)
+			cache->sketch[i] >>= 1;
+		cache->sketch_additions /= 2;
+	}
+}
+
+
+/*
+ * Estimate how many requests there have been for a hash: The minimum of
+ * it's counters, since collisions can only make them too high.
+ */
+unsigned int sketch_estimate(struct content_cache *cache, unsigned int hash) {
+	unsigned int estimate;
+	int row;
+
+	estimate = 255;
+	for (row = 0; row < SKETCH_ROWS; ++row) {
+		unsigned int count = cache->sketch[sketch_index(hash, row)];
+		if (count < estimate)
+			estimate = count;
+	}
+	return estimate;
+}
+
+
+/*
+ * Find the entry for a path, the lock must be held
+ */
+struct cache_entry *cache_find(struct content_cache *cache,
+	const char *path, unsigned int hash)
+{
+	struct cache_entry *entry;
+
+	for (entry = cache->buckets[hash & cache->bucket_mask]; entry;
+		entry = entry->hash_next)
+	{
+		if (entry->hash == hash && !strcmp(entry->path, path))
+			return entry;
+	}
+	return NULL;
+}
+
+
+/*
+ * Take an entry out of the LRU list, the lock must be held
+ */
+void cache_lru_unlink(struct content_cache *cache, struct cache_entry *entry) {
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+
+/*
+ * Put an entry at the most recently used end of the LRU list, the lock must
+ * be held
+ */
+void cache_lru_push(struct content_cache *cache, struct cache_entry *entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+
+/*
+ * Remove an entry from the cache, freeing it unless it's still in use, in
+ * which case the last server_cache_release frees it. The lock must be held.
+ */
+void cache_remove(struct content_cache *cache, struct cache_entry *entry) {
+	struct cache_entry **link;
+
+	/* Out of the hash table */
+	link = &cache->buckets[entry->hash & cache->bucket_mask];
+	while (*link != entry)
+		link = &(*link)->hash_next;
+	*link = entry->hash_next;
+
+	/* Out of the LRU list */
+	cache_lru_unlink(cache, entry);
+
+	cache->stats.memory_used -= entry->size;
+	--cache->stats.entries;
+
+	/* Free it, or leave that to the last user */
+	entry->stale = 1;
+	if (entry->refcount == 0)
+		cache_free_entry(entry);
+}
+
+
+/*
+ * Remove every entry from the cache, the lock must be held
+ */
+void cache_remove_all(struct content_cache *cache) {
+	while (cache->lru_head) {
+		cache_remove(cache, cache->lru_head);
+		++cache->stats.invalidated;
+	}
+}
+
+
+/*
+ * Free an entry that is no longer in the cache or in use
+ */
+void cache_free_entry(struct cache_entry *entry) {
+	free(entry->path);
+	free(entry->data);
+	free(entry);
+}
+
+
+/*
+ * TinyLFU admission: Decide whether a file of |size| bytes is requested
+ * often enough to evict the least recently used entries that would have to
+ * go to make room for it. The lock must be held.
+ * Returns 0 -> Don't admit it
+ *         1 -> Admit it
+ */
+int cache_admit(struct content_cache *cache, unsigned int hash, size_t size) {
+	struct cache_entry *victim;
+	unsigned int frequency;
+	size_t available;
+
+	/* Too big to ever be worth it */
+	if (size > cache->max_entry_size)
+		return 0;
+
+	/* Check it against each of the entries it would push out */
+	frequency = sketch_estimate(cache, hash);
+	available = cache->memory_cap - cache->stats.memory_used;
+	for (victim = cache->lru_tail; available < size && victim;
+		victim = victim->lru_prev)
+	{
+		if (sketch_estimate(cache, victim->hash) >= frequency)
+			return 0;
+		available += victim->size;
+	}
+
+	return available >= size;
+}
+
+
+/*
+ * Make sure the directory containing a path is being watched for changes,
+ * the lock must be held.
+ * Returns 0 -> The directory can't be watched
+ *         1 -> Okay
+ */
+int cache_watch_dir(struct content_cache *cache, const char *path) {
+	const char *slash;
+	size_t dir_length;
+	int wd;
+	int i;
+
+	/* Get the directory part of the path */
+	slash = strrchr(path, '/');
+	dir_length = slash ? (slash - path) : 0;
+
+	/* Already watched? */
+	for (i = 0; i < cache->watch_count; ++i) {
+		if (strlen(cache->watches[i].dir) == dir_length &&
+			!strncmp(cache->watches[i].dir, path, dir_length))
+		{
+			return 1;
+		}
+	}
+
+	/* Start watching it */
+	if (cache->watch_count == cache->watch_capacity) {
+		cache->watch_capacity = cache->watch_capacity * 2 + 8;
+		cache->watches = realloc(cache->watches,
+			cache->watch_capacity * sizeof(struct cache_watch));
+	}
+	cache->watches[cache->watch_count].dir = malloc(dir_length + 1);
+	memcpy(cache->watches[cache->watch_count].dir, path, dir_length);
+	cache->watches[cache->watch_count].dir[dir_length] = '\0';
+	wd = inotify_add_watch(cache->inotify_fd,
+		dir_length ? cache->watches[cache->watch_count].dir : "/",
+		WATCH_MASK);
+	if (wd < 0) {
+		/* Can't watch it, so it can't be cached safely */
+		free(cache->watches[cache->watch_count].dir);
+		return 0;
+	}
+	cache->watches[cache->watch_count].wd = wd;
+	++cache->watch_count;
+	return 1;
+}
+
+
+/*
+ * Invalidate the entries affected by an inotify event, the lock must be held
+ */
+void cache_handle_event(struct content_cache *cache,
+	struct inotify_event *event)
+{
+	int i;
+
+	/* Anything that has changed now may be out of date */
+	++cache->generation;
+
+	if ((event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF |
+		IN_MOVE_SELF)) ||
+		((event->mask & IN_ISDIR) && !(event->mask & IN_CREATE)))
+	{
+		/*
+		 * Missed events, or a whole directory changed, so we don't know
+		 * which entries are still good. Start over.
+		 */
+		cache_remove_all(cache);
+	}
+
+	/*
+	 * Find the directory it happened in. There may be more than one name
+	 * for it (like a/b/.. and a) sharing the same watch.
+	 */
+	for (i = 0; i < cache->watch_count; ) {
+		if (cache->watches[i].wd != event->wd) {
+			++i;
+		} else if (event->mask & IN_IGNORED) {
+			/* The watch is gone, forget it */
+			free(cache->watches[i].dir);
+			cache->watches[i] = cache->watches[--cache->watch_count];
+		} else {
+			if (event->len > 0)
+				cache_invalidate(cache, cache->watches[i].dir, event->name);
+			++i;
+		}
+	}
+}
+
+
+/*
+ * Drop the entry for file |name| in directory |dir| if it's cached, the
+ * lock must be held.
+ */
+void cache_invalidate(struct content_cache *cache, const char *dir,
+	const char *name)
+{
+	struct cache_entry *entry;
+	char *path;
+	size_t dir_length;
+
+	/* Work out the full path of the file, and drop it's entry */
+	dir_length = strlen(dir);
+	path = malloc(dir_length + 1 + strlen(name) + 1);
+	strcpy(path, dir);
+	path[dir_length] = '/';
+	strcpy(path + dir_length + 1, name);
+	if ((entry = cache_find(cache, path, server_cache_hash(path)))) {
+		cache_remove(cache, entry);
+		++cache->stats.invalidated;
+	}
+	free(path);
+}
+
+
+/*
+ * pthread Entry point for the thread reading inotify events
+ */
+void *cache_watch_main(void *arg) {
+	struct content_cache *cache;
+	char buffer[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	cache = (struct content_cache*)arg;
+	for (;;) {
+		ssize_t len;
+		char *ptr;
+
+		/* Wait for events */
+		len = read(cache->inotify_fd, buffer, sizeof(buffer));
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* Handle them all */
+		pthread_mutex_lock(&cache->lock);
+		for (ptr = buffer; ptr < buffer + len; ) {
+			struct inotify_event *event = (struct inotify_event*)ptr;
+			cache_handle_event(cache, event);
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+		pthread_mutex_unlock(&cache->lock);
+	}
+
+	return NULL;
+}
+
+
+int server_cache_create(struct content_cache *cache, size_t memory_cap) {
+	sigset_t block_set;
+	sigset_t old_set;
+	int status;
+
+	memset(cache, 0x0, sizeof(struct content_cache));
+	cache->memory_cap = memory_cap;
+	cache->max_entry_size = memory_cap / MAX_ENTRY_FRACTION;
+
+	/* Allocate the tables */
+	cache->bucket_mask = CACHE_BUCKETS - 1;
+	cache->buckets = calloc(CACHE_BUCKETS, sizeof(struct cache_entry*));
+	cache->sketch = calloc(SKETCH_WIDTH * SKETCH_ROWS, 1);
+	if (!cache->buckets || !cache->sketch)
+		goto error;
+
+	/* Set up inotify, and the thread to read it */
+	if ((cache->inotify_fd = inotify_init1(IN_CLOEXEC)) < 0)
+		goto error;
+	if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+		close(cache->inotify_fd);
+		goto error;
+	}
+
+	/* 
+	 * The thread must not handle any of the server's signals, the main
+	 * thread may siglongjmp out of it's handlers.
+	 */
+	sigfillset(&block_set);
+	pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+	status = pthread_create(&cache->watch_thread, NULL, cache_watch_main,
+		(void*)cache);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (status != 0) {
+		pthread_mutex_destroy(&cache->lock);
+		close(cache->inotify_fd);
+		goto error;
+	}
+
+	return CACHE_OKAY;
+
+error:
+	free(cache->buckets);
+	free(cache->sketch);
+	return CACHE_ERROR;
+}
+
+
+struct cache_entry *server_cache_get(struct content_cache *cache,
+	const char *path)
+{
+	struct cache_entry *entry;
+	unsigned int hash;
+
+	hash = server_cache_hash(path);
+	pthread_mutex_lock(&cache->lock);
+
+	/* Count the request, hit or miss */
+	sketch_increment(cache, hash);
+
+	/* Look it up */
+	if ((entry = cache_find(cache, path, hash))) {
+		cache_lru_unlink(cache, entry);
+		cache_lru_push(cache, entry);
+		++entry->refcount;
+		++cache->stats.hits;
+	} else {
+		++cache->stats.misses;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	return entry;
+}
+
+
+struct cache_entry *server_cache_offer(struct content_cache *cache,
+	const char *path, int fd, size_t size, time_t mtime, ino_t ino)
+{
+	struct cache_entry *entry;
+	unsigned int hash;
+	unsigned int generation;
+	size_t data_read;
+
+	hash = server_cache_hash(path);
+
+	/*
+	 * See if it gets in, and start watching for changes to it before
+	 * reading it, so that no change can slip by unnoticed.
+	 */
+	pthread_mutex_lock(&cache->lock);
+	if (!cache_admit(cache, hash, size)) {
+		++cache->stats.rejected;
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+	if (!cache_watch_dir(cache, path)) {
+		++cache->stats.rejected;
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+	generation = cache->generation;
+	pthread_mutex_unlock(&cache->lock);
+
+	/* Read it in, outside of the lock */
+	entry = malloc(sizeof(struct cache_entry));
+	entry->path = malloc(strlen(path) + 1);
+	strcpy(entry->path, path);
+	entry->hash = hash;
+	entry->data = malloc(size + 1);
+	entry->size = size;
+	entry->mtime = mtime;
+	entry->ino = ino;
+	entry->refcount = 1;
+	entry->stale = 0;
+	for (data_read = 0; data_read < size; ) {
+		ssize_t len = pread(fd, entry->data + data_read, size - data_read,
+			data_read);
+		if (len <= 0) {
+			/* Couldn't read it all, don't cache it */
+			cache_free_entry(entry);
+			return NULL;
+		}
+		data_read += len;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	/*
+	 * If anything changed while we were reading, or another thread cached
+	 * it first, throw our copy away.
+	 */
+	if (generation != cache->generation ||
+		cache_find(cache, path, hash))
+	{
+		pthread_mutex_unlock(&cache->lock);
+		cache_free_entry(entry);
+		return NULL;
+	}
+
+	/* Make room for it */
+	while (cache->lru_tail &&
+		cache->memory_cap - cache->stats.memory_used < size)
+	{
+		cache_remove(cache, cache->lru_tail);
+		++cache->stats.evicted;
+	}
+
+	/* Add it */
+	entry->hash_next = cache->buckets[hash & cache->bucket_mask];
+	cache->buckets[hash & cache->bucket_mask] = entry;
+	cache_lru_push(cache, entry);
+	cache->stats.memory_used += size;
+	++cache->stats.entries;
+	++cache->stats.admitted;
+
+	pthread_mutex_unlock(&cache->lock);
+	return entry;
+}
+
+
+void server_cache_release(struct content_cache *cache,
+	struct cache_entry *entry)
+{
+	pthread_mutex_lock(&cache->lock);
+	if (--entry->refcount == 0 && entry->stale)
+		cache_free_entry(entry);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+void server_cache_get_stats(struct content_cache *cache,
+	struct cache_stats *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	memcpy(stats, &cache->stats, sizeof(struct cache_stats));
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+void server_cache_destroy(struct content_cache *cache) {
+	int i;
+
+	/* Stop the inotify thread */
+	pthread_cancel(cache->watch_thread);
+	pthread_join(cache->watch_thread, NULL);
+	close(cache->inotify_fd);
+
+	/* Free everything */
+	cache_remove_all(cache);
+	for (i = 0; i < cache->watch_count; ++i)
+		free(cache->watches[i].dir);
+	free(cache->watches);
+	free(cache->buckets);
+	free(cache->sketch);
+	pthread_mutex_destroy(&cache->lock);
+}
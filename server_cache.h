@@ -0,0 +1,154 @@
+#ifndef SERVER_CACHE_H_
+#define SERVER_CACHE_H_
+
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+
+/* Status codes returned by server_cache_create */
+#define CACHE_OKAY   0
+#define CACHE_ERROR -1
+
+
+/*
+ * A file's contents held in the cache. Entries are reference counted, an
+ * entry that is invalidated while a request is still sending it is only
+ * freed once that request releases it.
+ */
+struct cache_entry {
+	char *path;
+	unsigned int hash;
+	char *data;
+	size_t size;
+	time_t mtime;
+	ino_t ino;
+	int refcount;
+	int stale;
+	struct cache_entry *hash_next;
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
+};
+
+
+/*
+ * A directory being watched with inotify for changes to the cached files in
+ * it.
+ */
+struct cache_watch {
+	int wd;
+	char *dir;
+};
+
+
+/*
+ * Counters for how well the cache is doing.
+ */
+struct cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long admitted;
+	unsigned long rejected;
+	unsigned long evicted;
+	unsigned long invalidated;
+	size_t memory_used;
+	size_t entries;
+};
+
+
+/*
+ * A bounded memory cache of file contents keyed by their full path, safe to
+ * share between threads.
+ * Entries are admitted with TinyLFU: a count-min sketch estimates how often
+ * each path is requested, and a new file only gets in if it is requested
+ * more often than the least recently used entries it would evict. That way
+ * a one-off scan of a lot of files can't flush out the hot ones.
+ * Entries are invalidated when inotify reports a change to their file.
+ */
+struct content_cache {
+	pthread_mutex_t lock;
+
+	/* Hash table of the entries, and LRU list, most recent at the head */
+	struct cache_entry **buckets;
+	unsigned int bucket_mask;
+	struct cache_entry *lru_head;
+	struct cache_entry *lru_tail;
+
+	/* Memory limits */
+	size_t memory_cap;
+	size_t max_entry_size;
+
+	/* Count-min sketch of request frequencies, halved every so often */
+	unsigned char *sketch;
+	unsigned int sketch_additions;
+
+	/* Inotify state, and the thread reading it's events */
+	int inotify_fd;
+	struct cache_watch *watches;
+	int watch_count;
+	int watch_capacity;
+	unsigned int generation;
+	pthread_t watch_thread;
+
+	struct cache_stats stats;
+};
+
+
+/*
+ * Hash a path, for the caches' hash tables.
+ */
+unsigned int server_cache_hash(const char *path);
+
+
+/*
+ * Initialize a content cache holding at most |memory_cap| bytes of file
+ * contents, and start it's inotify thread.
+ * Returns: CACHE_OKAY on success, or CACHE_ERROR on failure.
+ */
+int server_cache_create(struct content_cache *cache, size_t memory_cap);
+
+
+/*
+ * Look up the file with the given full path in the cache.
+ * Returns: The entry with a reference held on it, which must be given back
+ *          with server_cache_release, or NULL if the file isn't cached.
+ */
+struct cache_entry *server_cache_get(struct content_cache *cache,
+	const char *path);
+
+
+/*
+ * Offer a file that missed in the cache to be added to it, given an open
+ * |fd| for it, it's size, modification time and inode number. The file is
+ * only read in if the admission policy lets it in.
+ * Returns: The new entry with a reference held on it, as server_cache_get,
+ *          or NULL if it was not admitted.
+ */
+struct cache_entry *server_cache_offer(struct content_cache *cache,
+	const char *path, int fd, size_t size, time_t mtime, ino_t ino);
+
+
+/*
+ * Give back a reference to an entry from server_cache_get/offer.
+ */
+void server_cache_release(struct content_cache *cache,
+	struct cache_entry *entry);
+
+
+/*
+ * Get a snapshot of the cache's counters.
+ */
+void server_cache_get_stats(struct content_cache *cache,
+	struct cache_stats *stats);
+
+
+/*
+ * Destroy a content_cache, should only be called on a content_cache that
+ * was successfully server_cache_create'd, with no entries still in use.
+ */
+void server_cache_destroy(struct content_cache *cache);
+
+
+#endif
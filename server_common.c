@@ -1,14 +1,39 @@
 
+#define _GNU_SOURCE
 #include "server_common.h"
 
 #include <memory.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+
+/* Private function forward declarations */
+int set_option(int fd, int level, int option, int value, const char *name);
+
+
+/*
+ * Set an integer socket option, reporting it if it fails.
+ * Returns 0 -> It failed
+ *         1 -> Okay
+ */
+int set_option(int fd, int level, int option, int value, const char *name) {
+	if (setsockopt(fd, level, option, &value, sizeof(value))) {
+		printf("setsockopt(%s) error: %s\n", name, strerror(errno));
+		return 0;
+	}
+	return 1;
+}
 
-#define MAX_REQUESTS 3
 
-int server_create(struct server_state *state, int port) {
+int server_create(struct server_state *state, int port, int flags,
+	const struct server_tuning *tuning)
+{
+	struct server_tuning defaults;
+	struct timeval timeout;
 	int err;
 	int reuseOpt;
 
@@ -26,6 +51,50 @@ int server_create(struct server_state *state, int port) {
 		SOL_SOCKET, SO_REUSEADDR, 
 		&reuseOpt, sizeof(reuseOpt));
 
+	/* 
+	 * If requested, let other sockets bind the same port too, so that the
+	 * kernel load balances incomming connections between all of them.
+	 */
+	if (flags & SERVER_REUSEPORT) {
+		if (setsockopt(state->socketfd,
+			SOL_SOCKET, SO_REUSEPORT,
+			&reuseOpt, sizeof(reuseOpt)))
+		{
+			printf("setsockopt(SO_REUSEPORT) error\n");
+			close(state->socketfd);
+			return SERVER_ERROR;
+		}
+	}
+
+	/*
+	 * Set up the timeouts, and any tuning asked for, on the listener. The
+	 * timeouts and busy polling carry over to each connection accepted from
+	 * it, so they don't have to be set on each one.
+	 * Read Timeout: 10 seconds
+	 * Write Timeout: 10 seconds
+	 */
+	if (!tuning) {
+		memset(&defaults, 0x0, sizeof(defaults));
+		tuning = &defaults;
+	}
+	timeout.tv_sec = SERVER_TIMEOUT;
+	timeout.tv_usec = 0;
+	if (setsockopt(state->socketfd, SOL_SOCKET, SO_RCVTIMEO,
+		&timeout, sizeof(timeout)) ||
+		setsockopt(state->socketfd, SOL_SOCKET, SO_SNDTIMEO,
+		&timeout, sizeof(timeout)) ||
+		(tuning->defer_accept && !set_option(state->socketfd,
+		IPPROTO_TCP, TCP_DEFER_ACCEPT, tuning->defer_accept,
+		"TCP_DEFER_ACCEPT")) ||
+		(tuning->fastopen && !set_option(state->socketfd,
+		IPPROTO_TCP, TCP_FASTOPEN, tuning->fastopen, "TCP_FASTOPEN")) ||
+		(tuning->busy_poll && !set_option(state->socketfd,
+		SOL_SOCKET, SO_BUSY_POLL, tuning->busy_poll, "SO_BUSY_POLL")))
+	{
+		close(state->socketfd);
+		return SERVER_ERROR;
+	}
+
 	/* Bind the socket to the port */
 	memset(&state->addr, 0x0, sizeof(state->addr));
 	state->addr.sin_family = AF_INET;
@@ -39,7 +108,9 @@ int server_create(struct server_state *state, int port) {
 	}
 
 	/* Start listening */
-	if (listen(state->socketfd, MAX_REQUESTS)) {
+	if (listen(state->socketfd,
+		tuning->backlog ? tuning->backlog : SERVER_BACKLOG))
+	{
 		printf("listen() error\n");
 		return SERVER_ERROR;
 	}
@@ -51,58 +122,91 @@ int server_listen(struct server_state *state, char **addr) {
 	struct sockaddr_in connection_addr;
 	socklen_t connection_len;
 	int connectionfd;
-	struct timeval recv_timeout;
-	struct timeval send_timeout;
 
-	/* Set up listener info (zero it) */
-	connection_len = sizeof(connection_addr);
-	memset(&connection_addr, 0x0, connection_len);
-
-	/* Wait for an incomming connection */
-	connectionfd = accept(state->socketfd, 
-		(struct sockaddr*)&connection_addr, &connection_len);
+	/*
+	 * Wait for an incomming connection. The listener's timeouts apply to
+	 * waiting as well, so just keep waiting when it times out, or when a
+	 * signal cuts it short: With a timeout it isn't restarted, even with
+	 * SA_RESTART. The connection has the timeouts already.
+	 */
+	do {
+		connection_len = sizeof(connection_addr);
+		memset(&connection_addr, 0x0, connection_len);
+		connectionfd = accept4(state->socketfd,
+			(struct sockaddr*)&connection_addr, &connection_len,
+			SOCK_CLOEXEC);
+	} while (connectionfd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+		errno == EINTR || errno == ECONNABORTED));
 
 	/* Check that the connection succeeded */
 	if (connectionfd < 0) {
 		return SERVER_ERROR;
 	}
 
-	/* 
-	 * Configure the read / write timeout on a socket
-	 * Read Timeout: 10 seconds
-	 * Write Timeout: 10 seconds
-	 * Code From: 
-	 *   http://stackoverflow.com/questions/2876024/linux-is-there-
-	 *     a-read-or-recv-from-socket-with-timeout
-	 */
-	recv_timeout.tv_sec = 10;
-	recv_timeout.tv_usec = 0;
-	if (-1 == setsockopt(connectionfd, SOL_SOCKET, SO_RCVTIMEO, 
-		(char*)&recv_timeout, sizeof(struct timeval))) 
+	/* Get the source IP as a string. */
+	*addr = inet_ntoa(connection_addr.sin_addr);
+
+	/* Successful, return the connection */
+	return connectionfd;
+}
+
+int server_set_nonblocking(struct server_state *state) {
+	int flags;
+
+	/* Add O_NONBLOCK to the listener's flags */
+	flags = fcntl(state->socketfd, F_GETFL, 0);
+	if (flags == -1 || 
+		fcntl(state->socketfd, F_SETFL, flags | O_NONBLOCK) == -1) 
 	{
-		/* Failed to configure, close connection and return failure */
-		close(connectionfd);
 		return SERVER_ERROR;
 	}
 
-	send_timeout.tv_sec = 10;
-	send_timeout.tv_usec = 0;
-	if (-1 == setsockopt(connectionfd, SOL_SOCKET, SO_SNDTIMEO,
-		(char*)&send_timeout, sizeof(struct timeval)))
-	{
-		/* Failed to configure, close connection and return failure */
-		close(connectionfd);
+	return SERVER_OKAY;
+}
+
+int server_accept(struct server_state *state, char **addr) {
+	struct sockaddr_in connection_addr;
+	socklen_t connection_len;
+	int connectionfd;
+
+	/* Set up listener info (zero it) */
+	connection_len = sizeof(connection_addr);
+	memset(&connection_addr, 0x0, connection_len);
+
+	/*
+	 * Take a waiting connection if there is one. The connection is serviced
+	 * from an event loop, so it must never block; the event loop tracks
+	 * idle connections, the timeouts don't matter.
+	 */
+	connectionfd = accept4(state->socketfd,
+		(struct sockaddr*)&connection_addr, &connection_len,
+		SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (connectionfd < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+			errno == ECONNABORTED)
+		{
+			return SERVER_AGAIN;
+		}
 		return SERVER_ERROR;
 	}
 
 	/* Get the source IP as a string. */
 	*addr = inet_ntoa(connection_addr.sin_addr);
 
-	/* Successful, return the connection */
 	return connectionfd;
 }
 
 void server_destroy(struct server_state *state) {
 	/* Close the listener */
 	close(state->socketfd);
-}
\ No newline at end of file
+}
+
+void server_ignore_sigpipe() {
+	/*
+	 * The sends all pass MSG_NOSIGNAL, but sendfile and splice can't be
+	 * told not to raise SIGPIPE, so a client hanging up part way through a
+	 * file would kill the server. With it ignored they fail with EPIPE, and
+	 * the connection is closed like any other failed send.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+}
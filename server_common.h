@@ -13,6 +13,30 @@
 
 #define SERVER_OKAY   0
 #define SERVER_ERROR -1
+#define SERVER_AGAIN -2 /* No connection waiting on a non-blocking listener */
+
+/* Flags for server_create */
+#define SERVER_REUSEPORT 0x1 /* Share the port with other servers */
+
+/*
+ * How many connections may wait to be accepted if server_tuning doesn't
+ * say, the kernel caps it at net.core.somaxconn.
+ */
+#define SERVER_BACKLOG 511
+
+/* How long to wait for a connection to send something, in seconds */
+#define SERVER_TIMEOUT 10
+
+/*
+ * Optional tuning of a server's listening socket, 0 leaves each one as it
+ * was.
+ */
+struct server_tuning {
+	int backlog;      /* Accept queue length, SERVER_BACKLOG if 0 */
+	int defer_accept; /* TCP_DEFER_ACCEPT: Wake on data, up to this many s */
+	int fastopen;     /* TCP_FASTOPEN: How many pending TFO requests */
+	int busy_poll;    /* SO_BUSY_POLL: us to busy poll for, when reading */
+};
 
 /*
  * A structure holding the information about an open server session
@@ -28,10 +52,15 @@ struct server_state {
  * Parameters:
  *   state: The server state to initialize
  *   port: The port to listen on
+ *   flags: Some combination of the SERVER_* flags above
+ *   tuning: How to tune the listener, or NULL for the defaults. The
+ *           connections accepted from it inherit the busy polling, and
+ *           the SERVER_TIMEOUT read / write timeouts.
  * Returns:
  *   A status code representing whether the operation was sucessfull
  */
-int server_create(struct server_state *state, int port);
+int server_create(struct server_state *state, int port, int flags,
+	const struct server_tuning *tuning);
 
 
 /*
@@ -46,6 +75,30 @@ int server_create(struct server_state *state, int port);
 int server_listen(struct server_state *state, char **addr);
 
 
+/*
+ * Put the server's listening socket into non-blocking mode, for use with
+ * server_accept from an event loop.
+ * Returns:
+ *   A status code representing whether the operation was sucessfull
+ */
+int server_set_nonblocking(struct server_state *state);
+
+
+/*
+ * Accept an incomming connection without waiting for one, on a server that
+ * has been server_set_nonblocking'd. The connection is non-blocking as well.
+ * Call it until it returns SERVER_AGAIN to take a batch of them at once.
+ * Parameters:
+ *   state: The server state to accept on
+ *   addr:  Pointer to the address that the connection was accepted from
+ * Returns:
+ *   (positive) A file descriptor representing the opened connection.
+ *   SERVER_AGAIN if there are no more connections waiting to be accepted.
+ *   SERVER_ERROR if accepting failed.
+ */
+int server_accept(struct server_state *state, char **addr);
+
+
 /*
  * Destroy a server, should only be called on a server_state that was
  * successfully server_create'd.
@@ -53,4 +106,11 @@ int server_listen(struct server_state *state, char **addr);
 void server_destroy(struct server_state *state);
 
 
+/*
+ * Ignore SIGPIPE for the whole process, so that a client hanging up while
+ * it's response is being sent fails the send rather than killing the server.
+ */
+void server_ignore_sigpipe();
+
+
 #endif
\ No newline at end of file
@@ -0,0 +1,536 @@
+#include "args.h"
+#include "server_filesystem.h"
+#include "server_common.h"
+#include "server_http.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <memory.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+/* How many events to take from the kernel per epoll_wait */
+#define MAX_EVENTS 64
+
+/* How many connections to accept at most each time the listener is ready */
+#define ACCEPT_BATCH 64
+
+/*
+ * How long a connection may go without making any progress before it is
+ * dropped, the same as the read / write timeouts of the blocking servers.
+ */
+#define CONNECTION_TIMEOUT 10 /* seconds */
+
+/* States for a connection in the event loop to be in */
+#define CONN_STATE_READING 0
+#define CONN_STATE_WRITING 1
+
+/* Loctation to jump to on inturrepted */
+sigjmp_buf before_exit;
+
+/*
+ * Our interrupt handler
+ * We handle SIGINT for breaking out of the handler loop when not in daemonized
+ * mode. There are no child processes to reap.
+ */
+struct sigaction server_int_sigaction;
+
+
+/*
+ * A connection being served by the event loop. Connections are kept in a
+ * doubly linked list ordered by when they last made progress, so that the
+ * ones which have timed out are always at the front.
+ */
+struct event_conn {
+	struct http_conn http;
+	int state;
+	unsigned int events;
+	time_t last_active;
+	struct event_conn *prev;
+	struct event_conn *next;
+};
+
+
+/*
+ * The state of the event loop
+ */
+struct event_loop {
+	int epollfd;
+	struct server_filesystem *fs;
+	struct server_state *server;
+	struct event_conn *oldest;
+	struct event_conn *newest;
+};
+
+
+/* Forward declarations of functions */
+void sig_int_handler(int);
+void install_sig_handler();
+struct event_conn *conn_open(struct event_loop*, int fd, char *addr);
+void conn_close(struct event_loop*, struct event_conn*);
+void conn_touch(struct event_loop*, struct event_conn*);
+int conn_wait_for(struct event_loop*, struct event_conn*, unsigned int events);
+int conn_is_idle(struct event_conn*);
+void conn_handle(struct event_loop*, struct event_conn*);
+void accept_connections(struct event_loop*);
+void expire_connections(struct event_loop*);
+void serve_requests(struct server_filesystem*, struct server_state*);
+
+
+/* Signal handler for SIGINT */
+void sig_int_handler(int sig) {
+	/* On inturrupted, break out to the break-out-of-handler-loop jump point */
+	siglongjmp(before_exit, 1);
+}
+
+
+/* Install the signal handlers */
+void install_sig_handler() {
+	/* Install SIGINT */
+	memset(&server_int_sigaction, 0x0, sizeof(sigaction));
+	server_int_sigaction.sa_handler = sig_int_handler;
+	server_int_sigaction.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &server_int_sigaction, NULL);
+
+	/* Don't die when a client hangs up on us */
+	server_ignore_sigpipe();
+}
+
+
+/*
+ * Start tracking a newly accepted connection, and register it with epoll.
+ * Returns: The connection, or NULL if it could not be registered.
+ */
+struct event_conn *conn_open(struct event_loop *loop, int fd, char *addr) {
+	struct event_conn *conn;
+	struct epoll_event ev;
+
+	/* Set up the connection state */
+	conn = malloc(sizeof(struct event_conn));
+	http_conn_init(&conn->http, fd, addr);
+	conn->http.accepted = server_stats_now();
+	conn->state = CONN_STATE_READING;
+	conn->events = EPOLLIN;
+	conn->prev = NULL;
+	conn->next = NULL;
+
+	/* Wait for the request to arrive */
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		http_conn_destroy(&conn->http);
+		free(conn);
+		return NULL;
+	}
+
+	/* Put it at the back of the timeout list */
+	conn_touch(loop, conn);
+	server_stats_open(loop->fs->stats, conn->http.accepted);
+	return conn;
+}
+
+
+/*
+ * Stop tracking a connection, close it, and free it's state.
+ */
+void conn_close(struct event_loop *loop, struct event_conn *conn) {
+	/* Unlink from the timeout list */
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		loop->oldest = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	else
+		loop->newest = conn->prev;
+
+	/* Closing the fd also removes it from the epoll set */
+	shutdown(conn->http.fd, SHUT_RDWR);
+	close(conn->http.fd);
+	http_conn_destroy(&conn->http);
+	free(conn);
+	server_stats_close(loop->fs->stats);
+}
+
+
+/*
+ * Mark a connection as having made progress, moving it to the back of the
+ * timeout list.
+ */
+void conn_touch(struct event_loop *loop, struct event_conn *conn) {
+	conn->last_active = time(NULL);
+
+	/* Already at the back? */
+	if (loop->newest == conn)
+		return;
+
+	/* Unlink it if it's in the list */
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else if (loop->oldest == conn)
+		loop->oldest = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+
+	/* Link it in at the back */
+	conn->prev = loop->newest;
+	conn->next = NULL;
+	if (loop->newest)
+		loop->newest->next = conn;
+	else
+		loop->oldest = conn;
+	loop->newest = conn;
+}
+
+
+/*
+ * Change which readiness events epoll waits for on a connection.
+ * Returns 0 -> The change failed, the connection should be closed
+ *         1 -> Okay
+ */
+int conn_wait_for(struct event_loop *loop, struct event_conn *conn,
+	unsigned int events)
+{
+	struct epoll_event ev;
+
+	if (conn->events == events)
+		return 1;
+
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(loop->epollfd, EPOLL_CTL_MOD, conn->http.fd, &ev) == -1)
+		return 0;
+	conn->events = events;
+	return 1;
+}
+
+
+/*
+ * Is a connection sitting idle between requests?
+ */
+int conn_is_idle(struct event_conn *conn) {
+	return (conn->state == CONN_STATE_READING) &&
+		(conn->http.request_count > 0) && (conn->http.buffer_size == 0);
+}
+
+
+/*
+ * Advance a connection whose socket is ready: Read more of it's request
+ * and / or send more of it's response, going on to the next request on a
+ * persistent connection, and closing it when it's done.
+ */
+void conn_handle(struct event_loop *loop, struct event_conn *conn) {
+	int status;
+
+	conn_touch(loop, conn);
+
+	for (;;) {
+		/* Read more of the request */
+		if (conn->state == CONN_STATE_READING) {
+			status = http_conn_recv(&conn->http);
+			if (status == HTTP_CONN_AGAIN && conn->http.response_count == 0) {
+				/* Still waiting on more of the request */
+				if (!conn_wait_for(loop, conn, EPOLLIN))
+					conn_close(loop, conn);
+				return;
+			} else if (status == HTTP_CONN_CLOSED) {
+				/* The client hung up between requests */
+				conn_close(loop, conn);
+				return;
+			}
+
+			/* 
+			 * Request is complete (or bad), decide on a response, then go on
+			 * to any more pipelined requests that are already here. Once
+			 * there are no more, send the responses.
+			 */
+			if (status != HTTP_CONN_AGAIN) {
+				if (status == HTTP_CONN_DONE)
+					http_conn_dispatch(loop->fs, &conn->http);
+				else
+					http_conn_bad_request(&conn->http);
+				if (http_conn_next(&conn->http) && 
+					http_conn_batching(&conn->http))
+				{
+					continue;
+				}
+			}
+			conn->state = CONN_STATE_WRITING;
+		}
+
+		/* Send more of the response */
+		status = http_conn_send(&conn->http);
+		if (status == HTTP_CONN_AGAIN) {
+			/* The socket is full, wait until it can take more */
+			if (conn_wait_for(loop, conn, EPOLLOUT))
+				return;
+			status = HTTP_CONN_ERROR;
+		}
+
+		/* Done (or failed), log the result */
+		http_conn_finish(loop->fs, &conn->http);
+
+		/* Close the connection, unless it's persistent */
+		if (status != HTTP_CONN_DONE || !conn->http.keep_alive) {
+			conn_close(loop, conn);
+			return;
+		}
+
+		/* 
+		 * Go on to the next request, which may already be sitting in the
+		 * buffer.
+		 */
+		conn->state = CONN_STATE_READING;
+	}
+}
+
+
+/*
+ * Accept the connections waiting on the listener, up to ACCEPT_BATCH of
+ * them. Any more are left for the next time around the loop, so that a
+ * flood of them can't hold up the connections already open.
+ */
+void accept_connections(struct event_loop *loop) {
+	int i;
+
+	for (i = 0; i < ACCEPT_BATCH; ++i) {
+		char *addr;
+		int fd;
+
+		fd = server_accept(loop->server, &addr);
+		if (fd < 0) {
+			/* No more waiting, or a transient error on this one */
+			if (fd == SERVER_ERROR)
+				printf("Error trying to accept a connection.\n");
+			return;
+		}
+
+		/* Start serving it */
+		if (!conn_open(loop, fd, addr))
+			close(fd);
+	}
+}
+
+
+/*
+ * Drop any connections that have gone too long without making progress, or
+ * that have sat idle between requests for too long.
+ */
+void expire_connections(struct event_loop *loop) {
+	struct event_conn *conn;
+	struct event_conn *next;
+	time_t now;
+
+	/* 
+	 * Idle connections have the shorter timeout, so everything after the
+	 * first connection that is still within it can be skipped.
+	 */
+	now = time(NULL);
+	for (conn = loop->oldest; conn && 
+		conn->last_active < now - HTTP_KEEPALIVE_TIMEOUT; conn = next)
+	{
+		next = conn->next;
+		if (!conn_is_idle(conn) &&
+			conn->last_active >= now - CONNECTION_TIMEOUT)
+		{
+			continue;
+		}
+
+		/* If it got as far as responding, log how that went */
+		if (conn->state == CONN_STATE_WRITING)
+			http_conn_finish(loop->fs, &conn->http);
+		conn_close(loop, conn);
+	}
+}
+
+
+/*
+ * Main function to serve requests to the client, using a given server_state
+ * serving documents from a given server_filesystem.
+ * All connections are served from this one thread by a non-blocking epoll
+ * event loop, each one only costing an event_conn structure.
+ */
+void serve_requests(struct server_filesystem *fs, struct server_state *state) {
+	struct event_loop loop;
+	struct epoll_event ev;
+	struct epoll_event events[MAX_EVENTS];
+
+	/* Set up the loop */
+	memset(&loop, 0x0, sizeof(loop));
+	loop.fs = fs;
+	loop.server = state;
+	if ((loop.epollfd = epoll_create1(0)) == -1) {
+		printf("epoll_create1() error\n");
+		return;
+	}
+
+	/* Listen for new connections, the listener has a NULL data.ptr */
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (server_set_nonblocking(state) != SERVER_OKAY ||
+		epoll_ctl(loop.epollfd, EPOLL_CTL_ADD, state->socketfd, &ev) == -1)
+	{
+		printf("Could not listen for connections, terminating...\n");
+		close(loop.epollfd);
+		return;
+	}
+
+	for (;;) {
+		int count;
+		int i;
+
+		/* Wait for events, waking up every second to check timeouts */
+		count = epoll_wait(loop.epollfd, events, MAX_EVENTS, 1000);
+		if (count < 0) {
+			/* Interrupted by a signal is okay, anything else is fatal */
+			if (errno == EINTR)
+				continue;
+			printf("Error waiting for events, terminating...\n");
+			break;
+		}
+
+		/* Handle the events */
+		for (i = 0; i < count; ++i) {
+			if (events[i].data.ptr == NULL)
+				accept_connections(&loop);
+			else
+				conn_handle(&loop, events[i].data.ptr);
+		}
+
+		/* Drop the connections that have timed out */
+		expire_connections(&loop);
+	}
+
+	/* Close any connections still open */
+	while (loop.oldest)
+		conn_close(&loop, loop.oldest);
+	close(loop.epollfd);
+}
+
+
+/* Main program entry point */
+int main(int argc, char *argv[]) {
+	struct server_args args;
+	struct server_filesystem fs;
+	int fs_status;
+	struct server_state server;
+	int i;
+
+	/* Get the server arguments */
+	if (parse_args(&args, argc, argv) != ARGS_OKAY) {
+		print_usage("server_e");
+		return -1;
+	}
+
+	/*
+	 * Open the server filesystem (0 -> don't use flock, there is only one
+	 * process writing to the log)
+	 */
+	if ((fs_status = server_fs_create(&fs, args.server_root, args.log_file, 0))
+		!= FS_OKAY)
+	{
+		/* Failed to open the server filesystem, report and exit */
+		switch (fs_status) {
+		case FS_BADROOT:
+			printf("Could not access server root directory.\n");
+			break;
+		case FS_BADLOG:
+			printf("Could not open log file for writing.\n");
+			break;
+		case FS_INITERROR:
+			printf("Error initializing the file system access.\n");
+			break;
+		default:
+			printf("Unknown Error during startup.\n");
+		}
+		return -1;
+	}
+
+	/* Write a binary log if asked (-b) */
+	if (args.log_binary)
+		server_fs_enable_binary_log(&fs);
+
+	/* Let clients cache the files under some paths for a while (-e) */
+	for (i = 0; i < args.expires_count; ++i) {
+		server_fs_add_cache_policy(&fs, args.expires_prefix[i],
+			args.expires_max_age[i]);
+	}
+
+	/* Keep live stats, served at a URL of their own, if asked (-S) */
+	if (args.stats_path && server_fs_enable_stats(&fs, args.stats_path)
+		!= FS_OKAY)
+	{
+		printf("Could not start keeping stats, serving without them.\n");
+	}
+
+	/* Log the phases of each request (-t), and the slow ones (-l) */
+	if (args.log_timing)
+		server_fs_enable_timing_log(&fs);
+	if (args.slow_ms >= 0 &&
+		server_fs_enable_slow_log(&fs, args.slow_ms) != FS_OKAY)
+	{
+		printf("Could not open the slow request log, serving without it.\n");
+	}
+
+	/* Log asynchronously, dropping lines instead of waiting if asked (-d) */
+	if (server_fs_enable_async_log(&fs, 
+		args.log_drop ? LOG_FULL_DROP : LOG_FULL_BLOCK) != FS_OKAY)
+	{
+		printf("Could not start the log flusher, logging directly.\n");
+	}
+
+	/* Cache frequently requested files in memory (-c) */
+	if (args.cache_mb > 0 && server_fs_enable_cache(&fs, 
+		(size_t)args.cache_mb * 1024 * 1024) != FS_OKAY)
+	{
+		printf("Could not start the file cache, serving without it.\n");
+	}
+
+	/* Create the server state */
+	if (server_create(&server, args.port, 0, &args.tuning) != SERVER_OKAY) {
+		/*
+		 * Failed to create the server on the port requested, report
+		 * and exit
+		 */
+		printf("Could not start the server on port %d.\n", args.port);
+
+		/*
+		 * We already opened the filesystem, so before exiting, destroy
+		 * destroy the server_fs
+		 */
+		server_fs_destroy(&fs);
+
+		return -1;
+	}
+
+	/* Listen and serve new connections */
+	if (sigsetjmp(before_exit, 1) == 0) {
+		/*
+		 * With the jump point installed, now we can safely install the
+		 * signal handlers.
+		 */
+		install_sig_handler();
+
+		/* Go into the main handler loop */
+		serve_requests(&fs, &server);
+	} else {
+		/* User Ctrl-C requested exit (if not daemonized) */
+		printf("\nShutdown Requested, terminating...\n");
+	}
+
+	/* Close the server and fs */
+	server_destroy(&server);
+	if (server_fs_log_dropped(&fs) > 0)
+		printf("%lu log lines were dropped.\n", server_fs_log_dropped(&fs));
+	server_fs_destroy(&fs);
+
+	/* Done */
+	return 0;
+}
@@ -4,12 +4,30 @@
 #include "server_filesystem.h"
 #include "server_common.h"
 #include "server_http.h"
+#include "server_park.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <setjmp.h>
 #include <memory.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+/* How often a pre-forked worker looks for idle connections to close */
+#define PREFORK_EXPIRE_INTERVAL 1000 /* ms */
+
+
+/*
+ * A pre-forked worker's connection, which it parks while it's idle.
+ */
+struct prefork_conn {
+	struct parked_conn park;
+	struct http_idle idle;
+	char addr[16];
+};
+
 
 /* Forward declarations of functions */
 void sig_child_handler(int);
@@ -17,6 +35,15 @@ void sig_int_handler(int);
 void install_sig_handler();
 void uninstall_sig_handler();
 void serve_requests(struct server_filesystem*, struct server_state*);
+void serve_prefork_worker(struct server_filesystem*, struct server_state*);
+void serve_prefork_conn(struct server_filesystem*, struct park_lot*,
+	struct prefork_conn*, uint64_t accepted);
+void close_prefork_conn(struct server_filesystem*, struct prefork_conn*);
+pid_t start_prefork_worker(struct server_filesystem*, struct server_state*,
+	int count, int index, int cache_mb);
+void serve_prefork(struct server_filesystem*, struct server_state*,
+	pid_t *pids, int count, int cache_mb);
+void stop_prefork(pid_t *pids, int count);
 
 /* 
  * The PID of the main process, so that children can tell to do nothing
@@ -83,16 +110,25 @@ void install_sig_handler() {
 	server_int_sigaction.sa_handler = sig_int_handler;
 	server_int_sigaction.sa_flags = SA_RESTART;
 	sigaction(SIGINT, &server_int_sigaction, NULL);
+
+	/* Don't die when a client hangs up on us */
+	server_ignore_sigpipe();
 }
 
 
 /* Uninstall the signal handlers */
 void uninstall_sig_handler() {
+	struct sigaction default_sigaction;
+
+	/* Back to the default action */
+	memset(&default_sigaction, 0x0, sizeof(default_sigaction));
+	default_sigaction.sa_handler = SIG_DFL;
+
 	/* Uninstall SIGCHLD */
-	sigaction(SIGCHLD, NULL, NULL);
+	sigaction(SIGCHLD, &default_sigaction, NULL);
 
 	/* Uninstall SIGINT */
-	sigaction(SIGINT, NULL, NULL);
+	sigaction(SIGINT, &default_sigaction, NULL);
 }
 
 
@@ -104,12 +140,14 @@ void uninstall_sig_handler() {
  */
 void serve_requests(struct server_filesystem *fs, struct server_state *state) {
 	for (;;) {
+		uint64_t accepted;
 		char *addr;
 		int fd;
 
 		/* Do the listen */
 		if ((fd = server_listen(state, &addr)) > 0) {
 			/* Good request, fork off to a child process to handle it in */
+			accepted = server_stats_now();
 			if (fork() == 0) {
 				/* 
 				 * Close our copy of the server down, since we want the parent 
@@ -124,11 +162,16 @@ void serve_requests(struct server_filesystem *fs, struct server_state *state) {
 				 */
 				uninstall_sig_handler();
 
-				/* Serve the request as an http request */
-				handle_http_request(fs, fd, addr);
+				/*
+				 * Serve the request as an http request, counting it in the
+				 * stats shared with the main process, which outlive us.
+				 */
+				server_stats_open(fs->stats, accepted);
+				handle_http_request(fs, fd, addr, accepted, NULL);
 
 				/* Shutdown communications on the fd and close the fd handle */
 				shutdown(fd, SHUT_RDWR);
+				server_stats_close(fs->stats);
 
 				/* 
 				 * This fork has completed, end the process here.
@@ -139,6 +182,9 @@ void serve_requests(struct server_filesystem *fs, struct server_state *state) {
 				 */
 				exit(0);
 			}
+
+			/* The child has it's own copy of the connection now */
+			close(fd);
 		} else {
 			/* There was an error, exit */
 			printf("Error trying to accept a connection, terminating...\n");
@@ -147,12 +193,231 @@ void serve_requests(struct server_filesystem *fs, struct server_state *state) {
 	}
 }
 
+/*
+ * Serve a pre-forked worker's connection until it's done with, and close
+ * it, or until it's idle while something else is waiting, and park it.
+ */
+void serve_prefork_conn(struct server_filesystem *fs, struct park_lot *lot,
+	struct prefork_conn *conn, uint64_t accepted)
+{
+	if (handle_http_request(fs, conn->park.fd, conn->addr, accepted,
+		&conn->idle) && server_park(lot, &conn->park) == PARK_OKAY)
+	{
+		return;
+	}
+	close_prefork_conn(fs, conn);
+}
+
+
+/*
+ * Shut down and close a pre-forked worker's connection, and free it.
+ */
+void close_prefork_conn(struct server_filesystem *fs,
+	struct prefork_conn *conn)
+{
+	shutdown(conn->park.fd, SHUT_RDWR);
+	close(conn->park.fd);
+	server_stats_close(fs->stats);
+	free(conn);
+}
+
+
+/*
+ * Main function of a pre-forked worker process, serving requests from it's
+ * own listening socket until something goes wrong. Idle keep-alive
+ * connections are parked along with the listener, so that the worker is
+ * free to serve whichever has something for it first, rather than sitting
+ * on one.
+ */
+void serve_prefork_worker(struct server_filesystem *fs, 
+	struct server_state *state) 
+{
+	struct park_lot lot;
+	struct parked_conn *parked;
+	struct prefork_conn *conn;
+	uint64_t accepted;
+	char *addr;
+	int status;
+	int fd;
+
+	if (server_park_create(&lot, state->socketfd) != PARK_OKAY) {
+		printf("Error watching for connections, restarting...\n");
+		return;
+	}
+
+	for (;;) {
+		status = server_park_wait(&lot, PREFORK_EXPIRE_INTERVAL, &parked);
+		if (status == PARK_LISTENER) {
+			/* Do the listen */
+			if ((fd = server_listen(state, &addr)) <= 0) {
+				/* Let the main process start a new worker */
+				printf("Error trying to accept a connection, "
+					"restarting...\n");
+				break;
+			}
+
+			/* Serve it as an http connection */
+			accepted = server_stats_now();
+			server_stats_open(fs->stats, accepted);
+			conn = malloc(sizeof(struct prefork_conn));
+			if (!conn) {
+				shutdown(fd, SHUT_RDWR);
+				close(fd);
+				server_stats_close(fs->stats);
+				continue;
+			}
+			conn->park.fd = fd;
+			conn->park.data = conn;
+			conn->idle.fd = lot.epoll_fd;
+			conn->idle.claim = NULL;
+			conn->idle.arg = NULL;
+			conn->idle.requests = 0;
+			strncpy(conn->addr, addr, sizeof(conn->addr) - 1);
+			conn->addr[sizeof(conn->addr) - 1] = '\0';
+			serve_prefork_conn(fs, &lot, conn, accepted);
+		} else if (status == PARK_READY) {
+			/* The next request on a parked connection */
+			serve_prefork_conn(fs, &lot, (struct prefork_conn*)parked->data,
+				server_stats_now());
+		} else if (status == PARK_ERROR) {
+			printf("Error watching for connections, restarting...\n");
+			break;
+		}
+
+		/* Close the connections that have sat idle too long */
+		while ((parked = server_park_expired(&lot,
+			time(NULL) - HTTP_KEEPALIVE_TIMEOUT)))
+		{
+			close_prefork_conn(fs, (struct prefork_conn*)parked->data);
+		}
+	}
+	server_park_destroy(&lot);
+}
+
+
+/*
+ * Fork off the pre-forked worker process number |index|, serving from the
+ * |index|th of the |count| listening sockets, with a file cache of
+ * |cache_mb| MB of it's own.
+ * Returns: The worker's PID, or -1 if the fork failed.
+ */
+pid_t start_prefork_worker(struct server_filesystem *fs, 
+	struct server_state *servers, int count, int index, int cache_mb)
+{
+	pid_t pid;
+	int i;
+
+	if ((pid = fork()) != 0) {
+		/* Parent, or the fork failed */
+		return pid;
+	}
+
+	/* 
+	 * After the fork, we have to clear the signal handlers so that we don't
+	 * get additional signals that the child doesn't need. Ignore Ctrl-C, the
+	 * main process will tell us when to stop with a SIGTERM.
+	 */
+	uninstall_sig_handler();
+	signal(SIGINT, SIG_IGN);
+
+	/* Close the other workers' listeners, we only accept from our own */
+	for (i = 0; i < count; ++i) {
+		if (i != index)
+			server_destroy(&servers[i]);
+	}
+
+	/* 
+	 * A long lived worker serves enough requests to be worth caching files
+	 * for, which has to be set up here as inotify and threads don't carry
+	 * over a fork.
+	 */
+	if (cache_mb > 0 && server_fs_enable_cache(fs, 
+		(size_t)cache_mb * 1024 * 1024) != FS_OKAY)
+	{
+		printf("Could not start the file cache, serving without it.\n");
+	}
+
+	/* Serve requests until something goes wrong */
+	serve_prefork_worker(fs, &servers[index]);
+	exit(1);
+}
+
+
+/*
+ * Main function to serve requests to the client in pre-forked mode, using
+ * |count| long lived worker processes, each with it's own SO_REUSEPORT
+ * listener, so that the kernel spreads the connections across them rather
+ * than them all waking up to fight over one accept(). Workers that exit
+ * are restarted on the same listener. Returns if workers can't be started.
+ */
+void serve_prefork(struct server_filesystem *fs, struct server_state *servers,
+	pid_t *pids, int count, int cache_mb)
+{
+	int i;
+
+	/* Start all the workers */
+	for (i = 0; i < count; ++i) {
+		pids[i] = start_prefork_worker(fs, servers, count, i, cache_mb);
+		if (pids[i] < 0) {
+			printf("Could not start worker process, terminating...\n");
+			return;
+		}
+	}
+
+	for (;;) {
+		pid_t pid;
+
+		/* Wait for a worker to exit */
+		if ((pid = waitpid(WAIT_ANY, NULL, 0)) < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("Error waiting for worker processes, terminating...\n");
+			return;
+		}
+
+		/* Restart it on the same listener */
+		for (i = 0; i < count; ++i) {
+			if (pids[i] == pid) {
+				pids[i] = start_prefork_worker(fs, servers, count, i, 
+					cache_mb);
+				if (pids[i] < 0) {
+					printf("Could not restart worker process, "
+						"terminating...\n");
+					return;
+				}
+				break;
+			}
+		}
+	}
+}
+
+
+/*
+ * Stop all of the pre-forked worker processes, and wait for them to exit.
+ */
+void stop_prefork(pid_t *pids, int count) {
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		if (pids[i] > 0)
+			kill(pids[i], SIGTERM);
+	}
+	for (i = 0; i < count; ++i) {
+		if (pids[i] > 0)
+			waitpid(pids[i], NULL, 0);
+	}
+}
+
+
 /* Main program entry point */
 int main(int argc, char *argv[]) {
 	struct server_args args;
 	struct server_filesystem fs;
 	int fs_status;
-	struct server_state server;
+	struct server_state *servers;
+	pid_t *pids;
+	int count;
+	int i;
 
 	/* Get the server arguments */
 	if (parse_args(&args, argc, argv) != ARGS_OKAY) {
@@ -181,21 +446,67 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 
-	/* Create the server state */
-	if (server_create(&server, args.port) != SERVER_OKAY) {
-		/* 
-		 * Failed to create the server on the port requested, report 
-		 * and exit
-		 */
-		printf("Could not start the server on port %d.\n", args.port);
+	/* Write a binary log if asked (-b) */
+	if (args.log_binary)
+		server_fs_enable_binary_log(&fs);
 
-		/* 
-		 * We already opened the filesystem, so before exiting, destroy 
-		 * destroy the server_fs 
-		 */
-		server_fs_destroy(&fs);
+	/* Let clients cache the files under some paths for a while (-e) */
+	for (i = 0; i < args.expires_count; ++i) {
+		server_fs_add_cache_policy(&fs, args.expires_prefix[i],
+			args.expires_max_age[i]);
+	}
 
-		return -1;
+	/* Keep live stats, served at a URL of their own, if asked (-S) */
+	if (args.stats_path && server_fs_enable_stats(&fs, args.stats_path)
+		!= FS_OKAY)
+	{
+		printf("Could not start keeping stats, serving without them.\n");
+	}
+
+	/* Log the phases of each request (-t), and the slow ones (-l) */
+	if (args.log_timing)
+		server_fs_enable_timing_log(&fs);
+	if (args.slow_ms >= 0 &&
+		server_fs_enable_slow_log(&fs, args.slow_ms) != FS_OKAY)
+	{
+		printf("Could not open the slow request log, serving without it.\n");
+	}
+
+	/* Log asynchronously, dropping lines instead of waiting if asked (-d) */
+	if (server_fs_enable_async_log(&fs, 
+		args.log_drop ? LOG_FULL_DROP : LOG_FULL_BLOCK) != FS_OKAY)
+	{
+		printf("Could not start the log flusher, logging directly.\n");
+	}
+
+	/* 
+	 * Create the server states, one shared listener normally, or one
+	 * SO_REUSEPORT listener for each worker in pre-forked mode (-w).
+	 */
+	count = args.workers ? args.workers : 1;
+	servers = malloc(count * sizeof(struct server_state));
+	pids = malloc(count * sizeof(pid_t));
+	for (i = 0; i < count; ++i) {
+		pids[i] = -1;
+		if (server_create(&servers[i], args.port, 
+			args.workers ? SERVER_REUSEPORT : 0, &args.tuning) != SERVER_OKAY)
+		{
+			/* 
+			 * Failed to create the server on the port requested, report 
+			 * and exit
+			 */
+			printf("Could not start the server on port %d.\n", args.port);
+
+			/* 
+			 * We already opened the filesystem and any other servers, so 
+			 * before exiting, destroy them.
+			 */
+			while (i-- > 0)
+				server_destroy(&servers[i]);
+			server_fs_destroy(&fs);
+
+			return -1;
+		}
 	}
 
 	/* Listen and serve new connections */
@@ -207,16 +518,31 @@ int main(int argc, char *argv[]) {
 		install_sig_handler();
 
 		/* Go into the main handler loop */
-		serve_requests(&fs, &server);
+		if (args.workers) {
+			/* 
+			 * The workers are reaped and restarted by serve_prefork, not 
+			 * by the SIGCHLD handler.
+			 */
+			signal(SIGCHLD, SIG_DFL);
+			serve_prefork(&fs, servers, pids, count, args.cache_mb);
+		} else {
+			serve_requests(&fs, &servers[0]);
+		}
 	} else {
 		/* User Ctrl-C requested exit (if not daemonized) */
 		printf("\nShutdown Requested, terminating...\n");
 	}
 
-	/* Close the server and fs */
-	server_destroy(&server);
+	/* Stop any workers, then close the servers and fs */
+	stop_prefork(pids, count);
+	for (i = 0; i < count; ++i)
+		server_destroy(&servers[i]);
+	if (server_fs_log_dropped(&fs) > 0)
+		printf("%lu log lines were dropped.\n", server_fs_log_dropped(&fs));
 	server_fs_destroy(&fs);
+	free(servers);
+	free(pids);
 
 	/* Done */
 	return 0;
-}
\ No newline at end of file
+}
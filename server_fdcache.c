@@ -0,0 +1,277 @@
+#include "server_fdcache.h"
+#include "server_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Size of the hash table, must be a power of two */
+#define FDCACHE_BUCKETS 1024
+
+/* How long an entry is trusted before re-checking the file, in seconds */
+#define FDCACHE_TTL 1
+
+/* Private function forward declarations */
+struct fd_entry *fdcache_find(struct fd_cache *cache, const char *path,
+	unsigned int hash);
+void fdcache_lru_unlink(struct fd_cache *cache, struct fd_entry *entry);
+void fdcache_lru_push(struct fd_cache *cache, struct fd_entry *entry);
+void fdcache_remove(struct fd_cache *cache, struct fd_entry *entry);
+void fdcache_free_entry(struct fd_entry *entry);
+int fdcache_changed(struct fd_cache *cache, struct fd_entry *entry);
+
+
+/*
+ * Find the entry for a path, the lock must be held
+ */
+struct fd_entry *fdcache_find(struct fd_cache *cache, const char *path,
+	unsigned int hash)
+{
+	struct fd_entry *entry;
+
+	for (entry = cache->buckets[hash & cache->bucket_mask]; entry;
+		entry = entry->hash_next)
+	{
+		if (entry->hash == hash && !strcmp(entry->path, path))
+			return entry;
+	}
+	return NULL;
+}
+
+
+/*
+ * Take an entry out of the LRU list, the lock must be held
+ */
+void fdcache_lru_unlink(struct fd_cache *cache, struct fd_entry *entry) {
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+
+/*
+ * Put an entry at the most recently used end of the LRU list, the lock must
+ * be held
+ */
+void fdcache_lru_push(struct fd_cache *cache, struct fd_entry *entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+
+/*
+ * Remove an entry from the cache, closing and freeing it unless it's still
+ * in use, in which case the last server_fdcache_release does. The lock must
+ * be held.
+ */
+void fdcache_remove(struct fd_cache *cache, struct fd_entry *entry) {
+	struct fd_entry **link;
+
+	/* Out of the hash table */
+	link = &cache->buckets[entry->hash & cache->bucket_mask];
+	while (*link != entry)
+		link = &(*link)->hash_next;
+	*link = entry->hash_next;
+
+	/* Out of the LRU list */
+	fdcache_lru_unlink(cache, entry);
+	--cache->entries;
+
+	/* Free it, or leave that to the last user */
+	entry->stale = 1;
+	if (entry->refcount == 0)
+		fdcache_free_entry(entry);
+}
+
+
+/*
+ * Close and free an entry that is no longer in the cache or in use
+ */
+void fdcache_free_entry(struct fd_entry *entry) {
+	close(entry->fd);
+	free(entry->path);
+	free(entry);
+}
+
+
+/*
+ * Has the file an entry was opened from changed, or gone, since? Looks the
+ * path up from the root directory's fd, so the lock needn't (and shouldn't)
+ * be held: Only the entry's unchanging fields are read, and a reference
+ * must be held on it.
+ * Returns 1 -> It changed
+ *         0 -> It's still the same file
+ */
+int fdcache_changed(struct fd_cache *cache, struct fd_entry *entry) {
+	struct stat st_buf;
+	const char *path;
+
+	/* Relative to the root, which is itself "." */
+	path = entry->path + cache->root_len;
+	while (*path == '/')
+		++path;
+	if (!*path)
+		path = ".";
+
+	return fstatat(cache->root_fd, path, &st_buf, 0) == -1 ||
+		st_buf.st_ino != entry->ino || st_buf.st_dev != entry->dev ||
+		st_buf.st_size != entry->size ||
+		st_buf.st_mtime != entry->mtime;
+}
+
+
+int server_fdcache_create(struct fd_cache *cache, int max_entries,
+	int root_fd, size_t root_len)
+{
+	memset(cache, 0x0, sizeof(struct fd_cache));
+	cache->root_fd = root_fd;
+	cache->root_len = root_len;
+	cache->max_entries = max_entries;
+	cache->bucket_mask = FDCACHE_BUCKETS - 1;
+	cache->buckets = calloc(FDCACHE_BUCKETS, sizeof(struct fd_entry*));
+	if (!cache->buckets)
+		return FDCACHE_ERROR;
+	if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+		free(cache->buckets);
+		return FDCACHE_ERROR;
+	}
+	return FDCACHE_OKAY;
+}
+
+
+struct fd_entry *server_fdcache_get(struct fd_cache *cache, const char *path) {
+	struct fd_entry *entry;
+	unsigned int hash;
+	time_t now;
+	int changed;
+
+	hash = server_cache_hash(path);
+	now = time(NULL);
+
+	pthread_mutex_lock(&cache->lock);
+	if (!(entry = fdcache_find(cache, path, hash))) {
+		++cache->misses;
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+
+	/*
+	 * Trust it for FDCACHE_TTL seconds after it was last checked, after
+	 * that make sure the path still names the same unchanged file. The
+	 * lock is let go of meanwhile, holding on to the entry, so the other
+	 * threads aren't held up by the lookup.
+	 */
+	++entry->refcount;
+	if (now - entry->validated >= FDCACHE_TTL) {
+		pthread_mutex_unlock(&cache->lock);
+		changed = fdcache_changed(cache, entry);
+		pthread_mutex_lock(&cache->lock);
+		if (changed) {
+			/*
+			 * Drop it (unless another thread already has) and let the
+			 * caller open it again.
+			 */
+			if (!entry->stale)
+				fdcache_remove(cache, entry);
+			if (--entry->refcount == 0)
+				fdcache_free_entry(entry);
+			++cache->misses;
+			pthread_mutex_unlock(&cache->lock);
+			return NULL;
+		}
+		entry->validated = now;
+	}
+
+	/*
+	 * Good, use it. If it was replaced meanwhile, it's still the same file,
+	 * but it's not in the LRU list any more.
+	 */
+	if (!entry->stale) {
+		fdcache_lru_unlink(cache, entry);
+		fdcache_lru_push(cache, entry);
+	}
+	++cache->hits;
+	pthread_mutex_unlock(&cache->lock);
+	return entry;
+}
+
+
+struct fd_entry *server_fdcache_put(struct fd_cache *cache, const char *path,
+	int fd, struct stat *st_buf, int cachable)
+{
+	struct fd_entry *entry;
+	struct fd_entry *existing;
+
+	/* Set up the entry */
+	entry = malloc(sizeof(struct fd_entry));
+	entry->path = malloc(strlen(path) + 1);
+	strcpy(entry->path, path);
+	entry->hash = server_cache_hash(path);
+	entry->fd = fd;
+	entry->size = st_buf->st_size;
+	entry->mtime = st_buf->st_mtime;
+	entry->ino = st_buf->st_ino;
+	entry->dev = st_buf->st_dev;
+	entry->cachable = cachable;
+	entry->validated = time(NULL);
+	entry->refcount = 1;
+	entry->stale = 0;
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* Replace any older copy that another thread put in meanwhile */
+	if ((existing = fdcache_find(cache, path, entry->hash)))
+		fdcache_remove(cache, existing);
+
+	/* Make room for it */
+	while (cache->entries >= cache->max_entries && cache->lru_tail)
+		fdcache_remove(cache, cache->lru_tail);
+
+	/* Add it */
+	entry->hash_next = cache->buckets[entry->hash & cache->bucket_mask];
+	cache->buckets[entry->hash & cache->bucket_mask] = entry;
+	fdcache_lru_push(cache, entry);
+	++cache->entries;
+
+	pthread_mutex_unlock(&cache->lock);
+	return entry;
+}
+
+
+void server_fdcache_release(struct fd_cache *cache, struct fd_entry *entry) {
+	pthread_mutex_lock(&cache->lock);
+	if (--entry->refcount == 0 && entry->stale)
+		fdcache_free_entry(entry);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+void server_fdcache_get_stats(struct fd_cache *cache, unsigned long *hits,
+	unsigned long *misses, int *entries)
+{
+	pthread_mutex_lock(&cache->lock);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	*entries = cache->entries;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+void server_fdcache_destroy(struct fd_cache *cache) {
+	while (cache->lru_head)
+		fdcache_remove(cache, cache->lru_head);
+	free(cache->buckets);
+	pthread_mutex_destroy(&cache->lock);
+}
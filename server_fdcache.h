@@ -0,0 +1,111 @@
+#ifndef SERVER_FDCACHE_H_
+#define SERVER_FDCACHE_H_
+
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+/* Status codes returned by server_fdcache_create */
+#define FDCACHE_OKAY   0
+#define FDCACHE_ERROR -1
+
+
+/*
+ * An open file held in the fd cache, along with it's metadata. Requests
+ * for the same file share the one fd (they send from it by offset, never
+ * moving it's file position), and it's reference counted so that it isn't
+ * closed while any of them are still using it.
+ */
+struct fd_entry {
+	char *path;
+	unsigned int hash;
+	int fd;
+	size_t size;
+	time_t mtime;
+	ino_t ino;
+	dev_t dev;
+	int cachable;
+	time_t validated;
+	int refcount;
+	int stale;
+	struct fd_entry *hash_next;
+	struct fd_entry *lru_prev;
+	struct fd_entry *lru_next;
+};
+
+
+/*
+ * A cache of recently used open files keyed by their full path, safe to
+ * share between threads.
+ * An entry is trusted for a short time after it was last checked, after
+ * that it is re-stat'd to make sure that the file is still the same one.
+ * That's done relative to the root directory's fd, |root_fd|, which is the
+ * first |root_len| characters of each path, and without holding the lock.
+ */
+struct fd_cache {
+	pthread_mutex_t lock;
+	int root_fd;
+	size_t root_len;
+	struct fd_entry **buckets;
+	unsigned int bucket_mask;
+	struct fd_entry *lru_head;
+	struct fd_entry *lru_tail;
+	int entries;
+	int max_entries;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+
+/*
+ * Initialize an fd cache keeping at most |max_entries| files open, from
+ * under the root directory open as |root_fd|, with a path |root_len| long.
+ * Returns: FDCACHE_OKAY on success, or FDCACHE_ERROR on failure.
+ */
+int server_fdcache_create(struct fd_cache *cache, int max_entries,
+	int root_fd, size_t root_len);
+
+
+/*
+ * Look up the open file with the given full path.
+ * Returns: The entry with a reference held on it, which must be given back
+ *          with server_fdcache_release, or NULL if it isn't cached (or it
+ *          was, but the file has since changed).
+ */
+struct fd_entry *server_fdcache_get(struct fd_cache *cache, const char *path);
+
+
+/*
+ * Add a newly opened file to the cache, which takes ownership of |fd|.
+ * Returns: The new entry with a reference held on it, as server_fdcache_get.
+ */
+struct fd_entry *server_fdcache_put(struct fd_cache *cache, const char *path,
+	int fd, struct stat *st_buf, int cachable);
+
+
+/*
+ * Give back a reference to an entry from server_fdcache_get/put.
+ */
+void server_fdcache_release(struct fd_cache *cache, struct fd_entry *entry);
+
+
+/*
+ * Get how many lookups have hit and missed, and how many files are open.
+ */
+void server_fdcache_get_stats(struct fd_cache *cache, unsigned long *hits,
+	unsigned long *misses, int *entries);
+
+
+/*
+ * Destroy an fd_cache, closing it's files. Should only be called on an
+ * fd_cache that was successfully server_fdcache_create'd, with no entries
+ * still in use.
+ */
+void server_fdcache_destroy(struct fd_cache *cache);
+
+
+#endif
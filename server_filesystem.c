@@ -10,9 +10,37 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <limits.h>
+
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+/* How many files to keep open in the fd cache */
+#define FS_FDCACHE_ENTRIES 256
+
+/* How many missing paths to remember, must be a power of two */
+#define FS_NEGCACHE_ENTRIES 1024
+
+/*
+ * How files are opened to serve. Non-blocking so that opening a FIFO can't
+ * hang, it makes no difference to regular files.
+ */
+#define FS_OPEN_FLAGS (O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)
 
 /* Private function forward declarations */
 int check_path(char *path);
+void normalize_path(char *path);
+int full_path(struct server_filesystem *fs, char *path, char *fullpath);
+int root_openat(struct server_filesystem *fs, const char *path,
+	int no_symlinks);
+int root_walk(struct server_filesystem *fs, const char *path);
+int root_open(struct server_filesystem *fs, const char *path, int *fd,
+	struct stat *st_buf, int *cachable);
+void log_lock(struct server_filesystem *fs);
+void log_unlock(struct server_filesystem *fs);
 
 /* 
  * Check that a path does not "ascend" upwards past it's root using `..`
@@ -58,6 +86,215 @@ int check_path(char *path) {
 }
 
 
+/*
+ * Lexically normalize a path that has passed check_path, in place: Collapse
+ * repeated slashes, and remove `.` and `dir/..` components. That way there
+ * is only one name for each file, to key the cache by.
+ */
+void normalize_path(char *path) {
+	char *in;
+	char *out;
+
+	in = path;
+	out = path;
+	while (*in) {
+		char *segment;
+		size_t length;
+
+		/* Copy a slash, collapsing any repeats */
+		if (*in == '/') {
+			if (out == path || out[-1] != '/')
+				*out++ = '/';
+			++in;
+			continue;
+		}
+
+		/* Get the next path segment */
+		segment = in;
+		while (*in && *in != '/')
+			++in;
+		length = in - segment;
+
+		if (length == 1 && segment[0] == '.') {
+			/* `.` -> Skip it, and the slash after it */
+			if (*in == '/')
+				++in;
+		} else if (length == 2 && segment[0] == '.' && segment[1] == '.') {
+			/* `..` -> Back up over the previous segment */
+			if (out > path && out[-1] == '/')
+				--out;
+			while (out > path && out[-1] != '/')
+				--out;
+			if (out == path && *path == '/')
+				++out;
+			if (*in == '/')
+				++in;
+		} else {
+			/* Normal segment, keep it */
+			memmove(out, segment, length);
+			out += length;
+		}
+	}
+	*out = '\0';
+}
+
+
+/*
+ * Check and normalize a request's |path| (in place), and join it to the
+ * server root directory into |fullpath|, which has room for PATH_MAX.
+ * Returns: FS_OKAY on success, or an fs_open status code.
+ */
+int full_path(struct server_filesystem *fs, char *path, char *fullpath) {
+	size_t rootlen;
+	size_t pathlen;
+
+	/* 
+	 * Check for /../blah shenanigans in the path: Don't let the user
+	 * use ..s to ascend up past the root directory and access file that
+	 * we don't want to be serving.
+	 */
+	if (!check_path(path)) {
+		return FS_EFILE_FORBIDDEN;
+	}
+
+	/* 
+	 * Concatenate the path with the server root directory into a single 
+	 * path entry.
+	 */
+	normalize_path(path);
+	rootlen = fs->root_len;
+	pathlen = strlen(path);
+	if (rootlen + pathlen + 1 > PATH_MAX) {
+		return FS_EFILE_NOTFOUND;
+	}
+	memcpy(fullpath, fs->root_dir, rootlen);
+	memcpy(fullpath + rootlen, path, pathlen + 1);
+	return FS_OKAY;
+}
+
+
+/*
+ * Open a |path| relative to the server root directory, resolving it with
+ * openat2 so that neither `..` nor a symlink can take it outside the root.
+ * With |no_symlinks|, fails with ELOOP rather than follow any symlinks.
+ * Falls back to root_walk if the kernel doesn't have openat2.
+ * Returns: The fd, or -1 with errno set.
+ */
+int root_openat(struct server_filesystem *fs, const char *path,
+	int no_symlinks)
+{
+	struct open_how how;
+	int fd;
+
+	if (!fs->no_openat2) {
+		memset(&how, 0x0, sizeof(how));
+		how.flags = FS_OPEN_FLAGS;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		if (no_symlinks)
+			how.resolve |= RESOLVE_NO_SYMLINKS;
+		fd = syscall(SYS_openat2, fs->root_fd, path, &how, sizeof(how));
+		if (fd >= 0 || errno != ENOSYS)
+			return fd;
+
+		/* An older kernel, walk the paths ourselves from now on */
+		fs->no_openat2 = 1;
+	}
+	return root_walk(fs, path);
+}
+
+
+/*
+ * Open a |path| relative to the server root directory without openat2, a
+ * directory at a time, refusing to follow a symlink anywhere along it. The
+ * path must be normalized, with no `..` left in it to climb out with.
+ * Returns: The fd, or -1 with errno set.
+ */
+int root_walk(struct server_filesystem *fs, const char *path) {
+	char name[NAME_MAX + 1];
+	const char *end;
+	size_t length;
+	int dirfd;
+	int fd;
+	int error;
+
+	dirfd = fs->root_fd;
+	while ((end = strchr(path, '/'))) {
+		length = end - path;
+		if (length > NAME_MAX) {
+			fd = -1;
+			error = ENAMETOOLONG;
+			goto done;
+		}
+		memcpy(name, path, length);
+		name[length] = '\0';
+		fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			O_CLOEXEC);
+		error = errno;
+		if (dirfd != fs->root_fd)
+			close(dirfd);
+		if (fd == -1) {
+			errno = error;
+			return -1;
+		}
+		dirfd = fd;
+		path = end + 1;
+	}
+
+	/* The last part, or the directory itself if the path ends in a slash */
+	fd = openat(dirfd, *path ? path : ".", FS_OPEN_FLAGS | O_NOFOLLOW);
+	error = errno;
+
+done:
+	if (dirfd != fs->root_fd)
+		close(dirfd);
+	errno = error;
+	return fd;
+}
+
+
+/*
+ * Open a checked and normalized request |path| under the server root
+ * directory into |fd|, and fstat it into |st_buf|. If it was only reached
+ * through a symlink, clear |cachable|: Changes to the file it links to
+ * can't be watched for.
+ * Returns: FS_OKAY on success, or an fs_open status code.
+ */
+int root_open(struct server_filesystem *fs, const char *path, int *fd,
+	struct stat *st_buf, int *cachable)
+{
+	/* Relative to the root, which is itself "." */
+	if (*path == '/')
+		++path;
+	if (!*path)
+		path = ".";
+
+	/*
+	 * Try it without symlinks first when caching, so it only takes one
+	 * system call to open a cachable file.
+	 */
+	*fd = root_openat(fs, path, *cachable);
+	if (*fd == -1 && errno == ELOOP && *cachable && !fs->no_openat2) {
+		*cachable = 0;
+		*fd = root_openat(fs, path, 0);
+	}
+	if (*fd == -1) {
+		/* EXDEV -> It tried to leave the root */
+		return (errno == EXDEV) ? FS_EFILE_FORBIDDEN : FS_EFILE_NOTFOUND;
+	}
+
+	/* Check that the file is a file and not a directory */
+	if (fstat(*fd, st_buf) == -1) {
+		close(*fd);
+		return FS_EFILE_INTERNAL;
+	}
+	if (!S_ISREG(st_buf->st_mode)) {
+		close(*fd);
+		return FS_EFILE_FORBIDDEN;
+	}
+	return FS_OKAY;
+}
+
+
 int server_fs_create(struct server_filesystem *fs, char *rootDirectory, 
 	char *logFile, int useflock)
 {
@@ -75,6 +312,13 @@ int server_fs_create(struct server_filesystem *fs, char *rootDirectory,
 		return FS_BADROOT;
 	} 
 
+	/* Keep it open, to look files up from */
+	fs->root_fd = open(rootDirectory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fs->root_fd == -1) {
+		return FS_BADROOT;
+	}
+	fs->no_openat2 = 0;
+
 	/* 
 	 * Check that the logFile is a valid file
 	 * either it must not exist, so that we can make it, or
@@ -104,76 +348,487 @@ int server_fs_create(struct server_filesystem *fs, char *rootDirectory,
 
 	/* Done setup, all good */
 	fs->root_dir = rootDirectory;
+	fs->root_len = strlen(rootDirectory);
 	fs->log_dir = logFile;
+	fs->cache = NULL;
+	fs->fdcache = NULL;
+	fs->negcache = NULL;
+	fs->log = NULL;
+	fs->log_binary = 0;
+	fs->stats = NULL;
+	fs->log_timing = 0;
+	fs->slow_fd = -1;
+	fs->slow_us = 0;
+	fs->policy_count = 0;
+	return FS_OKAY;
+}
+
+
+int server_fs_enable_cache(struct server_filesystem *fs, size_t memory_cap) {
+	/* Set up the open file cache */
+	fs->fdcache = malloc(sizeof(struct fd_cache));
+	if (server_fdcache_create(fs->fdcache, FS_FDCACHE_ENTRIES,
+		fs->root_fd, fs->root_len) != FDCACHE_OKAY)
+	{
+		free(fs->fdcache);
+		fs->fdcache = NULL;
+		return FS_INITERROR;
+	}
+
+	/* Set up the content cache */
+	fs->cache = malloc(sizeof(struct content_cache));
+	if (server_cache_create(fs->cache, memory_cap) != CACHE_OKAY) {
+		free(fs->cache);
+		fs->cache = NULL;
+		return FS_INITERROR;
+	}
+
+	/* Set up the cache of missing paths */
+	fs->negcache = malloc(sizeof(struct neg_cache));
+	if (server_negcache_create(fs->negcache, FS_NEGCACHE_ENTRIES)
+		!= NEGCACHE_OKAY)
+	{
+		free(fs->negcache);
+		fs->negcache = NULL;
+		return FS_INITERROR;
+	}
+
+	return FS_OKAY;
+}
+
+
+int server_fs_enable_async_log(struct server_filesystem *fs, int full_policy)
+{
+	fs->log = malloc(sizeof(struct server_log));
+	if (server_log_create(fs->log, fs->log_fd, full_policy) != LOG_OKAY) {
+		free(fs->log);
+		fs->log = NULL;
+		return FS_INITERROR;
+	}
+
 	return FS_OKAY;
 }
 
 
-int server_fs_open(struct server_filesystem *fs, char *path) {
-	size_t totallen;
-	char *fullpath;
+int server_fs_enable_stats(struct server_filesystem *fs, const char *path) {
+	fs->stats = malloc(sizeof(struct server_stats));
+	if (server_stats_create(fs->stats, path) != STATS_OKAY) {
+		free(fs->stats);
+		fs->stats = NULL;
+		return FS_INITERROR;
+	}
+
+	return FS_OKAY;
+}
+
+
+size_t server_fs_format_stats(struct server_filesystem *fs, char *buffer,
+	size_t len)
+{
+	struct cache_stats cache;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long neg_hits;
+	unsigned long neg_misses;
+	size_t used;
+	int entries;
+	int neg_entries;
+	int length;
+
+	used = server_stats_format(fs->stats, buffer, len);
+
+	/* The log, if it's asynchronous */
+	if (fs->log && used < len) {
+		length = snprintf(buffer + used, len - used,
+			"# TYPE log_backlog gauge\n"
+			"log_backlog %u\n"
+			"# TYPE log_dropped_total counter\n"
+			"log_dropped_total %lu\n",
+			server_log_backlog(fs->log), server_log_dropped(fs->log));
+		if (length > 0)
+			used += ((size_t)length < len - used) ? length : len - used - 1;
+	}
+
+	/*
+	 * The caches, which each process has it's own of, so with pre-forked
+	 * workers these are just the ones of the worker that was asked.
+	 */
+	if (fs->cache && used < len) {
+		server_cache_get_stats(fs->cache, &cache);
+		server_fdcache_get_stats(fs->fdcache, &hits, &misses, &entries);
+		neg_hits = neg_misses = 0;
+		neg_entries = 0;
+		if (fs->negcache) {
+			server_negcache_get_stats(fs->negcache, &neg_hits, &neg_misses,
+				&neg_entries);
+		}
+		length = snprintf(buffer + used, len - used,
+			"# TYPE cache_hits_total counter\n"
+			"cache_hits_total %lu\n"
+			"# TYPE cache_misses_total counter\n"
+			"cache_misses_total %lu\n"
+			"# TYPE cache_admitted_total counter\n"
+			"cache_admitted_total %lu\n"
+			"# TYPE cache_rejected_total counter\n"
+			"cache_rejected_total %lu\n"
+			"# TYPE cache_evicted_total counter\n"
+			"cache_evicted_total %lu\n"
+			"# TYPE cache_invalidated_total counter\n"
+			"cache_invalidated_total %lu\n"
+			"# TYPE cache_memory_bytes gauge\n"
+			"cache_memory_bytes %lu\n"
+			"# TYPE cache_entries gauge\n"
+			"cache_entries %lu\n"
+			"# TYPE fdcache_hits_total counter\n"
+			"fdcache_hits_total %lu\n"
+			"# TYPE fdcache_misses_total counter\n"
+			"fdcache_misses_total %lu\n"
+			"# TYPE fdcache_entries gauge\n"
+			"fdcache_entries %d\n"
+			"# TYPE negcache_hits_total counter\n"
+			"negcache_hits_total %lu\n"
+			"# TYPE negcache_misses_total counter\n"
+			"negcache_misses_total %lu\n"
+			"# TYPE negcache_entries gauge\n"
+			"negcache_entries %d\n",
+			cache.hits, cache.misses, cache.admitted, cache.rejected,
+			cache.evicted, cache.invalidated,
+			(unsigned long)cache.memory_used, (unsigned long)cache.entries,
+			hits, misses, entries, neg_hits, neg_misses, neg_entries);
+		if (length > 0)
+			used += ((size_t)length < len - used) ? length : len - used - 1;
+	}
+
+	return used;
+}
+
+
+void server_fs_enable_binary_log(struct server_filesystem *fs) {
+	fs->log_binary = 1;
+}
+
+
+void server_fs_enable_timing_log(struct server_filesystem *fs) {
+	fs->log_timing = 1;
+}
+
+
+int server_fs_enable_slow_log(struct server_filesystem *fs, int threshold_ms) {
+	char slowFile[PATH_MAX];
+
+	if (snprintf(slowFile, sizeof(slowFile), "%s.slow", fs->log_dir) >=
+		(int)sizeof(slowFile))
+	{
+		return FS_BADLOG;
+	}
+	fs->slow_fd = open(slowFile, O_CREAT | O_APPEND | O_WRONLY, 0777);
+	if (fs->slow_fd == -1)
+		return FS_BADLOG;
+	fs->slow_us = (uint64_t)threshold_ms * 1000;
+	return FS_OKAY;
+}
+
+
+int server_fs_add_cache_policy(struct server_filesystem *fs, char *prefix,
+	int max_age)
+{
+	struct cache_policy *policy;
+
+	if (fs->policy_count >= FS_CACHE_POLICY_MAX)
+		return FS_INITERROR;
+
+	policy = &fs->policies[fs->policy_count++];
+	policy->prefix = prefix;
+	policy->prefix_len = strlen(prefix);
+	policy->max_age = max_age;
+	return FS_OKAY;
+}
+
+
+int server_fs_max_age(struct server_filesystem *fs, const char *path) {
+	struct cache_policy *best;
+	int i;
+
+	/* The longest prefix of the path wins */
+	best = NULL;
+	for (i = 0; i < fs->policy_count; ++i) {
+		struct cache_policy *policy = &fs->policies[i];
+
+		if (!strncmp(path, policy->prefix, policy->prefix_len) &&
+			(!best || policy->prefix_len > best->prefix_len))
+		{
+			best = policy;
+		}
+	}
+
+	return best ? best->max_age : -1;
+}
+
+
+int server_fs_open(struct server_filesystem *fs, char *path,
+	struct server_file *file) 
+{
+	char fullpath[PATH_MAX];
 	struct stat st_buf;
+	unsigned int generation;
 	int status;
 	int fd;
+	int cachable;
 
-	/* 
-	 * Check for /../blah shenanigans in the path: Don't let the user
-	 * use ..s to ascend up past the root directory and access file that
-	 * we don't want to be serving.
-	 */
-	if (!check_path(path)) {
-		return FS_EFILE_FORBIDDEN;
+	/* Get the full path on the stack */
+	status = full_path(fs, path, fullpath);
+	if (status != FS_OKAY) {
+		return status;
 	}
 
-	/* 
-	 * Concatenate the path with the server root directory into a single 
-	 * path entry.
-	 */
-	totallen = strlen(fs->root_dir) + strlen(path);
-	fullpath = malloc(totallen + 1);
-	strcpy(fullpath, fs->root_dir);
-	strcpy(fullpath + strlen(fs->root_dir), path);
-	fullpath[totallen] = '\0';
+	/* Serve it from memory if it's cached */
+	file->fd = -1;
+	file->data = NULL;
+	file->cached = NULL;
+	file->opened = NULL;
+	if (fs->cache && (file->cached = server_cache_get(fs->cache, fullpath))) {
+		file->data = file->cached->data;
+		file->size = file->cached->size;
+		file->mtime = file->cached->mtime;
+		file->ino = file->cached->ino;
+		return FS_OKAY;
+	}
 
-	/* Check that the file is a file and not a directory */
-	status = stat(fullpath, &st_buf);
-	if (status == -1) {
-		return FS_EFILE_NOTFOUND;
+	/* Otherwise serve it from an already open fd if there is one */
+	if (fs->fdcache && 
+		(file->opened = server_fdcache_get(fs->fdcache, fullpath))) 
+	{
+		/* It may have become worth caching the contents of by now */
+		if (file->opened->cachable && 
+			(file->cached = server_cache_offer(fs->cache, fullpath, 
+				file->opened->fd, file->opened->size, file->opened->mtime,
+				file->opened->ino)))
+		{
+			/* Send it from memory, not the fd as well */
+			file->data = file->cached->data;
+		} else {
+			file->fd = file->opened->fd;
+		}
+		file->size = file->opened->size;
+		file->mtime = file->opened->mtime;
+		file->ino = file->opened->ino;
+		return FS_OKAY;
 	}
-	if (!S_ISREG(st_buf.st_mode)) {
-		return FS_EFILE_FORBIDDEN;
+
+	/* Don't look it up again if it was missing a moment ago */
+	if (fs->negcache &&
+		server_negcache_get(fs->negcache, fullpath, &generation))
+	{
+		return FS_EFILE_NOTFOUND;
 	}
 
 	/* Try to open the file */
-	fd = open(fullpath, O_RDONLY);
-	free(fullpath);
+	cachable = (fs->cache != NULL);
+	status = root_open(fs, path, &fd, &st_buf, &cachable);
+	if (status == FS_EFILE_NOTFOUND && fs->negcache) {
+		server_negcache_put(fs->negcache, fullpath, fs->root_len,
+			generation);
+	}
+	if (status != FS_OKAY) {
+		return status;
+	}
+	file->fd = fd;
+	file->size = st_buf.st_size;
+	file->mtime = st_buf.st_mtime;
+	file->ino = st_buf.st_ino;
+
+	/* Offer it to the cache, if it's taken we can serve from memory */
+	if (cachable &&
+		(file->cached = server_cache_offer(fs->cache, fullpath, fd, 
+			st_buf.st_size, st_buf.st_mtime, st_buf.st_ino)))
+	{
+		close(fd);
+		file->fd = -1;
+		file->data = file->cached->data;
+		return FS_OKAY;
+	}
 
-	/* Return translated status */
-	if (fd == -1)
+	/* Otherwise keep it open for the next request for it */
+	if (fs->fdcache) {
+		file->opened = server_fdcache_put(fs->fdcache, fullpath, fd, 
+			&st_buf, cachable);
+	}
+
+	/* Return the file */
+	return FS_OKAY;
+}
+
+
+int server_fs_stat(struct server_filesystem *fs, char *path,
+	struct server_file *file)
+{
+	char fullpath[PATH_MAX];
+	struct stat st_buf;
+	struct cache_entry *cached;
+	struct fd_entry *opened;
+	unsigned int generation;
+	int status;
+	int cachable;
+	int fd;
+
+	status = full_path(fs, path, fullpath);
+	if (status != FS_OKAY) {
+		return status;
+	}
+
+	/* Nothing to close when we're done with it */
+	file->fd = -1;
+	file->data = NULL;
+	file->cached = NULL;
+	file->opened = NULL;
+
+	/* The caches already know, and keep themselves up to date */
+	if (fs->cache && (cached = server_cache_get(fs->cache, fullpath))) {
+		file->size = cached->size;
+		file->mtime = cached->mtime;
+		file->ino = cached->ino;
+		server_cache_release(fs->cache, cached);
+		return FS_OKAY;
+	}
+	if (fs->fdcache && (opened = server_fdcache_get(fs->fdcache, fullpath))) {
+		file->size = opened->size;
+		file->mtime = opened->mtime;
+		file->ino = opened->ino;
+		server_fdcache_release(fs->fdcache, opened);
+		return FS_OKAY;
+	}
+
+	/*
+	 * Otherwise open it to ask, so that it resolves exactly as opening it
+	 * would.
+	 */
+	if (fs->negcache &&
+		server_negcache_get(fs->negcache, fullpath, &generation))
+	{
 		return FS_EFILE_NOTFOUND;
-	else
-		return fd;
+	}
+	cachable = 0;
+	status = root_open(fs, path, &fd, &st_buf, &cachable);
+	if (status == FS_EFILE_NOTFOUND && fs->negcache) {
+		server_negcache_put(fs->negcache, fullpath, fs->root_len,
+			generation);
+	}
+	if (status != FS_OKAY) {
+		return status;
+	}
+	close(fd);
+	file->size = st_buf.st_size;
+	file->mtime = st_buf.st_mtime;
+	file->ino = st_buf.st_ino;
+	return FS_OKAY;
+}
+
+
+void server_fs_close_file(struct server_filesystem *fs, 
+	struct server_file *file)
+{
+	/* Give back it's cache entries, or close the file */
+	if (file->cached) {
+		server_cache_release(fs->cache, file->cached);
+		file->cached = NULL;
+	}
+	if (file->opened) {
+		server_fdcache_release(fs->fdcache, file->opened);
+		file->opened = NULL;
+	} else if (file->fd >= 0) {
+		close(file->fd);
+	}
+	file->fd = -1;
+	file->data = NULL;
 }
 
 
 void server_fs_destroy(struct server_filesystem *fs) {
-	/* Close the log file */
+	/* Write out anything still waiting to be logged, and close the log */
+	if (fs->log) {
+		server_log_destroy(fs->log);
+		free(fs->log);
+	}
 	close(fs->log_fd);
+	close(fs->root_fd);
+	if (fs->slow_fd != -1)
+		close(fs->slow_fd);
 
 	/* Maybe destroy the lock */
 	if (!fs->useflock) {
 		pthread_mutex_destroy(&fs->log_pthread_lock);
 	}
-}
 
+	/* Maybe stop keeping stats */
+	if (fs->stats) {
+		server_stats_destroy(fs->stats);
+		free(fs->stats);
+	}
 
-void server_fs_log(struct server_filesystem *fs, char* format, ...) {
+	/* Maybe destroy the caches */
+	if (fs->cache) {
+		server_cache_destroy(fs->cache);
+		free(fs->cache);
+	}
+	if (fs->fdcache) {
+		server_fdcache_destroy(fs->fdcache);
+		free(fs->fdcache);
+	}
+	if (fs->negcache) {
+		server_negcache_destroy(fs->negcache);
+		free(fs->negcache);
+	}
+}
 
-	/* Log the log file */
+
+/*
+ * Take the log file for writing to directly, with whichever lock the
+ * server_filesystem was created to use.
+ */
+void log_lock(struct server_filesystem *fs) {
 	if (fs->useflock)
 		flock(fs->log_fd, LOCK_EX);
 	else
 		pthread_mutex_lock(&fs->log_pthread_lock);
+}
+
+
+/*
+ * Release the log file after log_lock.
+ */
+void log_unlock(struct server_filesystem *fs) {
+	if (fs->useflock)
+		flock(fs->log_fd, LOCK_UN);
+	else
+		pthread_mutex_unlock(&fs->log_pthread_lock);
+}
+
+
+void server_fs_log(struct server_filesystem *fs, char* format, ...) {
+	char record[LOG_RECORD_MAX + 1];
+	int length;
+	int status;
+
+	/*
+	 * With the async log, format the line and hand it off to the flusher,
+	 * unless it's too long to fit in the ring, or this process has no ring.
+	 * Those are written directly, and may end up ahead of lines logged
+	 * before them.
+	 */
+	if (fs->log) {
+		va_list arglist;
+		va_start(arglist, format);
+		length = vsnprintf(record, sizeof(record), format, arglist);
+		va_end(arglist);
+		if (length >= 0) {
+			status = server_log_append(fs->log, record, length);
+			if (status == LOG_OKAY || status == LOG_DROPPED)
+				return;
+		}
+	}
+
+	/* Log the log file */
+	log_lock(fs);
 
 	/* Print out the variable arguments */
 	/* 
@@ -186,8 +841,61 @@ void server_fs_log(struct server_filesystem *fs, char* format, ...) {
 	va_end(arglist);
 
 	/* Unlock the log file */
-	if (fs->useflock)
-		flock(fs->log_fd, LOCK_UN);
-	else
-		pthread_mutex_unlock(&fs->log_pthread_lock);
-}
\ No newline at end of file
+	log_unlock(fs);
+}
+
+
+void server_fs_log_slow(struct server_filesystem *fs, char *format, ...) {
+	char line[LOG_RECORD_MAX + 1];
+	va_list arglist;
+	int length;
+
+	va_start(arglist, format);
+	length = vsnprintf(line, sizeof(line), format, arglist);
+	va_end(arglist);
+	if (length < 0)
+		return;
+	if (length > (int)sizeof(line) - 1)
+		length = sizeof(line) - 1;
+
+	/* O_APPEND keeps whole writes from interleaving */
+	if (write(fs->slow_fd, line, length) < 0)
+		return;
+}
+
+
+void server_fs_log_record(struct server_filesystem *fs, const void *record,
+	size_t length)
+{
+	const char *data;
+	ssize_t written;
+	int status;
+
+	/* Hand it off to the flusher if we can, as with server_fs_log */
+	if (fs->log) {
+		status = server_log_append(fs->log, record, length);
+		if (status == LOG_OKAY || status == LOG_DROPPED)
+			return;
+	}
+
+	/* Otherwise write it out whole while holding the log file */
+	log_lock(fs);
+	data = record;
+	while (length > 0) {
+		written = write(fs->log_fd, data, length);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			break;
+		data += written;
+		length -= written;
+	}
+	log_unlock(fs);
+}
+
+
+unsigned long server_fs_log_dropped(struct server_filesystem *fs) {
+	if (!fs->log)
+		return 0;
+	return server_log_dropped(fs->log);
+}
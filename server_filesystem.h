@@ -3,7 +3,17 @@
 #define SERVER_FILESYSTEM_H_
 
 
+#include "server_cache.h"
+#include "server_fdcache.h"
+#include "server_negcache.h"
+#include "server_log.h"
+#include "server_stats.h"
+
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
 
 
 /* fs_open status codes */
@@ -15,15 +25,59 @@
 #define FS_EFILE_FORBIDDEN -2 /* Use of /.. or other forbidden constructs */
 #define FS_EFILE_INTERNAL  -3 /* Internal problem accessing the file */
 
+/* How many cache policies may be added with server_fs_add_cache_policy */
+#define FS_CACHE_POLICY_MAX 16
+
+
+/*
+ * How long clients may cache the files under a path for without asking
+ * for them again.
+ */
+struct cache_policy {
+	char *prefix;
+	size_t prefix_len;
+	int max_age; /* seconds */
+};
+
 /*
  * A structure representing an opened server file system.
  */
 struct server_filesystem {
 	char *root_dir;
+	size_t root_len;
+	int root_fd;
+	int no_openat2;
 	char *log_dir;
 	int log_fd;
 	int useflock;
 	pthread_mutex_t log_pthread_lock;
+	struct content_cache *cache;
+	struct fd_cache *fdcache;
+	struct neg_cache *negcache;
+	struct server_log *log;
+	int log_binary;
+	struct server_stats *stats;
+	int log_timing;
+	int slow_fd;
+	uint64_t slow_us;
+	struct cache_policy policies[FS_CACHE_POLICY_MAX];
+	int policy_count;
+};
+
+
+/*
+ * A file opened for serving by server_fs_open. Either an open file
+ * descriptor for it (which may be shared through the fd cache), or if it
+ * was cached, it's contents in memory.
+ */
+struct server_file {
+	int fd;
+	const char *data;
+	size_t size;
+	time_t mtime;
+	ino_t ino;
+	struct cache_entry *cached;
+	struct fd_entry *opened;
 };
 
 
@@ -38,14 +92,121 @@ int server_fs_create(struct server_filesystem *fs, char *rootDirectory,
 	char *logDirectory, int useflock);
 
 
+/*
+ * Start keeping recently used files open, and caching the contents of 
+ * frequently requested ones in memory, up to |memory_cap| bytes of them.
+ * Also remember which paths were recently found not to exist.
+ * Each process has it's own caches, so this must be called after any fork.
+ * Returns: FS_OKAY on success, or FS_INITERROR on failure.
+ */
+int server_fs_enable_cache(struct server_filesystem *fs, size_t memory_cap);
+
+
+/*
+ * Start writing the log asynchronously: Log lines are added to a lock-free
+ * ring, and written out in batches by a flusher thread. |full_policy| is
+ * what to do with a line when the ring is full, LOG_FULL_BLOCK to wait for
+ * room or LOG_FULL_DROP to throw it away.
+ * The ring is shared with any processes forked after this is called.
+ * Returns: FS_OKAY on success, or FS_INITERROR on failure.
+ */
+int server_fs_enable_async_log(struct server_filesystem *fs, int full_policy);
+
+
+/*
+ * Write the log in the compact binary format from binary_log.h, rather than
+ * as text. The server_fs_log_record'd records are written as they are, it's
+ * up to the caller to make them binary_log records.
+ */
+void server_fs_enable_binary_log(struct server_filesystem *fs);
+
+
+/*
+ * Start keeping live stats of the requests served, and serve them at the
+ * URL |path|. The stats are shared with any processes forked after this is
+ * called.
+ * Returns: FS_OKAY on success, or FS_INITERROR on failure.
+ */
+int server_fs_enable_stats(struct server_filesystem *fs, const char *path);
+
+
+/*
+ * Add how long each phase of handling a request took to the end of it's line
+ * in the text log, see http_timing.
+ */
+void server_fs_enable_timing_log(struct server_filesystem *fs);
+
+
+/*
+ * Also log the requests that take at least |threshold_ms| milliseconds, with
+ * how long each phase of them took, to a log of their own: The log file's
+ * name with ".slow" on the end.
+ * Returns: FS_OKAY on success, or FS_BADLOG if it couldn't be opened.
+ */
+int server_fs_enable_slow_log(struct server_filesystem *fs, int threshold_ms);
+
+
+/*
+ * Format the stats, along with those of the log and this process's caches,
+ * as server_stats_format, into a |buffer| of |len| bytes. Stats must have
+ * been enabled.
+ * Returns: The length written.
+ */
+size_t server_fs_format_stats(struct server_filesystem *fs, char *buffer,
+	size_t len);
+
+
 /*
  * Open the file with the given path on the server, relative to the root
  * specified. Prevents any accesses to super-root directories through /../.. 
- * and other such shinanegans.
- * Returns: (positive) A file descriptor reference to the file.
+ * and other such shinanegans. The file is looked up from the root directory
+ * with openat2's RESOLVE_BENEATH, so symlinks can't lead outside it either.
+ * On kernels without openat2, it's walked a directory at a time, and
+ * symlinks aren't followed at all.
+ * On success, |file| is filled in, and must be closed with
+ * server_fs_close_file.
+ * Returns: FS_OKAY on success
  *          (negative) An fs_open status code from above.
  */
-int server_fs_open(struct server_filesystem *fs, char *path);
+int server_fs_open(struct server_filesystem *fs, char *path,
+	struct server_file *file);
+
+
+/*
+ * Look up the size, modification time and inode number of the file with
+ * the given path on the server, as server_fs_open would, but without
+ * opening it (unless it is already cached). Only those fields of |file|
+ * are filled in, there is nothing to close.
+ * Returns: FS_OKAY on success
+ *          (negative) An fs_open status code from above.
+ */
+int server_fs_stat(struct server_filesystem *fs, char *path,
+	struct server_file *file);
+
+
+/*
+ * Close a file opened by server_fs_open.
+ */
+void server_fs_close_file(struct server_filesystem *fs,
+	struct server_file *file);
+
+
+/*
+ * Let clients cache the files under the path |prefix| for |max_age|
+ * seconds. Where more than one prefix matches a path, the longest wins.
+ * Returns: FS_OKAY on success, or FS_INITERROR if there are already
+ *          FS_CACHE_POLICY_MAX policies.
+ */
+int server_fs_add_cache_policy(struct server_filesystem *fs, char *prefix,
+	int max_age);
+
+
+/*
+ * Get how long clients may cache the file with a given path (as normalized
+ * by server_fs_open or server_fs_stat) for.
+ * Returns: The max age in seconds, or -1 if no policy covers the path.
+ */
+int server_fs_max_age(struct server_filesystem *fs, const char *path);
 
 
 /*
@@ -62,4 +223,26 @@ void server_fs_destroy(struct server_filesystem *fs);
 void server_fs_log(struct server_filesystem *fs, char* format, ...);
 
 
+/*
+ * Append a line to the slow request log, see server_fs_enable_slow_log. The
+ * line is written all at once, so it isn't locked.
+ */
+void server_fs_log_slow(struct server_filesystem *fs, char *format, ...);
+
+
+/*
+ * Append a record to the log file for a given server_filesystem, exactly as
+ * it is given.
+ */
+void server_fs_log_record(struct server_filesystem *fs, const void *record,
+	size_t length);
+
+
+/*
+ * Get how many log lines have been dropped because the log couldn't keep
+ * up, with the LOG_FULL_DROP policy.
+ */
+unsigned long server_fs_log_dropped(struct server_filesystem *fs);
+
+
 #endif
\ No newline at end of file
@@ -2,51 +2,118 @@
 #include "server_http.h"
 
 #include "http_request.h"
+#include "http_scan.h"
+#include "binary_log.h"
 
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stddef.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <arpa/inet.h>
 
 /* How big the request buffer is initially */
 #define BUFFER_INITIAL 1024*2 /* 2 KB */
 
+/* How many unused request buffers each thread keeps for new connections */
+#define BUFFER_SPARE_MAX 32
+
+/* How many unused batches of responses each thread keeps for pipelining */
+#define BATCH_SPARE_MAX 8
+
+/* Room for the header of each part of a multipart/byteranges body */
+#define PART_HEADER_MAX 160
+
 
 /* States for the incremental request parser to be in */
-#define RECV_STATE_READY  0
-#define RECV_STATE_TEXT   1
-#define RECV_STATE_EOF    3
+#define RECV_STATE_READY     0
+#define RECV_STATE_EOF       3
+#define RECV_STATE_BODY      4
+#define RECV_STATE_TOO_LARGE 5
+#define RECV_STATE_DONE      6
 
 
 /* Private function forwards declarations */
-void format_date(char *buffer, size_t len);
-void http_response_const(struct server_filesystem *fs, int connection_fd, 
-	const char* resp[2]);
+void format_date(char *buffer, size_t len, time_t t);
+struct http_response *http_conn_response(struct http_conn *conn, int i);
+struct http_response *http_conn_add_response(struct http_conn *conn);
+struct http_render_cache *http_render_now();
+size_t format_size(char *buffer, size_t value);
+void http_response_const(struct http_conn *conn, int which);
+const char *http_conn_connection(struct http_conn *conn);
+const char *http_render_last_modified(time_t mtime);
+const char *http_render_expires(int max_age);
+void format_etag(char *buffer, size_t len, struct server_file *file);
+size_t format_content_headers(char *buffer, size_t len,
+	struct http_response *response);
+const struct mime_type *http_mime_type(const char *path);
+int http_conn_sidecar(struct server_filesystem *fs, struct http_conn *conn,
+	char *filename, struct server_file *file, const char **encoding);
+int http_conn_if_range(struct http_conn *conn, struct server_file *file);
+int http_conn_modified(struct http_conn *conn, struct server_file *file);
+void http_response_validators(struct http_response *response,
+	struct server_file *file, int max_age);
+void http_response_not_modified(struct http_conn *conn,
+	struct server_file *file, int max_age, int vary);
+void http_response_add_segment(struct http_response *response,
+	const char *data, size_t offset, size_t length, int is_content);
+void http_response_full(struct http_conn *conn,
+	struct http_response *response);
+void http_response_range(struct http_conn *conn,
+	struct http_response *response, struct http_range *range);
+void http_response_multipart(struct http_conn *conn,
+	struct http_response *response, struct http_range *ranges, int count);
+void http_response_unsatisfiable(struct http_conn *conn,
+	struct http_response *response);
 void http_response_log(struct server_filesystem *fs, char *addr, 
-	struct http_method *method, char *date, char *response);
-void http_response_dispatch(struct server_filesystem *fs, int connection_fd,
-	char *addr, struct http_method *method);
+	struct http_method *method, char *date, const char *response,
+	const char *timing);
+uint64_t http_cpu_now();
+void format_timing(char *buffer, size_t len, struct http_timing *timing);
+void http_conn_decide(struct server_filesystem *fs, struct http_conn *conn);
+void http_response_stats(struct server_filesystem *fs,
+	struct http_conn *conn);
+void http_response_log_binary(struct server_filesystem *fs,
+	struct http_conn *conn, struct http_response *response);
+int http_conn_lex(struct http_conn *conn);
+int http_body_discard(struct http_conn *conn, char *data, size_t length);
+int http_body_collect(struct http_conn *conn, char *data, size_t length);
+int http_conn_content_length(struct http_conn *conn, size_t *length);
+int http_conn_start_body(struct http_conn *conn);
+int http_conn_consume_body(struct http_conn *conn);
+int http_conn_send_status();
+int http_conn_send_memory(struct http_conn *conn);
+int http_conn_send_segment(struct http_conn *conn,
+	struct http_response *response, struct http_segment *segment);
+int http_conn_wants_keep_alive(struct http_conn *conn);
+int http_conn_wait(struct http_conn *conn, int timeout,
+	struct http_idle *idle);
+void http_conn_compact(struct http_conn *conn);
 
 
 /*
- * Format a date in the format that we want to use for HTTP responses from
- * this server. Formats into a buffer with a given length provided as 
+ * Format a date |t| in the format that we want to use for HTTP responses
+ * from this server. Formats into a buffer with a given length provided as 
  * arguments.
  */
-void format_date(char *buffer, size_t len) {
+void format_date(char *buffer, size_t len, time_t t) {
 	/*
 	 * Code taken from example on:
 	 *  http://linux.die.net/man/3/strftime
 	 * And modified
 	 */
-	time_t t;
+	struct tm tm_buf;
 	struct tm *tmp;
-	t = time(NULL);
-	tmp = gmtime(&t);
+	tmp = gmtime_r(&t, &tm_buf);
 
 	/* Format into our date format */
 	if (0 == strftime(buffer, len, "%a %d %b %Y %T GMT", tmp)) {
@@ -65,8 +132,9 @@ void format_date(char *buffer, size_t len) {
 const char *response_400[2] = {
 	"HTTP/1.1 400 Bad Request\n"
 	"Date: %s\n"
-	"Content‐Type: text/html\n"
-	"Content‐Length: %d\n"
+	"Connection: %s\n"
+	"Content-Type: text/html\n"
+	"Content-Length: %d\n"
 	"\n"
 	,
 	"<html><body>\n"
@@ -79,6 +147,7 @@ const char *response_400[2] = {
 const char *response_403[2] = {
 	"HTTP/1.1 403 Forbidden\n"
 	"Date: %s\n"
+	"Connection: %s\n"
 	"Content-Type: text/html\n"
 	"Content-Length: %d\n"
 	"\n"
@@ -93,8 +162,9 @@ const char *response_403[2] = {
 const char *response_404[2] = {
 	"HTTP/1.1 404 Not Found\n"
 	"Date: %s\n"
-	"Content‐Type: text/html\n"
-	"Content‐Length: %d\n"
+	"Connection: %s\n"
+	"Content-Type: text/html\n"
+	"Content-Length: %d\n"
 	"\n"
 	,
 	"<html><body>\n"
@@ -107,6 +177,7 @@ const char *response_404[2] = {
 const char *response_405[2] = {
 	"HTTP/1.1 405 Method Not Allowed\n"
 	"Date: %s\n"
+	"Connection: %s\n"
 	"Content-Type: text/html\n"
 	"Content-Length: %d\n"
 	"\n"
@@ -117,10 +188,26 @@ const char *response_405[2] = {
 	"</body></html>"
 };
 
+/* Request Header Fields Too Large */
+const char *response_431[2] = {
+	"HTTP/1.1 431 Request Header Fields Too Large\n"
+	"Date: %s\n"
+	"Connection: %s\n"
+	"Content-Type: text/html\n"
+	"Content-Length: %d\n"
+	"\n"
+	,
+	"<html><body>\n"
+	"<h2>Request Too Large</h2>\n"
+	"Your browser sent more headers than I am willing to read.\n"
+	"</body></html>"
+};
+
 /* Internal Server Error */
 const char *response_500[2] = {
 	"HTTP/1.1 500 Internal Server Error\n"
 	"Date: %s\n"
+	"Connection: %s\n"
 	"Content-Type: text/html\n"
 	"Content-Length: %d\n"
 	"\n"
@@ -133,439 +220,2100 @@ const char *response_500[2] = {
 
 
 /*
- * Serve a response which has fixed predefined contents other than the 
- * date in it's header.
- * Takes any |resp| from the above defined responses_<status>s.
+ * Get the |i|th of the waiting responses.
  */
-void http_response_const(struct server_filesystem *fs, int connection_fd, 
-	const char* resp[2])
-{
-	char date[200];
-	size_t length;
-
-	/* Get date */
-	format_date(date, 200);
+struct http_response *http_conn_response(struct http_conn *conn, int i) {
+	return (i == 0) ? &conn->response : &conn->batch[i - 1];
+}
 
-	/* Length */
-	length = strlen(resp[1]);
 
-	/* Write the response */
-	dprintf(connection_fd, resp[0], date, length);
-	write(connection_fd, resp[1], strlen(resp[1]));
+/*
+ * Add a new empty response for the current request to the end of the
+ * waiting responses. There must be room for it, see http_conn_batching.
+ */
+struct http_response *http_conn_add_response(struct http_conn *conn) {
+	struct http_response *response;
+
+	response = http_conn_response(conn, conn->response_count++);
+	memset(response, 0x0, sizeof(struct http_response));
+	response->method = conn->method;
+	response->timing = conn->timing;
+	response->file.fd = -1;
+	return response;
 }
 
-/* Okay header fragment */
+
+/* Okay header fragment, the file's content headers go after it */
 const char *response_200 =
 	"HTTP/1.1 200 OK\n"
 	"Date: %s\n"
-	"Content-Type: text/html\n"
-	"Content-Length: %d\n"
-	"\n";
+	"Connection: %s\n";
+
+
+/* The fixed responses, by RESPONSE_<status>, and what to log for them */
+#define RESPONSE_400   0
+#define RESPONSE_403   1
+#define RESPONSE_404   2
+#define RESPONSE_405   3
+#define RESPONSE_431   4
+#define RESPONSE_500   5
+#define RESPONSE_COUNT 6
+
+const char **const_responses[RESPONSE_COUNT] = {
+	response_400, response_403, response_404, response_405, response_431,
+	response_500
+};
+const int const_status[RESPONSE_COUNT] = { 400, 403, 404, 405, 431, 500 };
+const char *const_log_status[RESPONSE_COUNT] = {
+	"400 Bad Request",
+	"403 Forbidden",
+	"404 Not Found",
+	"405 Method Not Allowed",
+	"431 Request Header Fields Too Large",
+	"500 Internal Server Error"
+};
 
 
 /*
- * Write to the log file in the log format that we want 
+ * The date, and all of the fixed responses and the start of the 200 OK
+ * header, rendered for the current second both closing and keeping alive
+ * the connection. Each thread has it's own, so they never need a lock.
  */
-void http_response_log(struct server_filesystem *fs, char *addr, 
-	struct http_method *method, char *date, char *response)
-{
-	server_fs_log(fs, "%s\t%s\t%.*s %.*s %.*s\t%s\n",
-		date,
-		addr,
-		method->method.length, method->method.ptr,
-		method->url.length, method->url.ptr,
-		method->version.length, method->version.ptr,
-		response);
+struct http_render_cache {
+	time_t second;
+	char date[64];
+	char responses[RESPONSE_COUNT][2][512];
+	size_t response_lengths[RESPONSE_COUNT][2];
+	char ok_header[2][160];
+	size_t ok_header_lengths[2];
+
+	/* 
+	 * The last Last-Modified date rendered, files tend to be requested a
+	 * few times in a row, and the last Expires date.
+	 */
+	time_t last_modified_time;
+	char last_modified[64];
+	time_t expires_second;
+	int expires_max_age;
+	char expires[64];
+};
+
+__thread struct http_render_cache render_cache;
+
+
+/*
+ * Get this thread's render cache, re-rendering it first if the second (and
+ * so the date) has changed since it was last used.
+ */
+struct http_render_cache *http_render_now() {
+	struct http_render_cache *cache;
+	const char *connection;
+	time_t now;
+	int length;
+	int keep;
+	int i;
+
+	cache = &render_cache;
+	now = time(NULL);
+	if (now == cache->second)
+		return cache;
+
+	cache->second = now;
+	format_date(cache->date, sizeof(cache->date), now);
+	for (keep = 0; keep < 2; ++keep) {
+		connection = keep ? "keep-alive" : "close";
+
+		/* The fixed responses, header and body together */
+		for (i = 0; i < RESPONSE_COUNT; ++i) {
+			const char **resp = const_responses[i];
+			char *out = cache->responses[i][keep];
+
+			length = snprintf(out, sizeof(cache->responses[i][keep]),
+				resp[0], cache->date, connection, strlen(resp[1]));
+			length += snprintf(out + length,
+				sizeof(cache->responses[i][keep]) - length, "%s", resp[1]);
+			cache->response_lengths[i][keep] = length;
+		}
+
+		/* The start of the 200 OK header */
+		length = snprintf(cache->ok_header[keep],
+			sizeof(cache->ok_header[keep]), response_200,
+			cache->date, connection);
+		cache->ok_header_lengths[keep] = length;
+	}
+
+	return cache;
+}
+
+
+/*
+ * Write out |value| in decimal, without a null terminator.
+ * Returns: How many digits were written, at most 20.
+ */
+size_t format_size(char *buffer, size_t value) {
+	char digits[20];
+	size_t count;
+	size_t i;
+
+	count = 0;
+	do {
+		digits[count++] = '0' + (value % 10);
+		value /= 10;
+	} while (value > 0);
+
+	/* They came out backwards */
+	for (i = 0; i < count; ++i)
+		buffer[i] = digits[count - 1 - i];
+	return count;
+}
+
+
+/*
+ * Add a response which has fixed predefined contents other than the
+ * date in it's header, RESPONSE_<status> |which|. It's sent as it was
+ * pre-rendered, header and body in one piece.
+ */
+void http_response_const(struct http_conn *conn, int which) {
+	struct http_render_cache *cache;
+	struct http_response *response;
+	int keep;
+
+	/* Copy it out of the render cache, which changes every second */
+	cache = http_render_now();
+	keep = conn->keep_alive ? 1 : 0;
+	response = http_conn_add_response(conn);
+	response->time = cache->second;
+	memcpy(response->date, cache->date, sizeof(response->date));
+	memcpy(response->header, cache->responses[which][keep],
+		cache->response_lengths[which][keep]);
+	response->header_length = cache->response_lengths[which][keep];
+	response->log_status = const_log_status[which];
+	response->status = const_status[which];
 }
 
 
+/* Partial content header, for a single range of the file */
+const char *response_206 =
+	"HTTP/1.1 206 Partial Content\n"
+	"Date: %s\n"
+	"Connection: %s\n"
+	"%s"
+	"Content-Range: bytes %lu-%lu/%lu\n"
+	"Content-Length: %lu\n";
+
+/* And for more than one, each range in a part of a multipart body */
+const char *response_206_multipart =
+	"HTTP/1.1 206 Partial Content\n"
+	"Date: %s\n"
+	"Connection: %s\n"
+	"Content-Type: multipart/byteranges; boundary=%s\n"
+	"Content-Length: %lu\n";
+
+const char *multipart_part =
+	"\r\n--%s\r\n"
+	"Content-Type: %s\r\n"
+	"Content-Range: bytes %lu-%lu/%lu\r\n"
+	"\r\n";
+
+const char *multipart_end =
+	"\r\n--%s--\r\n";
+
+/* None of the ranges asked for are in the file */
+const char *response_416 =
+	"HTTP/1.1 416 Range Not Satisfiable\n"
+	"Date: %s\n"
+	"Connection: %s\n"
+	"Content-Range: bytes */%lu\n"
+	"Content-Length: 0\n";
+
+/* 
+ * The client already has the file, and it hasn't changed since. There's
+ * never a body.
+ */
+const char *response_304 =
+	"HTTP/1.1 304 Not Modified\n"
+	"Date: %s\n"
+	"Connection: %s\n";
+
+/*
+ * How the response may be cached, which finishes off the header of any
+ * response with a file.
+ */
+const char *response_validators =
+	"ETag: %s\n"
+	"Last-Modified: %s\n";
+
+const char *response_max_age =
+	"Cache-Control: max-age=%d\n"
+	"Expires: %s\n";
+
+const char *response_vary =
+	"Vary: Accept-Encoding\n";
+
+
 /* 
- * Decide what kind of response a given method needs, and dispatch that
- * response to the client via that method.
+ * Content types by file extension, and whether they are worth sending a
+ * precompressed copy of.
  */
-void http_response_dispatch(struct server_filesystem *fs, int connection_fd,
-	char *addr, struct http_method *method) 
-{
-	char *filename;
-	char date[200];
-	int fd;
-	ssize_t fsize;
-	ssize_t status;
-	char dataBuffer[1024];
-	size_t total_written;
-	ssize_t len;
+struct mime_type {
+	const char *extension;
+	const char *type;
+	int compressible;
+};
 
-	/* Null terminate the file to get name */
-	filename = malloc(method->url.length + 1);
-	memcpy(filename, method->url.ptr, method->url.length);
-	filename[method->url.length] = '\0';
+const struct mime_type mime_types[] = {
+	{ "html",  "text/html",              1 },
+	{ "htm",   "text/html",              1 },
+	{ "css",   "text/css",               1 },
+	{ "js",    "application/javascript", 1 },
+	{ "mjs",   "application/javascript", 1 },
+	{ "json",  "application/json",       1 },
+	{ "txt",   "text/plain",             1 },
+	{ "csv",   "text/csv",               1 },
+	{ "md",    "text/markdown",          1 },
+	{ "xml",   "application/xml",        1 },
+	{ "svg",   "image/svg+xml",          1 },
+	{ "wasm",  "application/wasm",       1 },
+	{ "ico",   "image/x-icon",           1 },
+	{ "png",   "image/png",              0 },
+	{ "jpg",   "image/jpeg",             0 },
+	{ "jpeg",  "image/jpeg",             0 },
+	{ "gif",   "image/gif",              0 },
+	{ "webp",  "image/webp",             0 },
+	{ "woff",  "font/woff",              0 },
+	{ "woff2", "font/woff2",             0 },
+	{ "pdf",   "application/pdf",        0 },
+	{ "mp3",   "audio/mpeg",             0 },
+	{ "mp4",   "video/mp4",              0 },
+	{ "zip",   "application/zip",        0 },
+	{ "gz",    "application/gzip",       0 },
+	{ NULL,    "application/octet-stream", 0 }
+};
 
-	/* Get date */
-	format_date(date, 200);
+/* 
+ * The precompressed copies we look for next to a file, the coding's name
+ * and the suffix of the copy, in the order we'd rather send them.
+ */
+const char *sidecar_codings[][2] = {
+	{ "br",   ".br" },
+	{ "gzip", ".gz" }
+};
+#define SIDECAR_CODINGS 2
 
-	/* Check the method */
-	if (strncmp("GET", method->method.ptr, method->method.length)) {
-		/* Request is not a get, issue 405 bad method */
-		http_response_const(fs, connection_fd, response_405);
-		http_response_log(fs, addr, method, date, "403 Method Not Allowed");
-		return;
-	}
+/* Counts multipart bodies, to make each one's boundary different */
+__thread unsigned long multipart_count;
 
-	/* Path must start with a slash */
-	if (filename[0] != '/') {
-		http_response_const(fs, connection_fd, response_400);
-		http_response_log(fs, addr, method, date, "400 Bad Request");	
-	}
 
-	/* Open file */
-	fd = server_fs_open(fs, filename);
-	free(filename);
-	if (fd < 0) {
-		/* Problem opening the file for response */
-		if (fd == FS_EFILE_FORBIDDEN) {
-			http_response_const(fs, connection_fd, response_403);
-			http_response_log(fs, addr, method, date, "403 Forbidden");
-		} else if (fd == FS_EFILE_NOTFOUND) {
-			http_response_const(fs, connection_fd, response_404);
-			http_response_log(fs, addr, method, date, "404 Not Found");
-		} else {
-			http_response_const(fs, connection_fd, response_500);
-			http_response_log(fs, addr, method, date, 
-				"500 Internal Server Error");
+/*
+ * Render a file's modification time for a Last-Modified header, in the
+ * standard HTTP date format that caches expect. The last one rendered is
+ * kept in this thread's render cache.
+ */
+const char *http_render_last_modified(time_t mtime) {
+	struct http_render_cache *cache;
+	struct tm tm_buf;
+
+	cache = &render_cache;
+	if (cache->last_modified_time != mtime || !cache->last_modified[0]) {
+		gmtime_r(&mtime, &tm_buf);
+		if (0 == strftime(cache->last_modified,
+			sizeof(cache->last_modified), "%a, %d %b %Y %T GMT", &tm_buf))
+		{
+			cache->last_modified[0] = '\0';
 		}
-		return;
+		cache->last_modified_time = mtime;
 	}
 
-	/* The file exists, try to respond with the contents */
+	return cache->last_modified;
+}
 
-	/* Get the file size (seek to end and back to start) */
-	fsize = lseek(fd, 0, SEEK_END);
-	status = lseek(fd, 0, SEEK_SET);
 
-	/* Failed to get file length? */
-	if (fsize < 0 || status < 0) {
-		http_response_const(fs, connection_fd, response_500);
-		http_response_log(fs, addr, method, date, "500 Internal Server Error");
-		return;
+/*
+ * Render the date |max_age| seconds from now, for an Expires header. The
+ * last one rendered is kept in this thread's render cache.
+ */
+const char *http_render_expires(int max_age) {
+	struct http_render_cache *cache;
+	struct tm tm_buf;
+	time_t expires;
+
+	cache = http_render_now();
+	if (cache->expires_second != cache->second ||
+		cache->expires_max_age != max_age)
+	{
+		expires = cache->second + max_age;
+		gmtime_r(&expires, &tm_buf);
+		if (0 == strftime(cache->expires, sizeof(cache->expires),
+			"%a, %d %b %Y %T GMT", &tm_buf))
+		{
+			cache->expires[0] = '\0';
+		}
+		cache->expires_second = cache->second;
+		cache->expires_max_age = max_age;
 	}
 
-	/* Ready to send contents, emit a 200 OK response type header */
+	return cache->expires;
+}
 
-	/* Write headers */
-	if (dprintf(connection_fd, response_200, date, fsize) < 0) {
-		/* At this point, we may have sent some of the header already, so
-		 * the only option is to stop sending and fail; we can't start a 
-		 * 500 Internal Server Error at this point.
-		 */
-		http_response_log(fs, addr, method, date, 
-			"Connection unexpectedly terminated while "
-			"sending response header.");
-		return;
-	}
 
-	/* Write contents in 1KB chunks */
-	total_written = 0;
+/*
+ * Format a strong entity tag for a file, quotes and all, from which file
+ * it is and the size and modification time that it has.
+ */
+void format_etag(char *buffer, size_t len, struct server_file *file) {
+	snprintf(buffer, len, "\"%lx-%lx-%lx\"", (unsigned long)file->ino,
+		(unsigned long)file->mtime, (unsigned long)file->size);
+}
 
-	/* While we read data, and didn't encounter an error */
-	while ((len = read(fd, dataBuffer, 1024)) > 0) {
-		ssize_t written;
 
-		/* Try to write out the data chunk that we read */
-		written = write(connection_fd, dataBuffer, len);
-		if (written < 0) {
-			/* Error writing occurred */
-			break;
-		} else if (written < len) {
-			/* 
-			 * Couldn't write all of the data, connection was probably
-			 * closed by the client, so break out.
-			 */
-			total_written += written;
-			break;
-		} else {
-			/* Write succeeded */
-			total_written += written;
-		}
+/*
+ * Format the Content-Type header line for |response|'s file, and the
+ * Content-Encoding line if it's a precompressed copy.
+ * Returns: The length written.
+ */
+size_t format_content_headers(char *buffer, size_t len,
+	struct http_response *response)
+{
+	int length;
+
+	if (response->content_encoding) {
+		length = snprintf(buffer, len,
+			"Content-Type: %s\nContent-Encoding: %s\n",
+			response->content_type, response->content_encoding);
+	} else {
+		length = snprintf(buffer, len, "Content-Type: %s\n",
+			response->content_type);
 	}
+	if (length < 0)
+		return 0;
+	return ((size_t)length < len) ? (size_t)length : len - 1;
+}
 
-	/* Log how the 200 OK response went (how much of the data we
-	 * managed to send out of the total file size.
-	 */
-	server_fs_log(fs, "%s\t%s\t%.*s %.*s %.*s\t200 OK %d/%d\n",
-		date,
-		addr,
-		method->method.length, method->method.ptr,
-		method->url.length, method->url.ptr,
-		method->version.length, method->version.ptr,
-		total_written,
-		fsize);	
+
+/*
+ * Look up the content type of the file at |path| by it's extension.
+ * Returns: The mime_types entry, the last one if the extension is unknown.
+ */
+const struct mime_type *http_mime_type(const char *path) {
+	const struct mime_type *mime;
+	const char *extension;
+
+	/* The extension is after the last dot in the last path segment */
+	extension = strrchr(path, '.');
+	if (!extension || strchr(extension, '/'))
+		extension = "";
+	else
+		++extension;
+
+	for (mime = mime_types; mime->extension; ++mime) {
+		if (!strcasecmp(extension, mime->extension))
+			break;
+	}
+	return mime;
 }
 
 
-void handle_http_request(struct server_filesystem *fs, int connection_fd,
-	char *addr) 
+/*
+ * Look for a precompressed copy of the file at |filename| next to it, in
+ * a coding that the client accepts (from sidecar_codings).
+ * The copies' extensions are tried on the end of |filename| in place, it
+ * has room for PATH_MAX. If there's a copy, it's path is left there.
+ * Returns: 0 -> There isn't a copy to send, |filename| is as it was
+ *          1 -> There is, with it's metadata as from server_fs_stat in
+ *               |file| and it's coding in |encoding|
+ */
+int http_conn_sidecar(struct server_filesystem *fs, struct http_conn *conn,
+	char *filename, struct server_file *file, const char **encoding)
 {
-	size_t buffer_capacity;
-	size_t buffer_size;
-	char *buffer;
-	size_t buffer_index;
-	size_t line_start_index;
-	int lex_state;
-	int line_count;
-	struct http_method method;
-	struct http_header *header_list;
-	char *request_content;
+	struct http_header header_buf;
+	struct http_header *header;
+	size_t length;
+	int i;
+
+	header = http_conn_header(conn, "Accept-Encoding", &header_buf);
+	if (!header)
+		return 0;
+
+	length = strlen(filename);
+	if (length + 4 > PATH_MAX)
+		return 0;
+	for (i = 0; i < SIDECAR_CODINGS; ++i) {
+		if (!header_accepts(header, sidecar_codings[i][0]))
+			continue;
+
+		strcpy(filename + length, sidecar_codings[i][1]);
+		if (server_fs_stat(fs, filename, file) == FS_OKAY) {
+			*encoding = sidecar_codings[i][0];
+			return 1;
+		}
+	}
 
-	/* Set up the growable buffer that we read the request into */
-	buffer_capacity = BUFFER_INITIAL;
-	buffer_size = 0;
-	buffer = malloc(buffer_capacity + 1); /* +1 -> room for trailing '\0' */
-	buffer_index = 0;
-	line_start_index = 0;
+	filename[length] = '\0';
+	return 0;
+}
 
-	/* Set the initial lex state */
-	lex_state = RECV_STATE_READY;
 
-	/* Current line count */
-	line_count = 0;
+/*
+ * The value of the Connection header to respond with.
+ */
+const char *http_conn_connection(struct http_conn *conn) {
+	return conn->keep_alive ? "keep-alive" : "close";
+}
 
-	/* The http method */
-	memset(&method, 0x0, sizeof(method));
 
-	/* A linked list of http_header-s */
-	header_list = NULL;
+/*
+ * Check whether the Range header applies: It does unless there is an
+ * If-Range header, saying to only send the ranges if the file hasn't
+ * changed since. That's given as either the file's entity tag, or it's
+ * modification date, which has to match exactly in either the standard
+ * HTTP date format or our own.
+ * Returns 0 -> Ignore the Range header, and send the whole file
+ *         1 -> Send the ranges asked for
+ */
+int http_conn_if_range(struct http_conn *conn, struct server_file *file) {
+	struct http_header header_buf;
+	struct http_header *header;
+	const char *date;
+	char buffer[64];
+	size_t length;
 
-	/* Storage for the request content if any */
-	request_content = NULL;
+	header = http_conn_header(conn, "If-Range", &header_buf);
+	if (!header)
+		return 1;
 
-	/* Read the request headers */
-	for (;;) {
-		ssize_t received;
+	/* An entity tag, which must be the same strong one */
+	if (header->value.length > 0 && header->value.ptr[0] == '"') {
+		format_etag(buffer, sizeof(buffer), file);
+		length = strlen(buffer);
+		return (length == header->value.length) &&
+			!strncmp(buffer, header->value.ptr, length);
+	}
 
-		/* Read a new chunk into the buffer */
-		received = recv(connection_fd, 
-			buffer + buffer_size,
-			buffer_capacity - buffer_size,
-			0);
-
-		/* Error: recv failed */
-		if (received == -1) {
-			goto badrequest;
-		}
+	/* Or a date */
+	date = http_render_last_modified(file->mtime);
+	length = strlen(date);
+	if (length == header->value.length &&
+		!strncmp(date, header->value.ptr, length))
+	{
+		return 1;
+	}
+	format_date(buffer, sizeof(buffer), file->mtime);
+	length = strlen(buffer);
+	return (length == header->value.length) &&
+		!strncmp(buffer, header->value.ptr, length);
+}
 
-		/* Add the content */
-		buffer_size += received;
 
-		/* Lex to see if we reached the end of the packet. EOF condition:
-		 * \r\n or \n alone on a line
-		 */
-		while (buffer_index < buffer_size) {
-			char c;
-
-			/* Get the current character */
-			c = buffer[buffer_index];
-
-			/* Lex the character given the current lex state */
-			if (c == '\r') {
-				/* Remain in the same state */
-			} else if (c == '\n') {
-				if (lex_state == RECV_STATE_READY) {
-					/* empty line, break out, the request is complete */
-					lex_state = RECV_STATE_EOF;
-					break;
-				} else {
-					/* New line, become ready again */
-					lex_state = RECV_STATE_READY;
-				}
+/*
+ * Check the conditional headers of a GET against the file: If-None-Match
+ * if there is one, otherwise If-Modified-Since.
+ * Returns 0 -> The client's copy of the file is up to date
+ *         1 -> The client needs the file sent
+ */
+int http_conn_modified(struct http_conn *conn, struct server_file *file) {
+	struct http_header header_buf;
+	struct http_header *header;
+	char etag[64];
+	time_t since;
+
+	header = http_conn_header(conn, "If-None-Match", &header_buf);
+	if (header) {
+		format_etag(etag, sizeof(etag), file);
+		return !header_matches_etag(header, etag);
+	}
 
-				/* Complete line has been read in */
-				++line_count;
-
-				/* Process this line */
-				if (line_count == 1) {
-					/* Line number 1 is the request method */
-					int result;
-
-					/* Process method */
-					result = parse_method(&method, 
-						buffer + line_start_index,
-						buffer_index - line_start_index + 1);
-
-					/* Failed to process method */
-					if (result == 0) {
-						/* Error malformed method */
-						goto badrequest;
-					}
-				} else {
-					/* Other lines are request headers */
-					struct http_header header;
-					int result;
-
-					/* Process a header */
-					result = parse_header(&header,
-						buffer + line_start_index,
-						buffer_index - line_start_index + 1);
-
-					/* Failed to process header */
-					if (result == 0)
-						/* Error malformed header */
-						goto badrequest;
-					else {
-						struct http_header *node;
-						/* 
-						 * Otherwise, allocate a linked list node for the
-						 * header, and insert it into the header list. 
-						 */
-						node = malloc(sizeof(struct http_header));
-						memcpy(node, &header, sizeof(struct http_header));
-						node->prev = header_list;
-						header_list = node;
-					}
-				}
+	header = http_conn_header(conn, "If-Modified-Since", &header_buf);
+	if (header && header_value_as_date(header, &since))
+		return file->mtime > since;
 
-				/* Line processed, reset the startofline tag to current ptr */
-				line_start_index = (buffer_index + 1);
-			} else {
-				/* Other text -> "line has text" state */
-				lex_state = RECV_STATE_TEXT;
-			}
+	return 1;
+}
 
-			/* Character processed, to next character */
-			++buffer_index;
-		}
 
-		/* 
-		 * Now, if we got the complete request, break out. Otherwise, possibly 
-		 * resize the buffer, and go on to read more chunks.
-		 */
-		if (lex_state == RECV_STATE_EOF) {
-			break;
-		} else {
-			ptrdiff_t delta;
-			struct http_header *curHeader;
-
-			/* Double the buffer when it is more than half full */
-			if ((buffer_capacity - buffer_size) < buffer_capacity/2) {
-				char *oldBuffer;
-
-				/* Double teh buffer size via realloc */
-				buffer_capacity *= 2;
-				oldBuffer = buffer;
-				buffer = realloc(buffer, buffer_capacity + 1);
-				delta = buffer - oldBuffer;
-
-				/* 
-				 * Patch the method and/or headers's pointers into the buffer
-				 * that we realocated.
-				 */
-				if (method.method.ptr != 0) {
-					method.method.ptr  += delta;
-					method.url.ptr     += delta;
-					method.version.ptr += delta;
-				}
-				for (curHeader = header_list; curHeader; 
-					curHeader = curHeader->prev) 
-				{
-					curHeader->label.ptr += delta;
-					curHeader->value.ptr += delta;
-				}
-			}
-		}
+/*
+ * Finish off the header of a response with a file: Add the validators the
+ * client can make a conditional request for it with later, how long it may
+ * cache it for if there is a |max_age| (not -1), whether that depends on
+ * the Accept-Encoding sent, and the empty line.
+ */
+void http_response_validators(struct http_response *response,
+	struct server_file *file, int max_age)
+{
+	char etag[64];
+	char *ptr;
+	size_t left;
+	int length;
+
+	format_etag(etag, sizeof(etag), file);
+	ptr = response->header + response->header_length;
+	left = sizeof(response->header) - response->header_length;
+	length = snprintf(ptr, left, response_validators, etag,
+		http_render_last_modified(file->mtime));
+	if (length < 0 || (size_t)length >= left)
+		return;
+	ptr += length;
+	left -= length;
+
+	if (max_age >= 0) {
+		length = snprintf(ptr, left, response_max_age, max_age,
+			http_render_expires(max_age));
+		if (length < 0 || (size_t)length >= left)
+			return;
+		ptr += length;
+		left -= length;
 	}
 
-	/* Note: Safe since we allocate one additional byte on top of the
-	 * capacity that we are working with when maniuplating the buffer, as
-	 * space to put this null terminator at. */
-	buffer[buffer_index] = '\0';
+	if (response->vary) {
+		length = snprintf(ptr, left, "%s", response_vary);
+		if (length < 0 || (size_t)length >= left)
+			return;
+		ptr += length;
+		left -= length;
+	}
 
-	/* 
-	 * If there is a request body (Content-Length header exists), we need to 
-	 * read that in. 
-	 */
-	struct http_header *curheader;
-	for (curheader = header_list; curheader; curheader = curheader->prev) {
-		if (!strncmp(curheader->label.ptr, "Content-Length", 
-			curheader->label.length)) 
-		{
-			size_t length;
-
-			/* limit to 100MB */
-			if (header_value_as_size_t(curheader, &length, 100*1024*1024)) {
-				size_t data_read;
-				ssize_t received;
-
-				/* Read in the data */
-				data_read = 0;
-				request_content = malloc(length);
-				while (data_read < length) {
-					received = recv(connection_fd, 
-						request_content + data_read,
-						length - data_read,
-						0);
-
-					/* Error: Failed to recieve body */
-					if (received < 0) {
-						goto badrequest;
-					}
-
-					data_read += received;
-				}
-			} else {
-				/* Error too long */
-				goto badrequest;
-			}
+	/* The snprintfs left room for it */
+	*ptr++ = '\n';
+	response->header_length = ptr - response->header;
+}
 
-			/* There can only be one Content-Length */
-			break;
-		}
+
+/*
+ * Add a 304 Not Modified response for a file, which is only stat'd, never
+ * opened. |vary| is whether a precompressed copy may have been chosen.
+ */
+void http_response_not_modified(struct http_conn *conn,
+	struct server_file *file, int max_age, int vary)
+{
+	struct http_render_cache *cache;
+	struct http_response *response;
+	int length;
+
+	cache = http_render_now();
+	response = http_conn_add_response(conn);
+	response->time = cache->second;
+	memcpy(response->date, cache->date, sizeof(response->date));
+	length = snprintf(response->header, sizeof(response->header),
+		response_304, response->date, http_conn_connection(conn));
+	response->header_length = (length > 0) ? length : 0;
+	response->vary = vary;
+	http_response_validators(response, file, max_age);
+	response->status = 304;
+	response->log_status = "304 Not Modified";
+}
+
+
+/*
+ * Add a segment to send after |response|'s header and body, see
+ * http_segment.
+ */
+void http_response_add_segment(struct http_response *response,
+	const char *data, size_t offset, size_t length, int is_content)
+{
+	struct http_segment *segment;
+
+	segment = &response->segments[response->segment_count++];
+	segment->data = data;
+	segment->offset = offset;
+	segment->length = length;
+	segment->is_content = is_content;
+}
+
+
+/*
+ * Make |response| a 200 OK with the whole of it's file, straight from
+ * memory if it was cached.
+ */
+void http_response_full(struct http_conn *conn,
+	struct http_response *response)
+{
+	struct http_render_cache *cache;
+	size_t length;
+	int keep;
+
+	if (response->file.data) {
+		response->body = response->file.data;
+		response->body_length = response->file.size;
+	} else {
+		http_response_add_segment(response, NULL, 0, response->file.size,
+			1);
 	}
 
-	/* Serve the response */
-	http_response_dispatch(fs, connection_fd, addr, &method);
+	/* Prepare the header from the pre-rendered start of one */
+	cache = http_render_now();
+	keep = conn->keep_alive ? 1 : 0;
+	length = cache->ok_header_lengths[keep];
+	memcpy(response->header, cache->ok_header[keep], length);
+	length += format_content_headers(response->header + length,
+		sizeof(response->header) - length, response);
+	memcpy(response->header + length, "Content-Length: ", 16);
+	length += 16;
+	length += format_size(response->header + length, response->file.size);
+	response->header[length] = '\n';
+	response->header_length = length + 1;
+
+	/* The log line says how much of the file we managed to send */
+	response->status = 200;
+	response->log_status = "200 OK";
+	response->log_progress = 1;
+	response->log_total = response->file.size;
+}
 
-	/* Completed successfully, skip bad request block */
-	goto cleanup;
 
+/*
+ * Make |response| a 206 Partial Content with a single |range| of it's file.
+ */
+void http_response_range(struct http_conn *conn,
+	struct http_response *response, struct http_range *range)
+{
+	char content[160];
+	int length;
+
+	if (response->file.data) {
+		response->body = response->file.data + range->start;
+		response->body_length = range->length;
+	} else {
+		http_response_add_segment(response, NULL, range->start,
+			range->length, 1);
+	}
 
-badrequest: 
-	/* 
-	 * Block that writes out a bad request response to the header 
-	 * This is done as a goto-block rather than a function since it can be
-	 * reached by breaking out of deeply nested logic above.
-	 */
-	{
-		char date[200];
+	format_content_headers(content, sizeof(content), response);
+	length = snprintf(response->header, sizeof(response->header),
+		response_206, response->date, http_conn_connection(conn), content,
+		(unsigned long)range->start,
+		(unsigned long)(range->start + range->length - 1),
+		(unsigned long)response->file.size,
+		(unsigned long)range->length);
+	response->header_length = (length > 0) ? length : 0;
+
+	/* The log line says how much of the range we managed to send */
+	response->status = 206;
+	response->log_status = "206 Partial Content";
+	response->log_progress = 1;
+	response->log_total = range->length;
+}
 
-		/* Get date */
-		format_date(date, 200);
 
-		/* Output response */
-		http_response_const(fs, connection_fd, response_400);
-		http_response_log(fs, addr, &method, date, 
-			"400 Bad Request");
+/*
+ * Make |response| a 206 Partial Content with more than one range of it's
+ * file, as the parts of a multipart/byteranges body. The part headers are
+ * sent from memory in between the ranges, which are still sent straight
+ * from the file.
+ */
+void http_response_multipart(struct http_conn *conn,
+	struct http_response *response, struct http_range *ranges, int count)
+{
+	char boundary[32];
+	char *part;
+	const char *data;
+	size_t content_length;
+	int length;
+	int i;
+
+	/* Room for all of the part headers, and the closing boundary */
+	response->parts = malloc((count + 1) * PART_HEADER_MAX);
+	if (!response->parts) {
+		http_response_full(conn, response);
+		return;
 	}
+	snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+		(unsigned long)response->time, multipart_count++);
+
+	/* Each range, after it's part header */
+	part = response->parts;
+	content_length = 0;
+	for (i = 0; i < count; ++i) {
+		length = snprintf(part, PART_HEADER_MAX, multipart_part, boundary,
+			response->content_type, (unsigned long)ranges[i].start,
+			(unsigned long)(ranges[i].start + ranges[i].length - 1),
+			(unsigned long)response->file.size);
+		http_response_add_segment(response, part, 0, length, 0);
+		part += length;
+
+		data = response->file.data;
+		http_response_add_segment(response,
+			data ? data + ranges[i].start : NULL, ranges[i].start,
+			ranges[i].length, 1);
+		content_length += length + ranges[i].length;
+		response->log_total += ranges[i].length;
+	}
+	length = snprintf(part, PART_HEADER_MAX, multipart_end, boundary);
+	http_response_add_segment(response, part, 0, length, 0);
+	content_length += length;
+
+	length = snprintf(response->header, sizeof(response->header),
+		response_206_multipart, response->date, http_conn_connection(conn),
+		boundary, (unsigned long)content_length);
+	response->header_length = (length > 0) ? length : 0;
+
+	/* The log line says how much of the ranges we managed to send */
+	response->status = 206;
+	response->log_status = "206 Partial Content";
+	response->log_progress = 1;
+}
 
 
-cleanup:
-	/* 
-	 * Main cleanup for the buffers & structures allocated during handling 
-	 * of the request.
-	 */
-	{
-		struct http_header *header;
+/*
+ * Make |response| a 416 Range Not Satisfiable, none of the ranges asked for
+ * are within it's file.
+ */
+void http_response_unsatisfiable(struct http_conn *conn,
+	struct http_response *response)
+{
+	int length;
+
+	length = snprintf(response->header, sizeof(response->header),
+		response_416, response->date, http_conn_connection(conn),
+		(unsigned long)response->file.size);
+	response->header_length = (length > 0) ? length : 0;
+	response->status = 416;
+	response->log_status = "416 Range Not Satisfiable";
+}
 
-		/* Free the request content */
-		if (request_content)
-			free(request_content);
 
-		/* Free the header linked list */
-		for (header = header_list; header;) {
-			struct http_header *prev = header->prev;
-			free(header);
-			header = prev;
-		}
+/*
+ * Write to the log file in the log format that we want, with the |timing|
+ * fields after it if they aren't empty.
+ */
+void http_response_log(struct server_filesystem *fs, char *addr, 
+	struct http_method *method, char *date, const char *response,
+	const char *timing)
+{
+	server_fs_log(fs, "%s\t%s\t%.*s %.*s %.*s\t%s%s%s\n",
+		date,
+		addr,
+		method->method.length, method->method.ptr,
+		method->url.length, method->url.ptr,
+		method->version.length, method->version.ptr,
+		response,
+		timing[0] ? "\t" : "", timing);
+}
+
+
+/*
+ * Get how much CPU time this thread has used, in microseconds. Unlike
+ * server_stats_now this is a system call, so it's only used when the
+ * timings are being logged.
+ */
+uint64_t http_cpu_now() {
+	struct timespec ts;
 
-		/* Free the buffer we used */
-		free(buffer);
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * Format how long each phase of a request took, in microseconds, as
+ * space separated name=value fields. A phase that it never got to takes
+ * no time, and the next one counts from the one before it. The total is
+ * from the first of the request arriving to the last of the response
+ * being sent, waiting to be accepted isn't part of it.
+ */
+void format_timing(char *buffer, size_t len, struct http_timing *timing) {
+	static const char *names[5] = {
+		"recv", "resolve", "open", "first", "last"
+	};
+	uint64_t stamps[5];
+	uint64_t last;
+	size_t used;
+	int length;
+	int i;
+
+	stamps[0] = timing->received;
+	stamps[1] = timing->resolved;
+	stamps[2] = timing->opened;
+	stamps[3] = timing->first_byte;
+	stamps[4] = timing->last_byte;
+
+	length = snprintf(buffer, len, "accept=%lu",
+		(unsigned long)(timing->accepted ?
+			timing->started - timing->accepted : 0));
+	used = (length > 0) ? length : 0;
+	last = timing->started;
+	for (i = 0; i < 5 && used < len; ++i) {
+		length = snprintf(buffer + used, len - used, " %s=%lu", names[i],
+			(unsigned long)(stamps[i] >= last ? stamps[i] - last : 0));
+		if (length > 0)
+			used += length;
+		if (stamps[i] >= last)
+			last = stamps[i];
+	}
+	if (used < len) {
+		snprintf(buffer + used, len - used, " total=%lu cpu=%lu",
+			(unsigned long)(timing->last_byte - timing->started),
+			(unsigned long)timing->cpu);
+	}
+}
+
+
+/*
+ * Add a 200 OK response with the server's live stats, rendered now, see
+ * server_fs_format_stats. It must never be cached.
+ */
+void http_response_stats(struct server_filesystem *fs,
+	struct http_conn *conn)
+{
+	struct http_render_cache *cache;
+	struct http_response *response;
+	int keep;
+	int length;
+
+	cache = http_render_now();
+	response = http_conn_add_response(conn);
+	response->time = cache->second;
+	memcpy(response->date, cache->date, sizeof(response->date));
+	response->content = malloc(STATS_FORMAT_MAX);
+	if (!response->content) {
+		--conn->response_count;
+		http_response_const(conn, RESPONSE_500);
+		return;
 	}
-}
\ No newline at end of file
+	response->body = response->content;
+	response->body_length = server_fs_format_stats(fs, response->content,
+		STATS_FORMAT_MAX);
+
+	keep = conn->keep_alive ? 1 : 0;
+	length = cache->ok_header_lengths[keep];
+	memcpy(response->header, cache->ok_header[keep], length);
+	length += snprintf(response->header + length,
+		sizeof(response->header) - length,
+		"Content-Type: text/plain; version=0.0.4\n"
+		"Cache-Control: no-store\n"
+		"Content-Length: %lu\n"
+		"\n", (unsigned long)response->body_length);
+	response->header_length = length;
+
+	response->status = 200;
+	response->log_status = "200 OK";
+	response->log_progress = 1;
+	response->log_total = response->body_length;
+}
+
+
+/*
+ * Decide whether the connection should stay open after responding to the
+ * request: HTTP/1.1 connections persist unless the client asks to close
+ * them, HTTP/1.0 ones only if the client asks to keep them alive.
+ * Returns 0 -> Close the connection after this response
+ *         1 -> Keep the connection open for another request
+ */
+int http_conn_wants_keep_alive(struct http_conn *conn) {
+	struct http_header header_buf;
+	struct http_header *header;
+	struct str_buffer_ptr *version;
+
+	/* Don't let one connection hog a worker forever */
+	if (conn->request_count + 1 >= HTTP_KEEPALIVE_MAX)
+		return 0;
+
+	/* Did the client say what it wants? */
+	header = http_conn_header(conn, "Connection", &header_buf);
+	if (header && header_has_token(header, "close"))
+		return 0;
+	if (header && header_has_token(header, "keep-alive"))
+		return 1;
+
+	/* Otherwise it's up to the version */
+	version = &conn->method.version;
+	return (version->length == 8) && !strncmp("HTTP/1.1", version->ptr, 8);
+}
+
+
+/*
+ * Write a response to the log as a binary log record, see binary_log.h.
+ */
+void http_response_log_binary(struct server_filesystem *fs,
+	struct http_conn *conn, struct http_response *response)
+{
+	struct binlog_record header;
+	struct http_method *method;
+	char record[LOG_RECORD_MAX];
+	char *ptr;
+	size_t length;
+
+	/* Fill in the fixed part, capping the lengths to what will fit */
+	method = &response->method;
+	memset(&header, 0x0, sizeof(header));
+	header.magic = BINLOG_MAGIC;
+	header.status = response->status;
+	header.time = response->time;
+	header.addr = conn->ip;
+	header.method_length = 
+		(method->method.length > 0xFF) ? 0xFF : method->method.length;
+	header.url_length = 
+		(method->url.length > 0xFFFF) ? 0xFFFF : method->url.length;
+	header.version_length = 
+		(method->version.length > 0xFF) ? 0xFF : method->version.length;
+	if (response->log_progress) {
+		if (response->header_sent < response->header_length)
+			header.status = BINLOG_STATUS_TERMINATED;
+		header.bytes_sent = response->body_sent + response->file_sent;
+		header.bytes_total = response->log_total;
+	}
+
+	/* Put the record together, somewhere bigger if it's a long url */
+	length = sizeof(header) + header.method_length + header.url_length +
+		header.version_length;
+	ptr = (length <= sizeof(record)) ? record : malloc(length);
+	memcpy(ptr, &header, sizeof(header));
+	memcpy(ptr + sizeof(header), method->method.ptr, header.method_length);
+	memcpy(ptr + sizeof(header) + header.method_length, method->url.ptr,
+		header.url_length);
+	memcpy(ptr + length - header.version_length, method->version.ptr,
+		header.version_length);
+
+	server_fs_log_record(fs, ptr, length);
+	if (ptr != record)
+		free(ptr);
+}
+
+
+/*
+ * Decide on the response to a request, as http_conn_dispatch.
+ */
+void http_conn_decide(struct server_filesystem *fs, struct http_conn *conn) {
+	struct http_method *method;
+	struct http_render_cache *cache;
+	struct http_response *response;
+	struct http_header header_buf;
+	struct http_header *header;
+	struct http_range ranges[HTTP_RANGE_MAX];
+	const struct mime_type *mime;
+	struct server_file file;
+	const char *encoding;
+	char *filename;
+	char path[PATH_MAX];
+	int range_count;
+	int found;
+	int max_age;
+	int status;
+
+	method = &conn->method;
+	conn->keep_alive = http_conn_wants_keep_alive(conn);
+
+	/* Check the method */
+	if ((method->method.length != 3) || 
+		strncmp("GET", method->method.ptr, 3)) 
+	{
+		/* Request is not a get, issue 405 bad method */
+		http_response_const(conn, RESPONSE_405);
+		return;
+	}
+
+	/* Path must start with a slash */
+	if (method->url.ptr[0] != '/') {
+		http_response_const(conn, RESPONSE_400);
+		return;
+	}
+
+	/* The stats have a URL of their own, if they're being kept */
+	if (fs->stats && method->url.length == strlen(fs->stats->path) &&
+		!strncmp(fs->stats->path, method->url.ptr, method->url.length))
+	{
+		http_response_stats(fs, conn);
+		return;
+	}
+
+	/* 
+	 * Null terminate the file to get name, a copy of it since the path is
+	 * normalized in place. One too long to be a path can't be a file.
+	 */
+	if (method->url.length >= sizeof(path)) {
+		http_response_const(conn, RESPONSE_404);
+		return;
+	}
+	filename = path;
+	memcpy(filename, method->url.ptr, method->url.length);
+	filename[method->url.length] = '\0';
+
+	/* 
+	 * What the file is, and if it's worth compressing, whether there's a
+	 * precompressed copy of it to send instead. Those are never compressed
+	 * here, that's left to whoever puts the file there.
+	 */
+	mime = http_mime_type(filename);
+	encoding = NULL;
+	found = 0;
+	if (mime->compressible)
+		found = http_conn_sidecar(fs, conn, filename, &file, &encoding);
+
+	/* 
+	 * If the client's copy of the file is still good, say so, without
+	 * opening the file.
+	 */
+	if ((http_conn_header(conn, "If-None-Match", &header_buf) ||
+		http_conn_header(conn, "If-Modified-Since", &header_buf)) &&
+		(found || server_fs_stat(fs, filename, &file) == FS_OKAY) &&
+		!http_conn_modified(conn, &file))
+	{
+		conn->timing.resolved = server_stats_now();
+		http_response_not_modified(conn, &file,
+			server_fs_max_age(fs, filename), mime->compressible);
+		return;
+	}
+
+	/* Open file */
+	conn->timing.resolved = server_stats_now();
+	status = server_fs_open(fs, filename, &file);
+	conn->timing.opened = server_stats_now();
+	max_age = server_fs_max_age(fs, filename);
+	if (status != FS_OKAY) {
+		/* Problem opening the file for response */
+		if (status == FS_EFILE_FORBIDDEN) {
+			http_response_const(conn, RESPONSE_403);
+		} else if (status == FS_EFILE_NOTFOUND) {
+			http_response_const(conn, RESPONSE_404);
+		} else {
+			http_response_const(conn, RESPONSE_500);
+		}
+		return;
+	}
+
+	/* The file exists, respond with all of it, or the ranges asked for */
+	response = http_conn_add_response(conn);
+	response->file = file;
+	response->content_type = mime->type;
+	response->content_encoding = encoding;
+	response->vary = mime->compressible;
+	cache = http_render_now();
+	response->time = cache->second;
+	memcpy(response->date, cache->date, sizeof(response->date));
+
+	range_count = -1;
+	header = http_conn_header(conn, "Range", &header_buf);
+	if (header && http_conn_if_range(conn, &file)) {
+		range_count = parse_range(header, file.size, ranges,
+			HTTP_RANGE_MAX);
+	}
+
+	/* 
+	 * The Content-Encoding of a multipart body would apply to all of it,
+	 * not just the parts, so precompressed copies are sent whole instead.
+	 */
+	if (range_count > 1 && encoding)
+		range_count = -1;
+
+	if (range_count == 0)
+		http_response_unsatisfiable(conn, response);
+	else if (range_count == 1)
+		http_response_range(conn, response, &ranges[0]);
+	else if (range_count > 1)
+		http_response_multipart(conn, response, ranges, range_count);
+	else
+		http_response_full(conn, response);
+	http_response_validators(response, &file, max_age);
+}
+
+
+void http_conn_dispatch(struct server_filesystem *fs, struct http_conn *conn)
+{
+	uint64_t cpu;
+	int timed;
+
+	/* Note how much CPU time it takes, if anyone wants to know */
+	timed = fs->log_timing || fs->slow_fd >= 0;
+	cpu = timed ? http_cpu_now() : 0;
+	http_conn_decide(fs, conn);
+	if (timed && conn->response_count > 0) {
+		http_conn_response(conn, conn->response_count - 1)->timing.cpu =
+			http_cpu_now() - cpu;
+	}
+}
+
+
+struct http_header *http_conn_header(struct http_conn *conn,
+	const char *label, struct http_header *header)
+{
+	return find_header(header, conn->buffer + conn->request_start,
+		conn->headers, conn->header_count, label);
+}
+
+
+void http_conn_bad_request(struct http_conn *conn) {
+	/* We can't tell where the next request would start, so stop here */
+	conn->keep_alive = 0;
+
+	/* Log what the request was, if it got past the method */
+	if (conn->line_count > 1) {
+		method_from_offsets(&conn->method, &conn->method_offsets,
+			conn->buffer + conn->request_start);
+	}
+
+	if (conn->lex_state == RECV_STATE_TOO_LARGE)
+		http_response_const(conn, RESPONSE_431);
+	else
+		http_response_const(conn, RESPONSE_400);
+}
+
+
+/*
+ * Translate the errno of a failed send into a status for http_conn_send.
+ * Timeouts on a blocking socket come back as HTTP_CONN_AGAIN too.
+ */
+int http_conn_send_status() {
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		return HTTP_CONN_AGAIN;
+	else
+		return HTTP_CONN_ERROR;
+}
+
+
+/*
+ * Send the headers and in-memory bodies of all of the waiting responses,
+ * gathered together so that as few calls as possible are needed.
+ * Returns: As http_conn_send
+ */
+int http_conn_send_memory(struct http_conn *conn) {
+	struct iovec iov[HTTP_GATHER_MAX];
+	struct msghdr msg;
+	ssize_t sent;
+	int count;
+
+	for (;;) {
+		/* Gather up everything that is left to send, in order */
+		count = http_conn_gather(conn, iov);
+		if (count == 0)
+			return HTTP_CONN_DONE;
+
+		/* sendmsg is writev that can take MSG_NOSIGNAL */
+		memset(&msg, 0x0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0)
+			return http_conn_send_status();
+		http_conn_sent(conn, sent);
+	}
+}
+
+
+int http_conn_gather(struct http_conn *conn, struct iovec *iov) {
+	struct http_response *response;
+	int count;
+	int i;
+
+	count = 0;
+	for (i = 0; i < conn->response_count; ++i) {
+		response = http_conn_response(conn, i);
+		if (response->header_sent < response->header_length) {
+			iov[count].iov_base = response->header + response->header_sent;
+			iov[count].iov_len =
+				response->header_length - response->header_sent;
+			++count;
+		}
+		if (response->body_sent < response->body_length) {
+			iov[count].iov_base =
+				(char *)response->body + response->body_sent;
+			iov[count].iov_len =
+				response->body_length - response->body_sent;
+			++count;
+		}
+	}
+	return count;
+}
+
+
+void http_conn_sent(struct http_conn *conn, size_t sent) {
+	struct http_response *response;
+	size_t part;
+	int i;
+
+	/* Credit what got sent to the responses, in the same order */
+	for (i = 0; i < conn->response_count && sent > 0; ++i) {
+		response = http_conn_response(conn, i);
+
+		part = response->header_length - response->header_sent;
+		if (part > sent)
+			part = sent;
+		if (part > 0 && response->header_sent == 0)
+			response->timing.first_byte = server_stats_now();
+		response->header_sent += part;
+		sent -= part;
+
+		part = response->body_length - response->body_sent;
+		if (part > sent)
+			part = sent;
+		response->body_sent += part;
+		sent -= part;
+	}
+}
+
+
+size_t http_conn_segment(struct http_conn *conn, const char **data,
+	int *fd, off_t *offset)
+{
+	struct http_response *last;
+	struct http_segment *segment;
+
+	/* Only the last response can have segments */
+	if (conn->response_count == 0)
+		return 0;
+	last = http_conn_response(conn, conn->response_count - 1);
+
+	/* Move on past the ones that are done */
+	for (; last->segment_index < last->segment_count; ++last->segment_index) {
+		segment = &last->segments[last->segment_index];
+		if (last->segment_sent < segment->length) {
+			*data = segment->data ? segment->data + last->segment_sent : NULL;
+			*fd = last->file.fd;
+			*offset = segment->offset + last->segment_sent;
+			return segment->length - last->segment_sent;
+		}
+		last->segment_sent = 0;
+	}
+	return 0;
+}
+
+
+void http_conn_segment_sent(struct http_conn *conn, size_t sent) {
+	struct http_response *last;
+
+	last = http_conn_response(conn, conn->response_count - 1);
+	last->segment_sent += sent;
+	if (last->segments[last->segment_index].is_content)
+		last->file_sent += sent;
+}
+
+
+/*
+ * Send what's left of one of |response|'s segments. Bytes in memory are
+ * sent as they are, and the file's contents with sendfile, unless it can't
+ * be, in which case they're read in and sent a chunk at a time.
+ * Returns: As http_conn_send
+ */
+int http_conn_send_segment(struct http_conn *conn,
+	struct http_response *response, struct http_segment *segment)
+{
+	ssize_t sent;
+	ssize_t len;
+	size_t left;
+	off_t offset;
+	int more;
+
+	/* Hold small pieces back if there's more to come after them */
+	more = (segment < &response->segments[response->segment_count - 1]) ?
+		MSG_MORE : 0;
+
+	while (response->segment_sent < segment->length) {
+		left = segment->length - response->segment_sent;
+		if (segment->data) {
+			sent = send(conn->fd, segment->data + response->segment_sent,
+				left, MSG_NOSIGNAL | more);
+		} else if (!conn->no_sendfile) {
+			/* 
+			 * Write file contents straight from the file to the socket
+			 * with sendfile, no copying them through our own buffer.
+			 */
+			offset = segment->offset + response->segment_sent;
+			sent = sendfile(conn->fd, response->file.fd, &offset, left);
+			if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				/* Can't sendfile this file, fall back to read / write */
+				conn->no_sendfile = 1;
+				continue;
+			} else if (sent == 0) {
+				/* The file got shorter since we opened it, can't finish */
+				return HTTP_CONN_ERROR;
+			}
+		} else {
+			/* Read the next chunk once the last one has all been sent */
+			if (conn->chunk_sent == conn->chunk_length) {
+				len = pread(response->file.fd, conn->chunk,
+					(left < sizeof(conn->chunk)) ? left : sizeof(conn->chunk),
+					segment->offset + response->segment_sent);
+				if (len <= 0) {
+					/* End of the file, or an error reading it */
+					return HTTP_CONN_ERROR;
+				}
+				conn->chunk_length = len;
+				conn->chunk_sent = 0;
+			}
+
+			/* 
+			 * Try to write out the data chunk that we read, the socket
+			 * may only take part of it.
+			 */
+			sent = send(conn->fd,
+				conn->chunk + conn->chunk_sent,
+				conn->chunk_length - conn->chunk_sent,
+				MSG_NOSIGNAL);
+			if (sent > 0)
+				conn->chunk_sent += sent;
+		}
+		if (sent < 0)
+			return http_conn_send_status();
+
+		response->segment_sent += sent;
+		if (segment->is_content)
+			response->file_sent += sent;
+	}
+
+	return HTTP_CONN_DONE;
+}
+
+
+int http_conn_send(struct http_conn *conn) {
+	struct http_response *last;
+	int status;
+
+	/* Write the headers, and constant (or cached) bodies */
+	status = http_conn_send_memory(conn);
+	if (status != HTTP_CONN_DONE)
+		return status;
+
+	/* Only the last response can have a file to send */
+	if (conn->response_count == 0)
+		return HTTP_CONN_DONE;
+	last = http_conn_response(conn, conn->response_count - 1);
+
+	/* Then it's segments, one after another */
+	while (last->segment_index < last->segment_count) {
+		status = http_conn_send_segment(conn, last,
+			&last->segments[last->segment_index]);
+		if (status != HTTP_CONN_DONE)
+			return status;
+		++last->segment_index;
+		last->segment_sent = 0;
+	}
+
+	return HTTP_CONN_DONE;
+}
+
+
+void http_conn_finish(struct server_filesystem *fs, struct http_conn *conn) {
+	struct http_response *response;
+	struct http_method *method;
+	const char *result;
+	char progress[128];
+	char timing[160];
+	uint64_t now;
+	int slow;
+	int i;
+
+	now = server_stats_now();
+	for (i = 0; i < conn->response_count; ++i) {
+		response = http_conn_response(conn, i);
+		method = &response->method;
+		response->timing.last_byte = now;
+		slow = (fs->slow_fd >= 0) && response->timing.started &&
+			(now - response->timing.started >= fs->slow_us);
+
+		/* How long each phase took, if that's being logged */
+		timing[0] = '\0';
+		if (fs->log_timing || slow)
+			format_timing(timing, sizeof(timing), &response->timing);
+
+		if (!response->log_progress) {
+			/* A constant response, log it's status */
+			result = response->log_status;
+		} else if (response->header_sent < response->header_length) {
+			/* At this point, we may have sent some of the header already,
+			 * so the only option was to stop sending and fail; we couldn't
+			 * start a 500 Internal Server Error at this point.
+			 */
+			result = "Connection unexpectedly terminated while "
+				"sending response header.";
+		} else {
+			/* Log how the 200 OK (or 206) response went, how much of the
+			 * data we managed to send out of the total to send.
+			 */
+			snprintf(progress, sizeof(progress), "%s %lu/%lu",
+				response->log_status,
+				(unsigned long)(response->body_sent + response->file_sent),
+				(unsigned long)response->log_total);
+			result = progress;
+		}
+
+		if (fs->log_binary) {
+			/* Leave the formatting to logconv */
+			http_response_log_binary(fs, conn, response);
+		} else {
+			http_response_log(fs, conn->addr, method, response->date,
+				result, fs->log_timing ? timing : "");
+		}
+
+		/* The slow ones go in a log of their own too, timings and all */
+		if (slow) {
+			server_fs_log_slow(fs, "%s\t%s\t%.*s %.*s %.*s\t%s\t%s\n",
+				response->date,
+				conn->addr,
+				method->method.length, method->method.ptr,
+				method->url.length, method->url.ptr,
+				method->version.length, method->version.ptr,
+				result, timing);
+		}
+
+		/* Count it, however it went */
+		server_stats_request(fs->stats, response->status,
+			response->header_sent + response->body_sent + response->file_sent,
+			response->timing.started);
+
+		/* Done with the file */
+		server_fs_close_file(fs, &response->file);
+		if (response->parts)
+			free(response->parts);
+		if (response->content)
+			free(response->content);
+	}
+
+	/* 
+	 * Done with the responses, and the requests they were for can be
+	 * dropped from the buffer.
+	 */
+	conn->response_count = 0;
+	conn->no_sendfile = 0;
+	conn->chunk_length = 0;
+	conn->chunk_sent = 0;
+	http_conn_compact(conn);
+}
+
+
+/*
+ * Request buffers of BUFFER_INITIAL bytes that closed connections have
+ * left, for new connections to take rather than allocating one. Each
+ * thread has it's own, so they never need a lock.
+ */
+__thread char *spare_buffers[BUFFER_SPARE_MAX];
+__thread int spare_buffer_count;
+
+/* The same for the room for batches of responses, see http_conn_batching */
+__thread struct http_response *spare_batches[BATCH_SPARE_MAX];
+__thread int spare_batch_count;
+
+
+void http_conn_init(struct http_conn *conn, int connection_fd,
+	const char *addr)
+{
+	/* Start with everything empty */
+	memset(conn, 0x0, sizeof(struct http_conn));
+	conn->fd = connection_fd;
+	strncpy(conn->addr, addr, sizeof(conn->addr) - 1);
+	inet_pton(AF_INET, conn->addr, &conn->ip);
+
+	/* Set up the growable buffer that we read the request into */
+	conn->buffer_capacity = BUFFER_INITIAL;
+	if (spare_buffer_count > 0)
+		conn->buffer = spare_buffers[--spare_buffer_count];
+	else
+		conn->buffer = malloc(conn->buffer_capacity + 1); /* +1 -> '\0' */
+
+	/* Set the initial lex state */
+	conn->lex_state = RECV_STATE_READY;
+}
+
+
+/*
+ * Lex the newly received part of the buffer, processing each complete line
+ * as the request method or a header, until reaching the end of the buffer or
+ * the empty line ending the request.
+ * Returns 0 -> The request was malformed
+ *         1 -> Everything so far is okay
+ */
+int http_conn_lex(struct http_conn *conn) {
+	char *after;
+	char *base;
+
+	/* Lex to see if we reached the end of the packet. EOF condition:
+	 * \r\n or \n alone on a line
+	 */
+	after = conn->buffer + conn->buffer_size;
+	base = conn->buffer + conn->request_start;
+	while (conn->buffer_index < conn->buffer_size) {
+		char *newline;
+		char *line;
+		char *ptr;
+		size_t line_length;
+
+		/* Find the end of the line, many bytes at a time */
+		newline = scan_for(conn->buffer + conn->buffer_index, after, '\n');
+		if (newline == after) {
+			/* Not all here yet, carry on from here once more comes in */
+			conn->buffer_index = conn->buffer_size;
+			if (conn->buffer_size - conn->request_start > HTTP_REQUEST_MAX) {
+				conn->lex_state = RECV_STATE_TOO_LARGE;
+				return 0;
+			}
+			break;
+		}
+		conn->buffer_index = newline - conn->buffer;
+		if (conn->buffer_index - conn->request_start > HTTP_REQUEST_MAX) {
+			conn->lex_state = RECV_STATE_TOO_LARGE;
+			return 0;
+		}
+
+		/*
+		 * A line with nothing on it (but \r) ends the request. Unless it's
+		 * before the request line, then it's skipped: Clients may send an
+		 * extra CRLF after a request's body (RFC 9112 2.2). The request is
+		 * taken to start after it.
+		 */
+		line = conn->buffer + conn->line_start_index;
+		for (ptr = line; (ptr < newline) && (*ptr == '\r'); ++ptr)
+			;
+		if (ptr == newline && conn->line_count == 0) {
+			++conn->buffer_index;
+			conn->line_start_index = conn->buffer_index;
+			conn->request_start = conn->buffer_index;
+			base = conn->buffer + conn->request_start;
+			continue;
+		} else if (ptr == newline) {
+			conn->lex_state = RECV_STATE_EOF;
+			break;
+		}
+
+		/* Complete line has been read in */
+		++conn->line_count;
+		line_length = conn->buffer_index - conn->line_start_index + 1;
+
+		/* Process this line */
+		if (conn->line_count == 1) {
+			/* Line number 1 is the request method */
+			struct http_method method;
+
+			if (!parse_method(&method, line, line_length)) {
+				/* Error malformed method */
+				return 0;
+			}
+			method_to_offsets(&conn->method_offsets, &method, base);
+		} else {
+			/* Other lines are request headers */
+			struct http_header header;
+
+			if (!parse_header(&header, line, line_length)) {
+				/* Error malformed header */
+				return 0;
+			}
+
+			/* Otherwise, add it to the table, if there's room */
+			if (conn->header_count == HTTP_HEADER_MAX) {
+				conn->lex_state = RECV_STATE_TOO_LARGE;
+				return 0;
+			}
+			header_to_offsets(&conn->headers[conn->header_count++],
+				&header, base);
+		}
+
+		/* Line processed, the next one starts after the \n */
+		++conn->buffer_index;
+		conn->line_start_index = conn->buffer_index;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Body consumers, see http_conn_start_body. The first throws the body away
+ * as it comes in, the other keeps all of it in request_content, for a
+ * handler that can't make do with it a piece at a time.
+ * Returns 0 -> Fail the request
+ *         1 -> Okay
+ */
+int http_body_discard(struct http_conn *conn, char *data, size_t length) {
+	return 1;
+}
+
+
+int http_body_collect(struct http_conn *conn, char *data, size_t length) {
+	char *content;
+
+	content = realloc(conn->request_content, conn->content_read + length);
+	if (!content)
+		return 0;
+	memcpy(content + conn->content_read, data, length);
+	conn->request_content = content;
+	return 1;
+}
+
+
+/*
+ * Get the request's Content-Length. It may be given more than once, but
+ * only if each one says the same, otherwise something in front of us may
+ * have gone by a different one than we would.
+ * Returns 0 -> One is malformed or over HTTP_BODY_MAX, or they differ
+ *         1 -> Okay, the length is in |length|
+ */
+int http_conn_content_length(struct http_conn *conn, size_t *length) {
+	struct http_header header;
+	struct http_header_offsets *offsets;
+	char *base;
+	size_t value;
+	int found;
+	int i;
+
+	base = conn->buffer + conn->request_start;
+	found = 0;
+	for (i = 0; i < conn->header_count; ++i) {
+		offsets = &conn->headers[i];
+		if (offsets->label.length != sizeof("Content-Length") - 1 ||
+			strncasecmp(base + offsets->label.offset, "Content-Length",
+			offsets->label.length))
+		{
+			continue;
+		}
+
+		header_from_offsets(&header, offsets, base);
+		if (!header_value_as_size_t(&header, &value, HTTP_BODY_MAX) ||
+			(found && value != *length))
+		{
+			return 0;
+		}
+		*length = value;
+		found = 1;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Called once the request headers are complete, to set up reading in the
+ * request body if there is one (a Content-Length or Transfer-Encoding
+ * header exists).
+ * Returns 0 -> The Content-Length or Transfer-Encoding was bad
+ *         1 -> Okay, lex_state is RECV_STATE_BODY if there is a body to
+ *              read, otherwise RECV_STATE_DONE
+ */
+int http_conn_start_body(struct http_conn *conn) {
+	struct http_header length_buf;
+	struct http_header encoding_buf;
+	struct http_header *length;
+	struct http_header *encoding;
+
+	/* Is there a body? */
+	conn->request_end = conn->buffer_index + 1;
+	conn->lex_state = RECV_STATE_DONE;
+	length = http_conn_header(conn, "Content-Length", &length_buf);
+	encoding = http_conn_header(conn, "Transfer-Encoding", &encoding_buf);
+	if (encoding) {
+		/* 
+		 * It has to end where the chunks do. Having a Content-Length as
+		 * well is turned down, something in front of us may have gone by
+		 * the other one.
+		 */
+		if (length || !header_last_token(encoding, "chunked"))
+			return 0;
+		conn->chunked = 1;
+		chunked_init(&conn->chunked_state);
+	} else if (length) {
+		if (!http_conn_content_length(conn, &conn->content_length)) {
+			/* Error too long, or they don't agree */
+			return 0;
+		}
+		if (conn->content_length == 0)
+			return 1;
+	} else {
+		return 1;
+	}
+
+	/* 
+	 * Nothing we handle takes a body: A GET ignores it, and anything else
+	 * is a 405. So it's thrown away as it comes in, however big it is. A
+	 * handler that needs all of it would use http_body_collect instead.
+	 */
+	conn->body_consumer = http_body_discard;
+	conn->content_read = 0;
+	conn->lex_state = RECV_STATE_BODY;
+	return 1;
+}
+
+
+/*
+ * Pass the body that has come in after the request, in the buffer, to it's
+ * consumer, decoding it first if it's chunked, and drop it from the buffer.
+ * The request stays ending at request_end, with how far into the body it
+ * is counted only by content_read, so the buffer never holds more than the
+ * request and a read's worth of body. Anything after the end of the body
+ * is the next request, and is moved down to request_end.
+ * Returns 0 -> The body was malformed or too big, or the consumer failed
+ *         1 -> Okay, lex_state is RECV_STATE_DONE if that was all of it
+ */
+int http_conn_consume_body(struct http_conn *conn) {
+	char *data;
+	size_t available;
+	size_t used;
+	size_t decoded;
+	int status;
+
+	data = conn->buffer + conn->request_end;
+	available = conn->buffer_size - conn->request_end;
+	if (conn->chunked) {
+		status = chunked_decode(&conn->chunked_state, data, available,
+			&used, &decoded);
+		if (status < 0 || conn->content_read + decoded > HTTP_BODY_MAX)
+			return 0;
+	} else {
+		used = conn->content_length - conn->content_read;
+		if (used > available)
+			used = available;
+		decoded = used;
+		status = (conn->content_read + used == conn->content_length);
+	}
+
+	if (decoded > 0 && !conn->body_consumer(conn, data, decoded))
+		return 0;
+	conn->content_read += decoded;
+
+	/*
+	 * The consumer is done with it, so the buffer can take in more of the
+	 * body where it was. Whatever's left over goes down in it's place.
+	 */
+	if (used < available)
+		memmove(data, data + used, available - used);
+	conn->buffer_size -= used;
+	if (status)
+		conn->lex_state = RECV_STATE_DONE;
+	return 1;
+}
+
+
+int http_conn_recv(struct http_conn *conn) {
+	for (;;) {
+		ssize_t received;
+		char *space;
+		size_t size;
+		int status;
+
+		/*
+		 * Note when the request started to arrive, and if it's the first
+		 * on the connection, when that was accepted.
+		 */
+		if (!conn->timing.started && conn->buffer_size > conn->request_start)
+		{
+			conn->timing.started = server_stats_now();
+			if (conn->request_count == 0)
+				conn->timing.accepted = conn->accepted;
+		}
+
+		if (conn->lex_state == RECV_STATE_BODY) {
+			/* Pass on as much of the request body as is here */
+			if (!http_conn_consume_body(conn))
+				return HTTP_CONN_ERROR;
+		} else if (conn->lex_state != RECV_STATE_DONE) {
+			/* 
+			 * Lex what we have, which on a persistent connection may
+			 * already include some (or all) of this request.
+			 */
+			if (!http_conn_lex(conn))
+				return HTTP_CONN_ERROR;
+
+			/* If we got the complete request, go on to the body */
+			if (conn->lex_state == RECV_STATE_EOF) {
+				/* Note: Safe since we allocate one additional byte on top
+				 * of the capacity that we are working with when
+				 * maniuplating the buffer, as space to put this null
+				 * terminator at. */
+				conn->buffer[conn->buffer_index] = '\0';
+
+				/* Set up reading the body */
+				if (!http_conn_start_body(conn))
+					return HTTP_CONN_ERROR;
+				continue;
+			}
+		}
+
+		/* 
+		 * All of it is here. The buffer stays put until the response has
+		 * been sent, so the method can point into it now, if the request
+		 * line was parsed. Otherwise it stays empty, rather than logging
+		 * whatever the offsets would point at.
+		 */
+		if (conn->lex_state == RECV_STATE_DONE) {
+			if (conn->line_count > 0) {
+				method_from_offsets(&conn->method, &conn->method_offsets,
+					conn->buffer + conn->request_start);
+			}
+			conn->timing.received = server_stats_now();
+			return HTTP_CONN_DONE;
+		}
+
+		/* 
+		 * More of the request is needed. If there are responses waiting,
+		 * send those first: The client may be waiting on them before it
+		 * sends any more, and they point into the buffer, so it has to
+		 * stay put until they're done.
+		 */
+		if (conn->response_count > 0 || conn->external_reads)
+			return HTTP_CONN_AGAIN;
+
+		/* Read a new chunk into the buffer */
+		size = http_conn_read_space(conn, &space);
+		if (size == 0)
+			return HTTP_CONN_ERROR;
+		received = recv(conn->fd, space, size, 0);
+
+		/* No more data yet, or recv failed / the connection closed */
+		if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return HTTP_CONN_AGAIN;
+		status = http_conn_read_done(conn, received);
+		if (status != HTTP_CONN_DONE)
+			return status;
+	}
+}
+
+
+size_t http_conn_read_space(struct http_conn *conn, char **space) {
+	char *buffer;
+
+	if ((conn->buffer_capacity - conn->buffer_size) <
+		conn->buffer_capacity/2)
+	{
+		/*
+		 * Double the buffer when it is more than half full. Nothing
+		 * points into it yet, so it's free to move. What it holds is the
+		 * request's headers, which the lexer keeps to HTTP_REQUEST_MAX,
+		 * and at most a read's worth of it's body, since that's dropped
+		 * as it's passed on.
+		 */
+		buffer = realloc(conn->buffer, conn->buffer_capacity*2 + 1);
+		if (!buffer)
+			return 0;
+		conn->buffer = buffer;
+		conn->buffer_capacity *= 2;
+	}
+
+	*space = conn->buffer + conn->buffer_size;
+	return conn->buffer_capacity - conn->buffer_size;
+}
+
+
+int http_conn_read_done(struct http_conn *conn, ssize_t received) {
+	if (received <= 0) {
+		/*
+		 * Between requests that's just the client hanging up, not a
+		 * bad request.
+		 */
+		if (conn->buffer_size == conn->request_start)
+			return HTTP_CONN_CLOSED;
+		return HTTP_CONN_ERROR;
+	}
+
+	/* Add the content */
+	conn->buffer_size += received;
+	return HTTP_CONN_DONE;
+}
+
+
+int http_conn_next(struct http_conn *conn) {
+	if (!conn->keep_alive)
+		return 0;
+
+	/* Forget the last request's headers, and free it's content */
+	conn->header_count = 0;
+	if (conn->request_content)
+		free(conn->request_content);
+	conn->request_content = NULL;
+	conn->body_consumer = NULL;
+	conn->chunked = 0;
+	conn->content_length = 0;
+	conn->content_read = 0;
+	memset(&conn->timing, 0x0, sizeof(conn->timing));
+
+	/* 
+	 * Lex the next request from where the last one ended. The last one
+	 * stays in the buffer until it's response has been sent, see
+	 * http_conn_compact.
+	 */
+	conn->request_start = conn->request_end;
+	conn->buffer_index = conn->request_end;
+	conn->line_start_index = conn->request_end;
+	conn->lex_state = RECV_STATE_READY;
+	conn->line_count = 0;
+	memset(&conn->method, 0x0, sizeof(conn->method));
+	memset(&conn->method_offsets, 0x0, sizeof(conn->method_offsets));
+
+	++conn->request_count;
+	return 1;
+}
+
+
+int http_conn_batching(struct http_conn *conn) {
+	struct http_response *last;
+
+	if (conn->response_count == 0)
+		return 1;
+	if (conn->response_count >= HTTP_BATCH_MAX)
+		return 0;
+
+	/* 
+	 * A file has to be sent on it's own after everything before it, and
+	 * a big body holds up the responses after it anyway.
+	 */
+	last = http_conn_response(conn, conn->response_count - 1);
+	if (last->segment_count > 0 || last->body_length > HTTP_BATCH_BODY_MAX)
+		return 0;
+
+	/* Make room for the rest of the batch, the first time it's needed */
+	if (!conn->batch) {
+		if (spare_batch_count > 0) {
+			conn->batch = spare_batches[--spare_batch_count];
+		} else {
+			conn->batch = malloc(sizeof(struct http_response) *
+				(HTTP_BATCH_MAX - 1));
+		}
+	}
+	return conn->batch != NULL;
+}
+
+
+/*
+ * Drop the requests that have been responded to from the front of the
+ * buffer, moving what's left (some or all of the next request) down to the
+ * start of it.
+ */
+void http_conn_compact(struct http_conn *conn) {
+	size_t start;
+
+	start = conn->request_start;
+	if (start == 0)
+		return;
+
+	memmove(conn->buffer, conn->buffer + start, conn->buffer_size - start);
+	conn->buffer_size -= start;
+	conn->buffer_index -= start;
+	conn->line_start_index -= start;
+	conn->request_end = (conn->request_end > start) ? 
+		conn->request_end - start : 0;
+	conn->request_start = 0;
+}
+
+
+/*
+ * Wait up to |timeout| seconds for the next request on a blocking
+ * connection to start arriving, if it isn't already in the buffer. With
+ * |idle|, stop waiting as soon as the worker is wanted elsewhere.
+ * Returns 0 -> The connection stayed idle, or failed
+ *         1 -> There is something to read
+ *         2 -> The worker is wanted, give the connection up
+ */
+int http_conn_wait(struct http_conn *conn, int timeout,
+	struct http_idle *idle)
+{
+	struct pollfd pfds[2];
+	uint64_t deadline;
+	uint64_t now;
+	int status;
+
+	if (conn->buffer_size > 0)
+		return 1;
+
+	pfds[0].fd = conn->fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = idle ? idle->fd : -1;
+	pfds[1].events = POLLIN;
+	deadline = server_stats_now() + (uint64_t)timeout * 1000000;
+	for (;;) {
+		now = server_stats_now();
+		if (now >= deadline)
+			return 0;
+		pfds[0].revents = 0;
+		pfds[1].revents = 0;
+		status = poll(pfds, idle ? 2 : 1, (deadline - now + 999) / 1000);
+		if (status < 0 && errno == EINTR)
+			continue;
+		if (status <= 0 || pfds[0].revents)
+			return status > 0;
+
+		/* Something else may want the worker */
+		if (!idle->claim || idle->claim(idle->arg))
+			return 2;
+	}
+}
+
+
+void http_conn_destroy(struct http_conn *conn) {
+	/* Free the request content */
+	if (conn->request_content)
+		free(conn->request_content);
+
+	/* Keep the room for a batch of responses too, if it had any */
+	if (conn->batch) {
+		if (spare_batch_count < BATCH_SPARE_MAX)
+			spare_batches[spare_batch_count++] = conn->batch;
+		else
+			free(conn->batch);
+	}
+
+	/* 
+	 * Keep the buffer we used for the next connection, unless it grew or
+	 * there are enough spares already.
+	 */
+	if (conn->buffer_capacity == BUFFER_INITIAL &&
+		spare_buffer_count < BUFFER_SPARE_MAX)
+	{
+		spare_buffers[spare_buffer_count++] = conn->buffer;
+	} else {
+		free(conn->buffer);
+	}
+}
+
+
+int handle_http_request(struct server_filesystem *fs, int connection_fd,
+	char *addr, uint64_t accepted, struct http_idle *idle)
+{
+	struct http_conn *conn;
+	int status;
+	int waited;
+
+	/*
+	 * Set up the connection state, on the heap, since it's too big to leave
+	 * much room on a worker thread's stack for the rest of the request.
+	 */
+	conn = malloc(sizeof(struct http_conn));
+	if (!conn)
+		return 0;
+	http_conn_init(conn, connection_fd, addr);
+	conn->accepted = accepted;
+	if (idle)
+		conn->request_count = idle->requests;
+	waited = 0;
+
+	/* Serve requests until the connection is closed or goes idle */
+	for (;;) {
+		/* 
+		 * Read the request, the socket is blocking so anything other than
+		 * HTTP_CONN_DONE means the request was bad or timed out, or the
+		 * client hung up. Unless there are responses waiting, then it's
+		 * time to send them.
+		 */
+		status = http_conn_recv(conn);
+		if (status == HTTP_CONN_CLOSED)
+			break;
+		if (status != HTTP_CONN_AGAIN || conn->response_count == 0) {
+			if (status == HTTP_CONN_DONE)
+				http_conn_dispatch(fs, conn);
+			else
+				http_conn_bad_request(conn);
+
+			/* 
+			 * Respond to any more pipelined requests that are already
+			 * here along with this one.
+			 */
+			if (http_conn_next(conn) && http_conn_batching(conn))
+				continue;
+		}
+
+		/* Serve the responses, again anything but done is a failure */
+		if (http_conn_send(conn) != HTTP_CONN_DONE)
+			conn->keep_alive = 0;
+
+		/* Log the result */
+		http_conn_finish(fs, conn);
+
+		/*
+		 * Wait for the next request, unless the connection is done, or
+		 * until the worker is wanted for something else.
+		 */
+		waited = conn->keep_alive ?
+			http_conn_wait(conn, HTTP_KEEPALIVE_TIMEOUT, idle) : 0;
+		if (waited != 1)
+			break;
+	}
+
+	/* Clean up, noting how far it got if it's picked up again */
+	if (idle)
+		idle->requests = conn->request_count;
+	http_conn_destroy(conn);
+	free(conn);
+	return waited == 2;
+}
@@ -1,15 +1,409 @@
-
 #ifndef SERVER_HTTP_H_
 #define SERVER_HTTP_H_
 
 #include "server_filesystem.h"
+#include "http_request.h"
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Status codes returned by http_conn_recv and http_conn_send */
+#define HTTP_CONN_DONE    1 /* The request was read / the response was sent */
+#define HTTP_CONN_AGAIN   0 /* The socket would block, retry when it's ready */
+#define HTTP_CONN_ERROR  -1 /* Malformed request, or the connection failed */
+#define HTTP_CONN_CLOSED -2 /* Closed before any of a new request arrived */
+
+/*
+ * How long a persistent connection may sit idle between requests, and how
+ * many requests it may make before we close it.
+ */
+#define HTTP_KEEPALIVE_TIMEOUT 5 /* seconds */
+#define HTTP_KEEPALIVE_MAX     100
 
 /*
- * Handle a request on a given connection, as a file descriptor, using a given 
+ * How big a request's method and headers may be altogether, and how many
+ * headers it may have, before it's turned away with a 431.
+ */
+#define HTTP_REQUEST_MAX (16*1024) /* 16 KB */
+#define HTTP_HEADER_MAX  64
+
+/* The biggest request body that will be read, even just to throw it away */
+#define HTTP_BODY_MAX (100*1024*1024) /* 100 MB */
+
+/*
+ * How many pipelined requests may have their responses batched together, and
+ * how big a response body may be for more responses to be batched after it.
+ */
+#define HTTP_BATCH_MAX       8
+#define HTTP_BATCH_BODY_MAX  (16*1024) /* 16 KB */
+
+/* How many pieces the responses' headers and bodies may be gathered into */
+#define HTTP_GATHER_MAX (HTTP_BATCH_MAX*2)
+
+/*
+ * How many segments a response may have: A multipart/byteranges body has
+ * a part header before each range, and the closing boundary after them.
+ */
+#define HTTP_SEGMENT_MAX (HTTP_RANGE_MAX*2 + 1)
+
+/*
+ * A piece of a response to send after it's header and body, either some
+ * bytes in memory, or |length| bytes of the response's file from |offset|.
+ * Only the pieces with the file's contents count towards what the log says
+ * was sent.
+ */
+struct http_segment {
+	const char *data; /* NULL to send from the file */
+	size_t offset;
+	size_t length;
+	int is_content;
+};
+
+
+/*
+ * When each phase of handling a request finished, see server_stats_now,
+ * or 0 if it never got that far (or, for |accepted|, if it's not the
+ * connection's first request).
+ */
+struct http_timing {
+	uint64_t accepted;   /* The connection was accepted */
+	uint64_t started;    /* The first of the request arrived */
+	uint64_t received;   /* All of the request (and any body) is here */
+	uint64_t resolved;   /* The path was checked, and looked up */
+	uint64_t opened;     /* The file was opened */
+	uint64_t first_byte; /* The first of the response was sent */
+	uint64_t last_byte;  /* The last of it was, or sending it failed */
+	uint64_t cpu;        /* Thread CPU time deciding on the response, in us */
+};
+
+
+/*
+ * A response to one request, and how much of it has been sent.
+ */
+struct http_response {
+	/* The request it's for, pointing into the connection's buffer */
+	struct http_method method;
+
+	/* The status code, when the response was made, and how long it took */
+	int status;
+	time_t time;
+	struct http_timing timing;
+
+	/* 
+	 * What the file is, how it's encoded if it's a precompressed copy, and
+	 * whether the response depends on the Accept-Encoding that was sent.
+	 */
+	const char *content_type;
+	const char *content_encoding;
+	int vary;
+
+	/* The response header, and how much of it has been sent */
+	char date[64];
+	char header[512];
+	size_t header_length;
+	size_t header_sent;
+
+	/* 
+	 * A constant (or cached) response body, and then the segments to send
+	 * from the file: The whole of it, or the ranges asked for with the
+	 * headers of a multipart/byteranges body around them.
+	 */
+	const char *body;
+	size_t body_length;
+	size_t body_sent;
+	char *content; /* A body made just for this response, freed with it */
+	struct server_file file;
+	struct http_segment segments[HTTP_SEGMENT_MAX];
+	int segment_count;
+	int segment_index;
+	size_t segment_sent;
+	char *parts;      /* The multipart headers, which the segments point to */
+	size_t file_sent; /* How much of the file's contents have been sent */
+
+	/* 
+	 * What to write to the log once the response is finished, and if it
+	 * logs how much of it's |log_total| bytes of content were sent.
+	 */
+	const char *log_status;
+	int log_progress;
+	size_t log_total;
+};
+
+
+/*
+ * The state of a single http connection: The incremental request lexer, the
+ * parsed request, and the progress of the responses being sent back.
+ * This is all that is needed to resume handling a request part way through,
+ * so an event loop can keep one of these per connection rather than a whole
+ * thread or process.
+ * When a client pipelines requests, every complete request already in the
+ * buffer is read and responded to before sending anything, so that the
+ * responses go out together in as few writes as possible.
+ */
+struct http_conn {
+	int fd;
+	char addr[16];
+	uint32_t ip; /* The address in binary, network byte order */
+	uint64_t accepted; /* When, see server_stats_now */
+
+	/* 
+	 * Whether the connection stays open after this response, and how many
+	 * requests it has made before this one.
+	 */
+	int keep_alive;
+	int request_count;
+
+	/*
+	 * Set if something else reads the socket for us, like an io_uring, see
+	 * http_conn_read_space. Then http_conn_recv never reads it itself.
+	 */
+	int external_reads;
+
+	/* The growable buffer that the request is read into, and lexer state */
+	char *buffer;
+	size_t buffer_capacity;
+	size_t buffer_size;
+	size_t buffer_index;
+	size_t line_start_index;
+	int lex_state;
+	int line_count;
+
+	/*
+	 * Where this request starts in the buffer, and where the next starts,
+	 * and how long the phases of handling it have taken so far.
+	 */
+	size_t request_start;
+	size_t request_end;
+	struct http_timing timing;
+
+	/* 
+	 * The parsed request. While it's being lexed, it's kept as offsets from
+	 * request_start, so that the buffer can be grown or compacted under it
+	 * without patching anything. Once it's all here the method is filled in
+	 * pointing into the buffer, and the headers are looked up by label with
+	 * http_conn_header.
+	 */
+	struct http_method method;
+	struct http_method_offsets method_offsets;
+	struct http_header_offsets headers[HTTP_HEADER_MAX];
+	int header_count;
+
+	/* 
+	 * The request body, which is passed to |body_consumer| a piece at a
+	 * time as it comes in, see http_conn_start_body. It's either
+	 * |content_length| bytes, or chunked. |content_read| is how much of it
+	 * has been passed on so far. Only a consumer that has to have all of
+	 * the body at once keeps it, in |request_content|.
+	 */
+	int (*body_consumer)(struct http_conn *conn, char *data, size_t length);
+	int chunked;
+	struct http_chunked chunked_state;
+	size_t content_length;
+	size_t content_read;
+	char *request_content;
+
+	/* 
+	 * The responses waiting to be sent. Only the last one may need to send
+	 * the contents of a file, the rest are all in memory. The first is kept
+	 * here, and |batch| has room for the rest once requests are pipelined,
+	 * see http_conn_batching.
+	 */
+	struct http_response response;
+	struct http_response *batch; /* HTTP_BATCH_MAX - 1 of them, or NULL */
+	int response_count;
+
+	/* 
+	 * The file is sent with sendfile, unless it can't be, in which case
+	 * it's read in and sent a chunk at a time.
+	 */
+	int no_sendfile;
+	char chunk[1024];
+	size_t chunk_length;
+	size_t chunk_sent;
+};
+
+
+/*
+ * A blocking keep-alive connection that may be given up by it's worker
+ * while it's idle between requests, to be picked up again (maybe by
+ * another worker) once the next one arrives: |fd| becomes readable when
+ * the worker may be wanted elsewhere, and then |claim| (if there is one)
+ * is called with |arg|, returning 1 if it is, or 0 to keep waiting.
+ * |requests| is how many requests the connection has served, which it
+ * carries across being given up.
+ */
+struct http_idle {
+	int fd;
+	int (*claim)(void *arg);
+	void *arg;
+	int requests;
+};
+
+
+/*
+ * Handle a request on a given connection, as a file descriptor, using a given
  * server_filesystem to serve from.
- * Also takes the address that the connection came from
+ * Also takes the address that the connection came from, and when it was
+ * accepted (see server_stats_now). With |idle|, the connection is given up
+ * while it's idle between requests, if the worker is wanted elsewhere.
+ * Returns 0 -> The connection is done with, close it
+ *         1 -> It was given up idle, call again once it's readable
+ */
+int handle_http_request(struct server_filesystem *fs, int connection_fd,
+	char *addr, uint64_t accepted, struct http_idle *idle);
+
+
+/*
+ * Initialize the state for a newly accepted connection.
+ */
+void http_conn_init(struct http_conn *conn, int connection_fd,
+	const char *addr);
+
+
+/*
+ * Read as much of the request as is available on the connection, and lex
+ * it. Works on both blocking and non-blocking sockets.
+ * Returns:
+ *   HTTP_CONN_DONE  -> The full request has been read, and any content
+ *                      passed to it's consumer
+ *   HTTP_CONN_AGAIN -> The socket has no more data yet, call again later.
+ *                      Also returned without reading if the next request
+ *                      isn't all in the buffer yet and there are responses
+ *                      waiting, which should be sent first
+ *   HTTP_CONN_ERROR -> The request was malformed or the connection failed
+ *   HTTP_CONN_CLOSED -> The client closed the connection (or it failed)
+ *                       before sending any of a new request, there is
+ *                       nothing to respond to
+ */
+int http_conn_recv(struct http_conn *conn);
+
+
+/*
+ * For a connection with |external_reads|: Make room for more of the request
+ * in the buffer, for when http_conn_recv returns HTTP_CONN_AGAIN with no
+ * responses waiting. The bytes read into it are added with
+ * http_conn_read_done, and then lexed by calling http_conn_recv again.
+ * Returns: How many bytes may be read into |*space|, or 0 if there wasn't
+ *          the memory for more, failing the connection.
+ */
+size_t http_conn_read_space(struct http_conn *conn, char **space);
+
+
+/*
+ * Add what was read into http_conn_read_space's space: |received| bytes, or
+ * 0 if the connection was closed, or -1 if reading it failed.
+ * Returns:
+ *   HTTP_CONN_DONE  -> The bytes were added
+ *   HTTP_CONN_ERROR / HTTP_CONN_CLOSED -> As from http_conn_recv
+ */
+int http_conn_read_done(struct http_conn *conn, ssize_t received);
+
+
+/*
+ * Decide what response a fully read request needs, and add it to the
+ * responses to be sent with http_conn_send.
+ */
+void http_conn_dispatch(struct server_filesystem *fs, struct http_conn *conn);
+
+
+/*
+ * Find the header of the request with a given label, see find_header.
+ * Returns: |header| filled in with it, or NULL if the request has none.
+ */
+struct http_header *http_conn_header(struct http_conn *conn,
+	const char *label, struct http_header *header);
+
+
+/*
+ * Add a 400 Bad Request response to be sent with http_conn_send, for a
+ * request that http_conn_recv failed on, or a 431 Request Header Fields Too
+ * Large if it failed because it was over HTTP_REQUEST_MAX or
+ * HTTP_HEADER_MAX.
+ */
+void http_conn_bad_request(struct http_conn *conn);
+
+
+/*
+ * Send as much of the waiting responses as the socket will take, gathering
+ * the in-memory ones into a single write.
+ * Returns:
+ *   HTTP_CONN_DONE  -> All of the responses have been sent
+ *   HTTP_CONN_AGAIN -> The socket is full (or timed out), call again later
+ *   HTTP_CONN_ERROR -> The connection failed
+ */
+int http_conn_send(struct http_conn *conn);
+
+
+/*
+ * Gather what's left to send of the waiting responses' headers and
+ * in-memory bodies into |iov|, which has room for HTTP_GATHER_MAX, for
+ * sending some other way than http_conn_send. Give back how much of it was
+ * sent with http_conn_sent. The rest of the responses are still sent with
+ * http_conn_send.
+ * Returns: How many of |iov| were filled in, 0 if it's all been sent.
+ */
+int http_conn_gather(struct http_conn *conn, struct iovec *iov);
+
+
+/*
+ * Credit |sent| bytes of what http_conn_gather gathered as sent.
+ */
+void http_conn_sent(struct http_conn *conn, size_t sent);
+
+
+/*
+ * Once http_conn_gather has nothing left, get what's left to send of the
+ * segment the last response is on, for sending it some other way than
+ * http_conn_send: Either bytes in memory at |*data|, or if that's NULL,
+ * the file's contents, from |*offset| in |*fd|. Give back how much of it
+ * was sent with http_conn_segment_sent.
+ * Returns: How many bytes are left of it, 0 if all the segments are sent.
+ */
+size_t http_conn_segment(struct http_conn *conn, const char **data,
+	int *fd, off_t *offset);
+
+
+/*
+ * Credit |sent| bytes of the segment from http_conn_segment as sent.
+ */
+void http_conn_segment_sent(struct http_conn *conn, size_t sent);
+
+
+/*
+ * Log how each of the responses went, and release the files they were sent
+ * from.
+ */
+void http_conn_finish(struct server_filesystem *fs, struct http_conn *conn);
+
+
+/*
+ * Get ready to read the next request on a persistent connection, once a
+ * response to the current one has been added. The request buffer is kept,
+ * along with any bytes of the next request already read into it.
+ * Returns:
+ *   0 -> The connection should be closed after the waiting responses
+ *   1 -> The connection is ready to http_conn_recv the next request
+ */
+int http_conn_next(struct http_conn *conn);
+
+
+/*
+ * Check whether the next request may be read and responded to before the
+ * waiting responses are sent, because they are all small and in memory,
+ * making room for the batch the first time.
+ * Returns:
+ *   0 -> Send the waiting responses now
+ *   1 -> Read on, any more requests already here can join the batch
+ */
+int http_conn_batching(struct http_conn *conn);
+
+
+/*
+ * Free the buffers and structures allocated while handling the connection.
+ * Does not close the connection's file descriptor.
  */
-void handle_http_request(struct server_filesystem *fs, int connection_fd,
-	char *addr);
+void http_conn_destroy(struct http_conn *conn);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,423 @@
+#include "server_log.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+ * Number of rings, so how many processes can log through the flusher at
+ * once. The rest write their records directly.
+ */
+#define LOG_RINGS 32
+
+/* Mask of a ring position to it's slot */
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+
+/* How much the flusher writes at once, and when it writes */
+#define LOG_BATCH_SIZE      (64*1024) /* 64 KB */
+#define LOG_FLUSH_BYTES     (32*1024) /* Once this much has built up */
+#define LOG_FLUSH_INTERVAL  100       /* ms, or the oldest is this old */
+
+/* How long the flusher sleeps for when there is nothing to flush */
+#define LOG_IDLE_SLEEP 5 /* ms */
+
+/* How often the flusher checks whether the rings' owners are still alive */
+#define LOG_REAP_INTERVAL 100 /* ms */
+
+
+/*
+ * This process's ring, claimed the first time it logs. A forked child
+ * starts out without one.
+ */
+static struct log_ring *log_own_ring;
+
+
+/* Private function forwards declarations */
+unsigned int log_slot_sequence(struct log_slot *slot, unsigned int pos);
+void log_slot_publish(struct log_slot *slot, unsigned int pos,
+	unsigned int sequence);
+int log_push(struct log_ring *ring, const void *record, size_t length);
+size_t log_take(struct log_ring *ring, char *buffer);
+struct log_ring *log_claim(struct server_log *log);
+void log_reap(struct server_log *log);
+void log_after_fork();
+long log_now_ms();
+void log_write_all(int fd, const char *data, size_t length);
+void *log_flusher_main(void *arg);
+
+
+/*
+ * Get the sequence number of the slot for ring position |pos|.
+ */
+unsigned int log_slot_sequence(struct log_slot *slot, unsigned int pos) {
+	return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) +
+		(pos & LOG_RING_MASK);
+}
+
+
+/*
+ * Set the sequence number of the slot for ring position |pos|, publishing
+ * what was written to it before.
+ */
+void log_slot_publish(struct log_slot *slot, unsigned int pos,
+	unsigned int sequence)
+{
+	__atomic_store_n(&slot->sequence, sequence - (pos & LOG_RING_MASK),
+		__ATOMIC_RELEASE);
+}
+
+
+/*
+ * Push a record into a free slot of the ring, the producer side of the
+ * algorithm in work_queue.c.
+ * Returns 1 -> The record was pushed
+ *         0 -> The ring is full
+ */
+int log_push(struct log_ring *ring, const void *record, size_t length) {
+	struct log_slot *slot;
+	unsigned int pos;
+	unsigned int seq;
+	int diff;
+
+	pos = __atomic_load_n(&ring->push_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &ring->slots[pos & LOG_RING_MASK];
+		seq = log_slot_sequence(slot, pos);
+		diff = (int)seq - (int)pos;
+		if (diff == 0) {
+			/* The slot is free, try to claim this position */
+			if (__atomic_compare_exchange_n(&ring->push_pos, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		} else if (diff < 0) {
+			/* The flusher hasn't got to this slot yet, we're full */
+			return 0;
+		} else {
+			/* Another producer got here first, catch up */
+			pos = __atomic_load_n(&ring->push_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* Fill the slot and publish it to the flusher */
+	memcpy(slot->data, record, length);
+	slot->length = length;
+	log_slot_publish(slot, pos, pos + 1);
+	return 1;
+}
+
+
+/*
+ * Take the next record out of the ring into |buffer|, which must have room
+ * for LOG_RECORD_MAX bytes. Only the flusher takes records, so unlike
+ * work_queue_pop there is no race to claim the position.
+ * Returns: The length of the record, or 0 if there are none ready.
+ */
+size_t log_take(struct log_ring *ring, char *buffer) {
+	struct log_slot *slot;
+	unsigned int pos;
+	size_t length;
+
+	pos = ring->pop_pos;
+	slot = &ring->slots[pos & LOG_RING_MASK];
+	if (log_slot_sequence(slot, pos) != pos + 1)
+		return 0;
+
+	/* Copy it out, and free the slot up for the next lap's producer */
+	length = slot->length;
+	memcpy(buffer, slot->data, length);
+	log_slot_publish(slot, pos, pos + LOG_RING_SLOTS);
+	__atomic_store_n(&ring->pop_pos, pos + 1, __ATOMIC_RELAXED);
+	return length;
+}
+
+
+/*
+ * Claim a free ring for this process, the first time it logs. If another
+ * of it's threads beats us to it, give ours back and use theirs, nothing
+ * was pushed to ours yet.
+ * Returns: The process's ring, or NULL if they are all taken.
+ */
+struct log_ring *log_claim(struct server_log *log) {
+	struct log_ring *ring;
+	struct log_ring *own;
+	pid_t owner;
+	unsigned int i;
+
+	for (i = 0; i < LOG_RINGS; ++i) {
+		ring = &log->rings[i];
+		owner = 0;
+		if (__atomic_compare_exchange_n(&ring->owner, &owner, getpid(), 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			own = NULL;
+			if (__atomic_compare_exchange_n(&log_own_ring, &own, ring, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				return ring;
+			}
+			__atomic_store_n(&ring->owner, 0, __ATOMIC_RELEASE);
+			return own;
+		}
+	}
+
+	/* None were free, unless another thread got the last one */
+	return __atomic_load_n(&log_own_ring, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Free the rings of processes that have died, so other processes can claim
+ * them. Any slots they claimed but never published are skipped, those
+ * records were lost with them. Only the flusher does this, once it's taken
+ * all it can from the ring.
+ * Note: If the pid has been reused, the ring is held until that process
+ * dies as well.
+ */
+void log_reap(struct server_log *log) {
+	struct log_ring *ring;
+	struct log_slot *slot;
+	unsigned int pos;
+	unsigned int i;
+	pid_t owner;
+
+	for (i = 0; i < LOG_RINGS; ++i) {
+		ring = &log->rings[i];
+		owner = __atomic_load_n(&ring->owner, __ATOMIC_ACQUIRE);
+		if (owner == 0 || owner == log->owner)
+			continue;
+		if (kill(owner, 0) == 0 || errno != ESRCH)
+			continue;
+
+		/* Skip what it never published, up to what the flusher hasn't taken */
+		pos = ring->pop_pos;
+		while (pos != __atomic_load_n(&ring->push_pos, __ATOMIC_ACQUIRE)) {
+			slot = &ring->slots[pos & LOG_RING_MASK];
+			if (log_slot_sequence(slot, pos) == pos + 1)
+				break;
+			log_slot_publish(slot, pos, pos + LOG_RING_SLOTS);
+			++pos;
+		}
+		__atomic_store_n(&ring->pop_pos, pos, __ATOMIC_RELAXED);
+
+		/* Once it's empty, it's free for the next process to claim */
+		if (pos == ring->push_pos)
+			__atomic_store_n(&ring->owner, 0, __ATOMIC_RELEASE);
+	}
+}
+
+
+/*
+ * Forget the parent's ring in a forked child, it claims it's own.
+ */
+void log_after_fork() {
+	log_own_ring = NULL;
+}
+
+
+/*
+ * Get a monotonic time in milliseconds, for the flush interval.
+ */
+long log_now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * Write all of some data to the log file, giving up on the rest of it if
+ * the write fails.
+ */
+void log_write_all(int fd, const char *data, size_t length) {
+	ssize_t written;
+
+	while (length > 0) {
+		written = write(fd, data, length);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return;
+		data += written;
+		length -= written;
+	}
+}
+
+
+/*
+ * Main function of the flusher thread: Gather records from the ring into a
+ * batch, and write the batch out once it is big enough or old enough.
+ * Drains the ring before exiting once it is told to stop.
+ */
+void *log_flusher_main(void *arg) {
+	char batch[LOG_BATCH_SIZE];
+	struct server_log *log;
+	struct timespec idle;
+	size_t batch_length;
+	size_t length;
+	long batch_started;
+	long reaped;
+	unsigned int i;
+	int stopping;
+
+	log = (struct server_log*)arg;
+	idle.tv_sec = 0;
+	idle.tv_nsec = LOG_IDLE_SLEEP * 1000000;
+	batch_length = 0;
+	batch_started = 0;
+	reaped = log_now_ms();
+	for (;;) {
+		int taken;
+
+		/* Check this before taking, so nothing added before stop is missed */
+		stopping = __atomic_load_n(&log->stop, __ATOMIC_ACQUIRE);
+
+		/* Take as many records as there are from each ring, and room for */
+		taken = 0;
+		for (i = 0; i < LOG_RINGS; ++i) {
+			while (batch_length + LOG_RECORD_MAX <= sizeof(batch) &&
+				(length = log_take(&log->rings[i], batch + batch_length)) > 0)
+			{
+				if (batch_length == 0)
+					batch_started = log_now_ms();
+				batch_length += length;
+				taken = 1;
+			}
+		}
+
+		/* Free up the rings of processes that have gone */
+		if (log_now_ms() - reaped >= LOG_REAP_INTERVAL) {
+			log_reap(log);
+			reaped = log_now_ms();
+		}
+
+		/* Write the batch out when it's time to */
+		if (batch_length >= LOG_FLUSH_BYTES || (batch_length > 0 &&
+			(stopping || log_now_ms() - batch_started >= LOG_FLUSH_INTERVAL)))
+		{
+			log_write_all(log->fd, batch, batch_length);
+			batch_length = 0;
+		}
+
+		/* Wait for more if there aren't any, or stop once drained */
+		if (!taken) {
+			if (stopping)
+				break;
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+
+int server_log_create(struct server_log *log, int fd, int full_policy) {
+	sigset_t block_set;
+	sigset_t old_set;
+	int status;
+
+	memset(log, 0x0, sizeof(struct server_log));
+	log->fd = fd;
+	log->full_policy = full_policy;
+	log->owner = getpid();
+
+	/*
+	 * Map the rings as shared memory, so that they are still shared with
+	 * any processes forked off after this. They start out zeroed, which is
+	 * unowned with every slot ready to be written at it's own position.
+	 * Only the pages of rings that get used are ever committed.
+	 */
+	log->rings_size = LOG_RINGS * sizeof(struct log_ring);
+	log->rings = mmap(NULL, log->rings_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (log->rings == MAP_FAILED)
+		return LOG_ERROR;
+	log_own_ring = NULL;
+	pthread_atfork(NULL, NULL, log_after_fork);
+
+	/*
+	 * Start the flusher, it must not handle any of the server's signals, the
+	 * main thread may siglongjmp out of it's handlers.
+	 */
+	sigfillset(&block_set);
+	pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+	status = pthread_create(&log->flusher, NULL, log_flusher_main,
+		(void*)log);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (status != 0) {
+		munmap(log->rings, log->rings_size);
+		return LOG_ERROR;
+	}
+
+	return LOG_OKAY;
+}
+
+
+int server_log_append(struct server_log *log, const void *record,
+	size_t length)
+{
+	struct log_ring *ring;
+
+	if (length > LOG_RECORD_MAX)
+		return LOG_TOOBIG;
+
+	/* Append to this process's own ring, claiming one the first time */
+	ring = __atomic_load_n(&log_own_ring, __ATOMIC_ACQUIRE);
+	if (!ring && !(ring = log_claim(log)))
+		return LOG_NORING;
+
+	while (!log_push(ring, record, length)) {
+		if (log->full_policy == LOG_FULL_DROP) {
+			__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return LOG_DROPPED;
+		}
+
+		/* Let the flusher catch up */
+		sched_yield();
+	}
+
+	return LOG_OKAY;
+}
+
+
+unsigned long server_log_dropped(struct server_log *log) {
+	unsigned long dropped;
+	unsigned int i;
+
+	/* Counted by each ring, over every process that's had it */
+	dropped = 0;
+	for (i = 0; i < LOG_RINGS; ++i)
+		dropped += __atomic_load_n(&log->rings[i].dropped, __ATOMIC_RELAXED);
+	return dropped;
+}
+
+
+unsigned int server_log_backlog(struct server_log *log) {
+	unsigned int backlog;
+	unsigned int i;
+
+	backlog = 0;
+	for (i = 0; i < LOG_RINGS; ++i) {
+		backlog += __atomic_load_n(&log->rings[i].push_pos, __ATOMIC_RELAXED) -
+			__atomic_load_n(&log->rings[i].pop_pos, __ATOMIC_RELAXED);
+	}
+	return backlog;
+}
+
+
+void server_log_destroy(struct server_log *log) {
+	/* Only the process that started the flusher can stop it */
+	if (getpid() != log->owner)
+		return;
+
+	/* Stop the flusher, writing out what's left */
+	__atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(log->flusher, NULL);
+	munmap(log->rings, log->rings_size);
+}
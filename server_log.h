@@ -0,0 +1,118 @@
+#ifndef SERVER_LOG_H_
+#define SERVER_LOG_H_
+
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/* Status codes returned by the server_log functions */
+#define LOG_OKAY     0
+#define LOG_ERROR   -1
+#define LOG_DROPPED -2 /* The ring was full, the record was thrown away */
+#define LOG_TOOBIG  -3 /* The record doesn't fit in a slot */
+#define LOG_NORING  -4 /* Every ring is taken by another process */
+
+/* What to do with a record when the ring is full */
+#define LOG_FULL_BLOCK 0 /* Wait for the flusher to make room for it */
+#define LOG_FULL_DROP  1 /* Throw it away, and count that we did */
+
+/* The biggest record that fits in a slot of the ring */
+#define LOG_RECORD_MAX 504
+
+/* Number of slots in each process's ring, must be a power of two */
+#define LOG_RING_SLOTS 1024
+
+
+/*
+ * A slot in the ring holding one log record. As in a work_queue, the
+ * sequence number says whether the slot is ready to be written or flushed
+ * for a given ring position. It's kept less the slot's index, so that a
+ * ring starts out ready without having to write to (and so commit) every
+ * page of it.
+ */
+struct log_slot {
+	unsigned int sequence;
+	unsigned int length;
+	char data[LOG_RECORD_MAX];
+};
+
+
+/*
+ * A bounded, lock-free ring of log records, with the threads of the one
+ * process that owns it as producers, and a single consumer (the flusher).
+ * The rings live in shared memory, so that forked processes can each claim
+ * one to append to. A process that dies part way through appending only
+ * holds up it's own ring, which the flusher frees once it notices.
+ */
+struct log_ring {
+	pid_t owner;
+	unsigned long dropped;
+	char pad0[64];
+	unsigned int push_pos;
+	char pad1[64];
+	unsigned int pop_pos;
+	char pad2[64];
+	struct log_slot slots[LOG_RING_SLOTS];
+};
+
+
+/*
+ * An asynchronous log: Request threads append records to their process's
+ * ring without taking any locks, and a flusher thread in the process that
+ * created it writes them out to the log file in large batches, once
+ * enough have built up or they have waited long enough.
+ */
+struct server_log {
+	int fd;
+	int full_policy;
+	struct log_ring *rings;
+	size_t rings_size;
+	pid_t owner;
+	int stop;
+	pthread_t flusher;
+};
+
+
+/*
+ * Initialize a server_log writing to the file |fd|, with what to do with
+ * records when the ring is full as |full_policy|, and start it's flusher
+ * thread. Must be called before forking any processes that will log, and
+ * only once, a process only has the one ring.
+ * Returns: LOG_OKAY on success, or LOG_ERROR on failure.
+ */
+int server_log_create(struct server_log *log, int fd, int full_policy);
+
+
+/*
+ * Append a record to the log, it will be written out exactly as given.
+ * Returns: LOG_OKAY when the record was added to the ring
+ *          LOG_DROPPED if it was full, with the LOG_FULL_DROP policy
+ *          LOG_TOOBIG if the record is longer than LOG_RECORD_MAX
+ *          LOG_NORING if this process couldn't get a ring of it's own
+ */
+int server_log_append(struct server_log *log, const void *record,
+	size_t length);
+
+
+/*
+ * Get how many records have been dropped because the ring was full.
+ */
+unsigned long server_log_dropped(struct server_log *log);
+
+
+/*
+ * Get how many records are in the rings waiting to be written out.
+ */
+unsigned int server_log_backlog(struct server_log *log);
+
+
+/*
+ * Destroy a server_log, writing out any records still in the rings. Only
+ * the process that created it stops the flusher. Does not close the file.
+ */
+void server_log_destroy(struct server_log *log);
+
+
+#endif
@@ -0,0 +1,282 @@
+#include "server_negcache.h"
+#include "server_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+/*
+ * The changes to a watched directory that could make a missing path exist.
+ * Any of them empties the cache.
+ */
+#define NEG_WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_ATTRIB | \
+	IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* Private function forward declarations */
+int negcache_watch(struct neg_cache *cache, const char *path,
+	size_t root_len, int *added);
+void negcache_handle_event(struct neg_cache *cache,
+	struct inotify_event *event);
+void *negcache_watch_main(void *arg);
+
+
+/*
+ * Make sure every directory from the root down along a path is being
+ * watched for changes, as far as they exist, the lock must be held.
+ * |added| is set if any of them weren't already.
+ * Returns 0 -> One of them can't be watched
+ *         1 -> Okay
+ */
+int negcache_watch(struct neg_cache *cache, const char *path,
+	size_t root_len, int *added)
+{
+	char dir[NEGCACHE_PATH_MAX];
+	size_t length;
+	int wd;
+	int i;
+
+	*added = 0;
+	length = root_len;
+	for (;;) {
+		/* Already watched? */
+		for (i = 0; i < cache->watch_count; ++i) {
+			if (strlen(cache->watch_dirs[i]) == length &&
+				!strncmp(cache->watch_dirs[i], path, length))
+			{
+				break;
+			}
+		}
+
+		/* Start watching it */
+		if (i == cache->watch_count) {
+			if (cache->watch_count == NEGCACHE_WATCH_MAX)
+				return 0;
+			memcpy(dir, path, length);
+			dir[length] = '\0';
+			wd = inotify_add_watch(cache->inotify_fd, length ? dir : "/",
+				NEG_WATCH_MASK);
+			if (wd < 0) {
+				/*
+				 * It doesn't exist (or isn't a directory), so what's under
+				 * it can only come to exist by it being made in the one
+				 * above, which is watched.
+				 */
+				return (errno == ENOENT || errno == ENOTDIR) && length >
+					root_len;
+			}
+			cache->watches[cache->watch_count] = wd;
+			cache->watch_dirs[cache->watch_count] = malloc(length + 1);
+			memcpy(cache->watch_dirs[cache->watch_count], dir, length + 1);
+			++cache->watch_count;
+			*added = 1;
+		}
+
+		/* On to the next directory down, if the path goes any further */
+		while (path[length] == '/')
+			++length;
+		while (path[length] && path[length] != '/')
+			++length;
+		if (!path[length])
+			return 1;
+	}
+}
+
+
+/*
+ * Empty the cache for an inotify event, the lock must be held
+ */
+void negcache_handle_event(struct neg_cache *cache,
+	struct inotify_event *event)
+{
+	int i;
+
+	/* Anything missing may exist now */
+	++cache->generation;
+	if (cache->entry_count > 0) {
+		memset(cache->entries, 0x0,
+			(cache->entry_mask + 1) * sizeof(struct neg_entry));
+		cache->entry_count = 0;
+	}
+
+	/* Forget the watch if it's gone */
+	if (event->mask & IN_IGNORED) {
+		for (i = 0; i < cache->watch_count; ++i) {
+			if (cache->watches[i] == event->wd) {
+				free(cache->watch_dirs[i]);
+				--cache->watch_count;
+				cache->watches[i] = cache->watches[cache->watch_count];
+				cache->watch_dirs[i] = cache->watch_dirs[cache->watch_count];
+				break;
+			}
+		}
+	}
+}
+
+
+/*
+ * pthread Entry point for the thread reading inotify events
+ */
+void *negcache_watch_main(void *arg) {
+	struct neg_cache *cache;
+	char buffer[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	cache = (struct neg_cache*)arg;
+	for (;;) {
+		ssize_t len;
+		char *ptr;
+
+		/* Wait for events */
+		len = read(cache->inotify_fd, buffer, sizeof(buffer));
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* Handle them all */
+		pthread_mutex_lock(&cache->lock);
+		for (ptr = buffer; ptr < buffer + len; ) {
+			struct inotify_event *event = (struct inotify_event*)ptr;
+			negcache_handle_event(cache, event);
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+		pthread_mutex_unlock(&cache->lock);
+	}
+
+	return NULL;
+}
+
+
+int server_negcache_create(struct neg_cache *cache, unsigned int max_entries)
+{
+	sigset_t block_set;
+	sigset_t old_set;
+	int status;
+
+	memset(cache, 0x0, sizeof(struct neg_cache));
+	cache->entry_mask = max_entries - 1;
+	cache->entries = calloc(max_entries, sizeof(struct neg_entry));
+	if (!cache->entries)
+		return NEGCACHE_ERROR;
+
+	/* Set up inotify, and the thread to read it */
+	if ((cache->inotify_fd = inotify_init1(IN_CLOEXEC)) < 0)
+		goto error;
+	if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+		close(cache->inotify_fd);
+		goto error;
+	}
+
+	/*
+	 * The thread must not handle any of the server's signals, as with the
+	 * content cache's.
+	 */
+	sigfillset(&block_set);
+	pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+	status = pthread_create(&cache->watch_thread, NULL, negcache_watch_main,
+		(void*)cache);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (status != 0) {
+		pthread_mutex_destroy(&cache->lock);
+		close(cache->inotify_fd);
+		goto error;
+	}
+
+	return NEGCACHE_OKAY;
+
+error:
+	free(cache->entries);
+	return NEGCACHE_ERROR;
+}
+
+
+int server_negcache_get(struct neg_cache *cache, const char *path,
+	unsigned int *generation)
+{
+	struct neg_entry *entry;
+	unsigned int hash;
+	int found;
+
+	hash = server_cache_hash(path);
+	entry = &cache->entries[hash & cache->entry_mask];
+	pthread_mutex_lock(&cache->lock);
+	found = (entry->hash == hash && !strcmp(entry->path, path));
+	if (found)
+		++cache->hits;
+	else
+		++cache->misses;
+	*generation = cache->generation;
+	pthread_mutex_unlock(&cache->lock);
+	return found;
+}
+
+
+void server_negcache_put(struct neg_cache *cache, const char *path,
+	size_t root_len, unsigned int generation)
+{
+	struct neg_entry *entry;
+	unsigned int hash;
+	size_t length;
+	int added;
+
+	length = strlen(path);
+	if (length >= NEGCACHE_PATH_MAX || length < root_len)
+		return;
+
+	hash = server_cache_hash(path);
+	entry = &cache->entries[hash & cache->entry_mask];
+	pthread_mutex_lock(&cache->lock);
+	if (!negcache_watch(cache, path, root_len, &added) ||
+		generation != cache->generation)
+	{
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	/*
+	 * Anything made in a directory before it was watched would have been
+	 * missed, so check that it's still missing now that it is.
+	 */
+	if (added && access(path, F_OK) == 0) {
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	/* Take the slot, from whichever path had it */
+	if (!entry->path[0])
+		++cache->entry_count;
+	entry->hash = hash;
+	memcpy(entry->path, path, length + 1);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+void server_negcache_get_stats(struct neg_cache *cache, unsigned long *hits,
+	unsigned long *misses, int *entries)
+{
+	pthread_mutex_lock(&cache->lock);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	*entries = cache->entry_count;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+void server_negcache_destroy(struct neg_cache *cache) {
+	int i;
+
+	/* Stop the inotify thread */
+	pthread_cancel(cache->watch_thread);
+	pthread_join(cache->watch_thread, NULL);
+	close(cache->inotify_fd);
+
+	/* Free everything */
+	for (i = 0; i < cache->watch_count; ++i)
+		free(cache->watch_dirs[i]);
+	free(cache->entries);
+	pthread_mutex_destroy(&cache->lock);
+}
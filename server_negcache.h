@@ -0,0 +1,106 @@
+#ifndef SERVER_NEGCACHE_H_
+#define SERVER_NEGCACHE_H_
+
+
+#include <pthread.h>
+#include <stddef.h>
+
+
+/* Status codes returned by server_negcache_create */
+#define NEGCACHE_OKAY   0
+#define NEGCACHE_ERROR -1
+
+/* The longest path that is remembered, longer ones are just looked up */
+#define NEGCACHE_PATH_MAX 240
+
+/* How many directories may be watched, paths under any more aren't cached */
+#define NEGCACHE_WATCH_MAX 1024
+
+
+/*
+ * A path that was found not to exist, an empty path for an unused slot.
+ */
+struct neg_entry {
+	unsigned int hash;
+	char path[NEGCACHE_PATH_MAX];
+};
+
+
+/*
+ * A bounded cache of the full paths recently found not to exist, so that
+ * requests for them can be turned away without looking them up again, safe
+ * to share between threads.
+ * It's a fixed size table with one slot for each hash, a new path pushes
+ * out whichever one shared it's slot. Every directory along a cached path
+ * that exists is watched with inotify, and when anything is created in (or
+ * moved into, or changes in) any of them, the whole cache is emptied.
+ * Files aren't created often enough for that to matter, and it means a
+ * path can't be missed however it comes to exist.
+ */
+struct neg_cache {
+	pthread_mutex_t lock;
+	struct neg_entry *entries;
+	unsigned int entry_mask;
+	int entry_count;
+
+	/*
+	 * Inotify state, the directories being watched, and the thread reading
+	 * it's events. |generation| is counted up with each change.
+	 */
+	int inotify_fd;
+	int watches[NEGCACHE_WATCH_MAX];
+	char *watch_dirs[NEGCACHE_WATCH_MAX];
+	int watch_count;
+	unsigned int generation;
+	pthread_t watch_thread;
+
+	unsigned long hits;
+	unsigned long misses;
+};
+
+
+/*
+ * Initialize a negative cache remembering at most |max_entries| paths,
+ * which must be a power of two, and start it's inotify thread.
+ * Returns: NEGCACHE_OKAY on success, or NEGCACHE_ERROR on failure.
+ */
+int server_negcache_create(struct neg_cache *cache, unsigned int max_entries);
+
+
+/*
+ * Look up whether the file with the given full path is known not to exist.
+ * Also gets the cache's |generation|, to pass to server_negcache_put if it
+ * isn't known and turns out not to exist.
+ * Returns: 1 if the path is known not to exist, 0 if it has to be looked up.
+ */
+int server_negcache_get(struct neg_cache *cache, const char *path,
+	unsigned int *generation);
+
+
+/*
+ * Remember that the file with the given full path doesn't exist, as found
+ * by a lookup started at |generation|. The path is under a root directory
+ * whose path is it's first |root_len| bytes, the directories from there
+ * down are the ones that are watched. Nothing is remembered if they can't
+ * be watched, or something changed since the lookup.
+ */
+void server_negcache_put(struct neg_cache *cache, const char *path,
+	size_t root_len, unsigned int generation);
+
+
+/*
+ * Get how many lookups have hit and missed, and how many paths are
+ * remembered.
+ */
+void server_negcache_get_stats(struct neg_cache *cache, unsigned long *hits,
+	unsigned long *misses, int *entries);
+
+
+/*
+ * Destroy a neg_cache, should only be called on a neg_cache that was
+ * successfully server_negcache_create'd.
+ */
+void server_negcache_destroy(struct neg_cache *cache);
+
+
+#endif
@@ -4,6 +4,8 @@
 #include "server_filesystem.h"
 #include "server_common.h"
 #include "server_http.h"
+#include "server_park.h"
+#include "work_queue.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -11,14 +13,26 @@
 #include <memory.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <sched.h>
+#include <limits.h>
+#include <time.h>
 
-/* Forward declarations of functions */
-void sig_child_handler(int);
-void sig_int_handler(int);
-void install_sig_handler();
-void uninstall_sig_handler();
-void *serve_single_request(void *arg);
-void serve_requests(struct server_filesystem*, struct server_state*);
+/* How many worker threads serve requests if not given with -w */
+#define POOL_DEFAULT_WORKERS 16
+
+/* The stack size of each worker thread if not given with -s */
+#define POOL_DEFAULT_STACK_KB 64
+
+/* How many accepted connections each worker can have queued up */
+#define POOL_QUEUE_CAPACITY 256
+
+/* How often the main thread looks for idle connections to close */
+#define POOL_EXPIRE_INTERVAL 1000 /* ms */
 
 /* 
  * The PID of the main process, so that children can tell to do nothing
@@ -40,16 +54,71 @@ struct sigaction server_int_sigaction;
 
 
 /*
- * The state that a request needs to operate
+ * The state that a request needs to operate, which is kept while it's
+ * connection is parked between requests.
  */
 struct request_state {
-	pthread_t thread;
 	struct server_filesystem *fs;
 	char *addr;
 	int connectionfd;
+	uint64_t accepted; /* When, see server_stats_now */
+	int parked; /* It has been, so it's already counted as open */
+	struct parked_conn park;
+	struct http_idle idle;
+};
+
+
+/*
+ * A worker thread in the pool, and the queue of requests handed to it.
+ */
+struct pool_worker {
+	pthread_t thread;
+	int index;
+	struct thread_pool *pool;
+	struct work_queue queue;
 };
 
 
+/*
+ * A fixed size pool of pre-spawned worker threads serving requests.
+ * Accepted requests are spread across the workers' queues, and |available|
+ * counts the requests queued across all of them. A worker that finds it's
+ * own queue empty steals from the others, so one slow request doesn't hold
+ * up the ones queued behind it while other workers sit idle.
+ * Workers don't sit on idle keep-alive connections while there are
+ * requests queued and no other worker is free for them (|free_workers|
+ * counts those). They park the connections in |lot|, where the main thread
+ * waits on them along with the listener, and queues them again once their
+ * next request arrives. |available| is a semaphore eventfd rather than a
+ * sem_t so that it can be polled along with a connection for this.
+ */
+struct thread_pool {
+	struct server_filesystem *fs;
+	int count;
+	struct pool_worker *workers;
+	int available;
+	int free_workers;
+	unsigned int next;
+	struct park_lot lot;
+};
+
+
+/* Forward declarations of functions */
+void sig_child_handler(int);
+void sig_int_handler(int);
+void install_sig_handler();
+void uninstall_sig_handler();
+void serve_single_request(struct thread_pool*, struct request_state*);
+void close_request(struct request_state*);
+int pool_take(struct thread_pool*);
+int pool_claim(void *arg);
+void *pool_worker_main(void *arg);
+int pool_create(struct thread_pool*, struct server_filesystem*, 
+	struct server_args*);
+void pool_submit(struct thread_pool*, struct request_state*);
+void serve_requests(struct thread_pool*, struct server_state*);
+
+
 /* Signal handler for SIGCHLD */
 void sig_child_handler(int sig) {
 	/* 
@@ -96,6 +165,9 @@ void install_sig_handler() {
 	server_int_sigaction.sa_handler = sig_int_handler;
 	server_int_sigaction.sa_flags = SA_RESTART;
 	sigaction(SIGINT, &server_int_sigaction, NULL);
+
+	/* Don't die when a client hangs up on us */
+	server_ignore_sigpipe();
 }
 
 
@@ -110,69 +182,292 @@ void uninstall_sig_handler() {
 
 
 /*
- * pthread Entry point for theads handling requests
- * Parameters: A pointer to a request_state structure
- *   Note: The thread owns this request_state structure, and must
- *         free it before exiting.
+ * Serve a single request that was handed to a worker thread
+ * Parameters: The pool, and a pointer to a request_state structure
+ *   Note: The worker owns this request_state structure, and must
+ *         free it when done, unless it parks it's connection.
  */
-void *serve_single_request(void *arg) {
-	struct request_state *state;
+void serve_single_request(struct thread_pool *pool,
+	struct request_state *state)
+{
+	/* Count how long it sat in the queue, the first time */
+	if (!state->parked)
+		server_stats_open(state->fs->stats, state->accepted);
+
+	/* Call off to handle the request, parking the connection if it idles */
+	if (handle_http_request(state->fs, state->connectionfd, state->addr,
+		state->accepted, &state->idle))
+	{
+		state->parked = 1;
+		if (server_park(&pool->lot, &state->park) == PARK_OKAY)
+			return;
+	}
 
-	/* Get the request state */
-	state = (struct request_state*)arg;
+	close_request(state);
+}
 
-	/* Call off to handle the request */
-	handle_http_request(state->fs, state->connectionfd, state->addr);
 
-	/* Shut down the connection */
+/*
+ * Shut down and close a request's connection, and free it's request_state.
+ */
+void close_request(struct request_state *state) {
 	shutdown(state->connectionfd, SHUT_RDWR);
-
-	/* Free the request_state structure */
+	close(state->connectionfd);
+	server_stats_close(state->fs->stats);
 	free(state->addr);
 	free(state);
+}
 
-	/* Done, exit */
-	pthread_exit(0);
+
+/*
+ * Take one of the requests counted in the pool's |available|, as sem_trywait
+ * would.
+ * Returns 1 -> There is a request queued for us
+ *         0 -> There were none left
+ */
+int pool_take(struct thread_pool *pool) {
+	uint64_t count;
+
+	return read(pool->available, &count, sizeof(count)) == sizeof(count);
 }
 
 
 /*
- * Main function to serve requests to the client, using a given server_state
- * serving documents from a given server_filesystem.
- * Each request is processed in a new child process, which terminates once
- * the request has been completed.
+ * The http_idle claim of a worker sitting on an idle keep-alive connection
+ * while a request is queued: It's wanted, unless there's a free worker.
+ * Parameters: A pointer to the thread_pool
+ * Returns 1 -> Park the connection, and go to the request
+ *         0 -> Keep waiting on the connection
+ */
+int pool_claim(void *arg) {
+	struct thread_pool *pool;
+
+	pool = (struct thread_pool*)arg;
+	if (__atomic_load_n(&pool->free_workers, __ATOMIC_ACQUIRE) > 0) {
+		/* Let it wake up and take it */
+		sched_yield();
+		return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * pthread Entry point for the pool's worker threads
+ * Parameters: A pointer to the pool_worker structure for the thread
+ */
+void *pool_worker_main(void *arg) {
+	struct pool_worker *self;
+	struct thread_pool *pool;
+	struct pollfd pfd;
+
+	/* Get the worker */
+	self = (struct pool_worker*)arg;
+	pool = self->pool;
+	pfd.fd = pool->available;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		void *item;
+		int i;
+
+		/* Wait for a request to be queued somewhere */
+		__atomic_add_fetch(&pool->free_workers, 1, __ATOMIC_RELEASE);
+		while (!pool_take(pool)) {
+			/* Interrupted or beaten to it, keep waiting */
+			poll(&pfd, 1, -1);
+		}
+		__atomic_sub_fetch(&pool->free_workers, 1, __ATOMIC_RELEASE);
+
+		/* 
+		 * Take it from our own queue first, otherwise steal it from the
+		 * other workers'. There is at least one request queued for each one
+		 * we take from |available|, so keep looking until we find it.
+		 */
+		for (;;) {
+			if (work_queue_pop(&self->queue, &item))
+				break;
+			for (i = 1; i < pool->count; ++i) {
+				struct pool_worker *victim;
+
+				victim = &pool->workers[(self->index + i) % pool->count];
+				if (work_queue_pop(&victim->queue, &item))
+					break;
+			}
+			if (i < pool->count)
+				break;
+			sched_yield();
+		}
+
+		/* Serve it */
+		serve_single_request(pool, (struct request_state*)item);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Create the pool of worker threads to serve requests from a given
+ * server_filesystem, sized by the -w and -s arguments.
+ * Returns: SERVER_OKAY on success, or SERVER_ERROR on failure.
+ */
+int pool_create(struct thread_pool *pool, struct server_filesystem *fs,
+	struct server_args *args)
+{
+	pthread_attr_t attr;
+	size_t stack_size;
+	sigset_t block_set;
+	sigset_t old_set;
+	int i;
+
+	/* Sizes */
+	pool->fs = fs;
+	pool->count = args->workers ? args->workers : POOL_DEFAULT_WORKERS;
+	pool->next = 0;
+	pool->free_workers = 0;
+	stack_size = 1024 * (args->stack_kb ? args->stack_kb : 
+		POOL_DEFAULT_STACK_KB);
+	if (stack_size < PTHREAD_STACK_MIN)
+		stack_size = PTHREAD_STACK_MIN;
+
+	/* Set up the workers and their queues */
+	pool->available = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool->available == -1)
+		return SERVER_ERROR;
+	pool->workers = malloc(pool->count * sizeof(struct pool_worker));
+	for (i = 0; i < pool->count; ++i) {
+		pool->workers[i].index = i;
+		pool->workers[i].pool = pool;
+		if (work_queue_create(&pool->workers[i].queue, POOL_QUEUE_CAPACITY)
+			!= WORK_QUEUE_OKAY)
+		{
+			return SERVER_ERROR;
+		}
+	}
+
+	/* Small stacks, the request handling doesn't need much */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, stack_size);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* 
+	 * Block SIGINT in the workers, so that it's always the main thread that
+	 * gets it and jumps out of the handler loop.
+	 */
+	sigemptyset(&block_set);
+	sigaddset(&block_set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+
+	/* Start them */
+	for (i = 0; i < pool->count; ++i) {
+		if (0 != pthread_create(&pool->workers[i].thread, &attr,
+			pool_worker_main, (void*)&pool->workers[i]))
+		{
+			/* Thread creation failed */
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	pthread_attr_destroy(&attr);
+
+	/* Run with however many did start, as long as it's some */
+	if (i == 0)
+		return SERVER_ERROR;
+	pool->count = i;
+	return SERVER_OKAY;
+}
+
+
+/*
+ * Hand a request off to the pool, round robin between the workers' queues.
+ * If every queue is full, wait for the workers to catch up; connections
+ * back up in the listen queue in the mean time.
  */
-void serve_requests(struct server_filesystem *fs, struct server_state *state) {
+void pool_submit(struct thread_pool *pool, struct request_state *req) {
 	for (;;) {
-		char *addr;
-		int fd;
+		int i;
+
+		for (i = 0; i < pool->count; ++i) {
+			struct pool_worker *worker;
+
+			worker = &pool->workers[pool->next++ % pool->count];
+			if (work_queue_push(&worker->queue, req)) {
+				/* Queued, wake up a worker */
+				eventfd_write(pool->available, 1);
+				return;
+			}
+		}
+
+		/* Everything is full */
+		sched_yield();
+	}
+}
+
+
+/*
+ * Main function to serve requests to the client, using a given server_state
+ * and handing them to a given thread_pool to serve.
+ * Each request is processed by one of the pool's worker threads, and the
+ * connections they park are handed back to them once they have another.
+ */
+void serve_requests(struct thread_pool *pool, struct server_state *state) {
+	struct parked_conn *parked;
+	struct request_state *req;
+	char *addr;
+	int status;
+	int fd;
+
+	/* Watch the listener along with the parked connections */
+	if (server_park_create(&pool->lot, state->socketfd) != PARK_OKAY) {
+		printf("Error watching for connections, terminating...\n");
+		return;
+	}
 
-		/* Do the listen */
-		if ((fd = server_listen(state, &addr)) > 0) {
-			struct request_state *req;
+	for (;;) {
+		status = server_park_wait(&pool->lot, POOL_EXPIRE_INTERVAL, &parked);
+		if (status == PARK_LISTENER) {
+			/* Do the listen */
+			if ((fd = server_listen(state, &addr)) <= 0) {
+				/* There was an error, exit */
+				printf("Error trying to accept a connection, "
+					"terminating...\n");
+				break;
+			}
 
 			/* Init a request structure for the request */
 			req = malloc(sizeof(struct request_state));
-			req->fs = fs;
+			req->fs = pool->fs;
 			req->addr = malloc(strlen(addr) + 1);
 			strcpy(req->addr, addr);
 			req->connectionfd = fd;
-
-			/* Start a new thread to handle it */
-			if (0 != pthread_create(&(req->thread), NULL, 
-				serve_single_request, (void*)req))
-			{
-				/* Thread creation failed, free req and stop */
-				free(req->addr);
-				free(req);
-			}
-
-			/* The thread takes ownership of req, we don't need to free it */
-		} else {
-			/* There was an error, exit */
-			printf("Error trying to accept a connection, terminating...\n");
+			req->accepted = server_stats_now();
+			req->parked = 0;
+			req->park.fd = fd;
+			req->park.data = req;
+			req->idle.fd = pool->available;
+			req->idle.claim = pool_claim;
+			req->idle.arg = pool;
+			req->idle.requests = 0;
+
+			/* Hand it to a worker, which takes ownership of req */
+			pool_submit(pool, req);
+		} else if (status == PARK_READY) {
+			/* Hand a parked connection back for it's next request */
+			req = (struct request_state*)parked->data;
+			req->accepted = server_stats_now();
+			pool_submit(pool, req);
+		} else if (status == PARK_ERROR) {
+			printf("Error watching for connections, terminating...\n");
 			break;
 		}
+
+		/* Close the connections that have sat idle too long */
+		while ((parked = server_park_expired(&pool->lot,
+			time(NULL) - HTTP_KEEPALIVE_TIMEOUT)))
+		{
+			close_request((struct request_state*)parked->data);
+		}
 	}
 }
 
@@ -183,10 +478,12 @@ int main(int argc, char *argv[]) {
 	struct server_filesystem fs;
 	int fs_status;
 	struct server_state server;
+	struct thread_pool pool;
+	int i;
 
 	/* Get the server arguments */
 	if (parse_args(&args, argc, argv) != ARGS_OKAY) {
-		print_usage("server_f");
+		print_usage("server_p");
 		return -1;
 	}
 
@@ -211,8 +508,48 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 
+	/* Write a binary log if asked (-b) */
+	if (args.log_binary)
+		server_fs_enable_binary_log(&fs);
+
+	/* Let clients cache the files under some paths for a while (-e) */
+	for (i = 0; i < args.expires_count; ++i) {
+		server_fs_add_cache_policy(&fs, args.expires_prefix[i],
+			args.expires_max_age[i]);
+	}
+
+	/* Keep live stats, served at a URL of their own, if asked (-S) */
+	if (args.stats_path && server_fs_enable_stats(&fs, args.stats_path)
+		!= FS_OKAY)
+	{
+		printf("Could not start keeping stats, serving without them.\n");
+	}
+
+	/* Log the phases of each request (-t), and the slow ones (-l) */
+	if (args.log_timing)
+		server_fs_enable_timing_log(&fs);
+	if (args.slow_ms >= 0 &&
+		server_fs_enable_slow_log(&fs, args.slow_ms) != FS_OKAY)
+	{
+		printf("Could not open the slow request log, serving without it.\n");
+	}
+
+	/* Log asynchronously, dropping lines instead of waiting if asked (-d) */
+	if (server_fs_enable_async_log(&fs, 
+		args.log_drop ? LOG_FULL_DROP : LOG_FULL_BLOCK) != FS_OKAY)
+	{
+		printf("Could not start the log flusher, logging directly.\n");
+	}
+
+	/* Cache frequently requested files in memory (-c) */
+	if (args.cache_mb > 0 && server_fs_enable_cache(&fs, 
+		(size_t)args.cache_mb * 1024 * 1024) != FS_OKAY)
+	{
+		printf("Could not start the file cache, serving without it.\n");
+	}
+
 	/* Create the server state */
-	if (server_create(&server, args.port) != SERVER_OKAY) {
+	if (server_create(&server, args.port, 0, &args.tuning) != SERVER_OKAY) {
 		/* 
 		 * Failed to create the server on the port requested, report 
 		 * and exit
@@ -228,6 +565,14 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 
+	/* Start up the worker threads */
+	if (pool_create(&pool, &fs, &args) != SERVER_OKAY) {
+		printf("Could not start the worker threads.\n");
+		server_destroy(&server);
+		server_fs_destroy(&fs);
+		return -1;
+	}
+
 	/* Listen and serve new connections */
 	if (sigsetjmp(before_exit, 1) == 0) {
 		/* 
@@ -237,7 +582,7 @@ int main(int argc, char *argv[]) {
 		install_sig_handler();
 
 		/* Go into the main handler loop */
-		serve_requests(&fs, &server);
+		serve_requests(&pool, &server);
 	} else {
 		/* User Ctrl-C requested exit (if not daemonized) */
 		printf("\nShutdown Requested, terminating...\n");
@@ -245,6 +590,8 @@ int main(int argc, char *argv[]) {
 
 	/* Close the server and fs */
 	server_destroy(&server);
+	if (server_fs_log_dropped(&fs) > 0)
+		printf("%lu log lines were dropped.\n", server_fs_log_dropped(&fs));
 	server_fs_destroy(&fs);
 
 	/* Done */
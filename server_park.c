@@ -0,0 +1,123 @@
+#include "server_park.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+/* Private function forward declarations */
+void park_unlink(struct park_lot *lot, struct parked_conn *conn);
+
+
+/*
+ * Take a connection out of the lot's list, and stop watching it. The lock
+ * must be held.
+ */
+void park_unlink(struct park_lot *lot, struct parked_conn *conn) {
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		lot->oldest = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	else
+		lot->newest = conn->prev;
+	epoll_ctl(lot->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+}
+
+
+int server_park_create(struct park_lot *lot, int listen_fd) {
+	struct epoll_event event;
+
+	memset(lot, 0x0, sizeof(struct park_lot));
+	lot->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (lot->epoll_fd == -1)
+		return PARK_ERROR;
+
+	/* The listener is the one without a parked_conn */
+	memset(&event, 0x0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(lot->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1 ||
+		pthread_mutex_init(&lot->lock, NULL) != 0)
+	{
+		close(lot->epoll_fd);
+		return PARK_ERROR;
+	}
+	return PARK_OKAY;
+}
+
+
+int server_park(struct park_lot *lot, struct parked_conn *conn) {
+	struct epoll_event event;
+	int status;
+
+	conn->since = time(NULL);
+	conn->prev = NULL;
+	conn->next = NULL;
+
+	/*
+	 * Add it to the end of the list before watching it, the waiting thread
+	 * takes it out again as soon as it's readable. It's only reported the
+	 * once, the connection goes back to a worker then.
+	 */
+	memset(&event, 0x0, sizeof(event));
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = conn;
+	pthread_mutex_lock(&lot->lock);
+	conn->prev = lot->newest;
+	if (lot->newest)
+		lot->newest->next = conn;
+	else
+		lot->oldest = conn;
+	lot->newest = conn;
+	status = epoll_ctl(lot->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+	if (status == -1)
+		park_unlink(lot, conn);
+	pthread_mutex_unlock(&lot->lock);
+
+	return (status == -1) ? PARK_ERROR : PARK_OKAY;
+}
+
+
+int server_park_wait(struct park_lot *lot, int timeout,
+	struct parked_conn **conn)
+{
+	struct epoll_event event;
+	int count;
+
+	count = epoll_wait(lot->epoll_fd, &event, 1, timeout);
+	if (count < 0)
+		return (errno == EINTR) ? PARK_TIMEOUT : PARK_ERROR;
+	if (count == 0)
+		return PARK_TIMEOUT;
+	if (!event.data.ptr)
+		return PARK_LISTENER;
+
+	/* It's request is arriving, hand it back */
+	*conn = (struct parked_conn*)event.data.ptr;
+	pthread_mutex_lock(&lot->lock);
+	park_unlink(lot, *conn);
+	pthread_mutex_unlock(&lot->lock);
+	return PARK_READY;
+}
+
+
+struct parked_conn *server_park_expired(struct park_lot *lot, time_t before) {
+	struct parked_conn *conn;
+
+	pthread_mutex_lock(&lot->lock);
+	conn = lot->oldest;
+	if (conn && conn->since <= before)
+		park_unlink(lot, conn);
+	else
+		conn = NULL;
+	pthread_mutex_unlock(&lot->lock);
+	return conn;
+}
+
+
+void server_park_destroy(struct park_lot *lot) {
+	close(lot->epoll_fd);
+	pthread_mutex_destroy(&lot->lock);
+}
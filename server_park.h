@@ -0,0 +1,87 @@
+#ifndef SERVER_PARK_H_
+#define SERVER_PARK_H_
+
+
+#include <pthread.h>
+#include <time.h>
+
+
+/* Status codes returned by the server_park functions */
+#define PARK_OKAY      0
+#define PARK_ERROR    -1
+#define PARK_LISTENER  1 /* The listening socket has a connection waiting */
+#define PARK_READY     2 /* A parked connection's next request is arriving */
+#define PARK_TIMEOUT   3 /* Neither, in the time given */
+
+
+/*
+ * An idle keep-alive connection, given up by it's worker until the next
+ * request on it starts to arrive. |data| is whatever the server keeps for
+ * the connection.
+ */
+struct parked_conn {
+	int fd;
+	time_t since;
+	void *data;
+	struct parked_conn *prev;
+	struct parked_conn *next;
+};
+
+
+/*
+ * Where blocking workers park their idle keep-alive connections, rather
+ * than each sitting on one: An epoll set watching them along with the
+ * listening socket, and a list of them, longest parked first, to time them
+ * out from. Connections may be parked from any thread, but only one may
+ * wait on the lot.
+ */
+struct park_lot {
+	int epoll_fd;
+	pthread_mutex_t lock;
+	struct parked_conn *oldest;
+	struct parked_conn *newest;
+};
+
+
+/*
+ * Initialize a park_lot, watching the listening socket |listen_fd| too.
+ * Returns: PARK_OKAY on success, or PARK_ERROR on failure.
+ */
+int server_park_create(struct park_lot *lot, int listen_fd);
+
+
+/*
+ * Park an idle connection, the lot holds on to it until it's readable or
+ * it's timed out.
+ * Returns: PARK_OKAY on success, or PARK_ERROR if it couldn't be watched,
+ *          and the caller should close it.
+ */
+int server_park(struct park_lot *lot, struct parked_conn *conn);
+
+
+/*
+ * Wait up to |timeout| ms for a new connection on the listener, or for a
+ * parked one to become readable, which is taken out of the lot into
+ * |*conn|.
+ * Returns: PARK_LISTENER, PARK_READY, PARK_TIMEOUT (also when interrupted)
+ *          or PARK_ERROR.
+ */
+int server_park_wait(struct park_lot *lot, int timeout,
+	struct parked_conn **conn);
+
+
+/*
+ * Take the longest parked connection out of the lot, if it was parked at
+ * or before |before|, for the caller to close.
+ * Returns: The connection, or NULL if there are none that old.
+ */
+struct parked_conn *server_park_expired(struct park_lot *lot, time_t before);
+
+
+/*
+ * Destroy a park_lot. Doesn't close the connections still parked in it.
+ */
+void server_park_destroy(struct park_lot *lot);
+
+
+#endif
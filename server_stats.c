@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include "server_stats.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+
+/* The statuses counted on their own, see STATS_STATUS_COUNT */
+const int stats_statuses[STATS_STATUS_COUNT] = {
+	200, 206, 304, 400, 403, 404, 405, 416, 431, 500
+};
+
+
+/* Private function forwards declarations */
+struct stats_slot *stats_slot(struct server_stats *stats);
+void stats_add(uint64_t *counter, uint64_t value);
+void stats_histogram_add(struct stats_histogram *histogram, uint64_t value);
+void stats_histogram_sum(struct stats_histogram *total,
+	struct stats_histogram *histogram);
+size_t stats_append(char *buffer, size_t len, size_t used,
+	const char *format, ...);
+size_t stats_format_histogram(char *buffer, size_t len, size_t used,
+	const char *name, struct stats_histogram *histogram);
+
+
+/*
+ * Get the slot of the CPU that we're running on. We may be moved to another
+ * CPU straight after, which only means sharing it's slot for a moment.
+ */
+struct stats_slot *stats_slot(struct server_stats *stats) {
+	int cpu;
+
+	cpu = sched_getcpu();
+	if (cpu < 0)
+		cpu = 0;
+	return &stats->slots[cpu % stats->slot_count];
+}
+
+
+/*
+ * Add to one of the counters. Other threads on the same CPU (or that were)
+ * may be adding to it too, so it still has to be atomic.
+ */
+void stats_add(uint64_t *counter, uint64_t value) {
+	__atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Count a latency of |value| microseconds in a histogram, in the first
+ * bucket that it's at most the limit of.
+ */
+void stats_histogram_add(struct stats_histogram *histogram, uint64_t value) {
+	int bucket;
+
+	bucket = 0;
+	while (bucket < STATS_BUCKETS - 1 && value > ((uint64_t)1 << bucket))
+		++bucket;
+	stats_add(&histogram->buckets[bucket], 1);
+	stats_add(&histogram->sum, value);
+}
+
+
+/*
+ * Add one slot's histogram to the totals.
+ */
+void stats_histogram_sum(struct stats_histogram *total,
+	struct stats_histogram *histogram)
+{
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; ++i) {
+		total->buckets[i] +=
+			__atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+	}
+	total->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Format onto the end of the |used| bytes of |buffer|, as snprintf, without
+ * going past |len|.
+ * Returns: How much of the buffer is used now.
+ */
+size_t stats_append(char *buffer, size_t len, size_t used,
+	const char *format, ...)
+{
+	va_list args;
+	int length;
+
+	if (used + 1 >= len)
+		return used;
+
+	va_start(args, format);
+	length = vsnprintf(buffer + used, len - used, format, args);
+	va_end(args);
+	if (length < 0)
+		return used;
+	return (used + length < len) ? used + length : len - 1;
+}
+
+
+/*
+ * Format a histogram, with the buckets adding up as they go, as the
+ * Prometheus text format has them.
+ * Returns: As stats_append
+ */
+size_t stats_format_histogram(char *buffer, size_t len, size_t used,
+	const char *name, struct stats_histogram *histogram)
+{
+	uint64_t count;
+	int i;
+
+	used = stats_append(buffer, len, used, "# TYPE %s histogram\n", name);
+	count = 0;
+	for (i = 0; i < STATS_BUCKETS - 1; ++i) {
+		count += histogram->buckets[i];
+		used = stats_append(buffer, len, used, "%s_bucket{le=\"%lu\"} %llu\n",
+			name, 1UL << i, (unsigned long long)count);
+	}
+	count += histogram->buckets[STATS_BUCKETS - 1];
+	used = stats_append(buffer, len, used, "%s_bucket{le=\"+Inf\"} %llu\n",
+		name, (unsigned long long)count);
+	used = stats_append(buffer, len, used, "%s_sum %llu\n", name,
+		(unsigned long long)histogram->sum);
+	return stats_append(buffer, len, used, "%s_count %llu\n", name,
+		(unsigned long long)count);
+}
+
+
+int server_stats_create(struct server_stats *stats, const char *path) {
+	long cpus;
+
+	memset(stats, 0x0, sizeof(struct server_stats));
+	stats->path = path;
+	stats->started = time(NULL);
+
+	/* A slot for each CPU there could be */
+	cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (cpus < 1)
+		cpus = 1;
+	stats->slot_count = (cpus < STATS_SLOT_MAX) ? cpus : STATS_SLOT_MAX;
+
+	/*
+	 * Map the slots as shared memory, so that the counts of forked
+	 * processes, which may only live for a request, aren't lost with them.
+	 */
+	stats->size = stats->slot_count * sizeof(struct stats_slot);
+	stats->slots = mmap(NULL, stats->size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats->slots == MAP_FAILED)
+		return STATS_ERROR;
+
+	return STATS_OKAY;
+}
+
+
+uint64_t server_stats_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+void server_stats_open(struct server_stats *stats, uint64_t accepted) {
+	struct stats_slot *slot;
+	uint64_t now;
+
+	if (!stats)
+		return;
+
+	slot = stats_slot(stats);
+	stats_add(&slot->connections_opened, 1);
+	now = server_stats_now();
+	stats_histogram_add(&slot->accept_latency,
+		(now > accepted) ? now - accepted : 0);
+}
+
+
+void server_stats_close(struct server_stats *stats) {
+	if (!stats)
+		return;
+
+	stats_add(&stats_slot(stats)->connections_closed, 1);
+}
+
+
+void server_stats_request(struct server_stats *stats, int status,
+	size_t bytes, uint64_t started)
+{
+	struct stats_slot *slot;
+	uint64_t now;
+	int i;
+
+	if (!stats)
+		return;
+
+	/* Which status it was, or other */
+	for (i = 0; i < STATS_STATUS_COUNT; ++i) {
+		if (stats_statuses[i] == status)
+			break;
+	}
+
+	slot = stats_slot(stats);
+	stats_add(&slot->requests[i], 1);
+	stats_add(&slot->bytes_sent, bytes);
+	now = server_stats_now();
+	stats_histogram_add(&slot->request_latency,
+		(now > started) ? now - started : 0);
+}
+
+
+void server_stats_sum(struct server_stats *stats, struct stats_slot *total) {
+	struct stats_slot *slot;
+	int i;
+	int j;
+
+	memset(total, 0x0, sizeof(struct stats_slot));
+	for (i = 0; i < stats->slot_count; ++i) {
+		slot = &stats->slots[i];
+		for (j = 0; j <= STATS_STATUS_COUNT; ++j) {
+			total->requests[j] +=
+				__atomic_load_n(&slot->requests[j], __ATOMIC_RELAXED);
+		}
+		total->bytes_sent +=
+			__atomic_load_n(&slot->bytes_sent, __ATOMIC_RELAXED);
+		total->connections_opened +=
+			__atomic_load_n(&slot->connections_opened, __ATOMIC_RELAXED);
+		total->connections_closed +=
+			__atomic_load_n(&slot->connections_closed, __ATOMIC_RELAXED);
+		stats_histogram_sum(&total->accept_latency, &slot->accept_latency);
+		stats_histogram_sum(&total->request_latency, &slot->request_latency);
+	}
+}
+
+
+size_t server_stats_format(struct server_stats *stats, char *buffer,
+	size_t len)
+{
+	struct stats_slot total;
+	uint64_t active;
+	size_t used;
+	int i;
+
+	server_stats_sum(stats, &total);
+	if (len > 0)
+		buffer[0] = '\0';
+
+	/* Requests by status */
+	used = stats_append(buffer, len, 0,
+		"# TYPE http_requests_total counter\n");
+	for (i = 0; i < STATS_STATUS_COUNT; ++i) {
+		used = stats_append(buffer, len, used,
+			"http_requests_total{status=\"%d\"} %llu\n", stats_statuses[i],
+			(unsigned long long)total.requests[i]);
+	}
+	used = stats_append(buffer, len, used,
+		"http_requests_total{status=\"other\"} %llu\n",
+		(unsigned long long)total.requests[STATS_STATUS_COUNT]);
+
+	/*
+	 * What was sent, and the connections. A connection may be counted
+	 * closed on one CPU before it's counted open on another is seen.
+	 */
+	active = (total.connections_opened > total.connections_closed) ?
+		total.connections_opened - total.connections_closed : 0;
+	used = stats_append(buffer, len, used,
+		"# TYPE http_sent_bytes_total counter\n"
+		"http_sent_bytes_total %llu\n"
+		"# TYPE http_connections_total counter\n"
+		"http_connections_total %llu\n"
+		"# TYPE http_connections_active gauge\n"
+		"http_connections_active %llu\n"
+		"# TYPE server_uptime_seconds gauge\n"
+		"server_uptime_seconds %ld\n",
+		(unsigned long long)total.bytes_sent,
+		(unsigned long long)total.connections_opened,
+		(unsigned long long)active,
+		(long)(time(NULL) - stats->started));
+
+	/* How long connections wait to be picked up, and requests take */
+	used = stats_format_histogram(buffer, len, used,
+		"http_accept_latency_us", &total.accept_latency);
+	return stats_format_histogram(buffer, len, used,
+		"http_request_latency_us", &total.request_latency);
+}
+
+
+void server_stats_destroy(struct server_stats *stats) {
+	munmap(stats->slots, stats->size);
+}
@@ -0,0 +1,130 @@
+#ifndef SERVER_STATS_H_
+#define SERVER_STATS_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/* Status codes returned by server_stats_create */
+#define STATS_OKAY   0
+#define STATS_ERROR -1
+
+/*
+ * The response statuses counted on their own, anything else is counted as
+ * "other" after them.
+ */
+#define STATS_STATUS_COUNT 10
+
+/*
+ * How many buckets the latency histograms have. Bucket i counts latencies
+ * of at most 2^i microseconds (and more than the bucket before's), the last
+ * one everything longer than the one before it, 2^23 us being about 8 s.
+ */
+#define STATS_BUCKETS 25
+
+/* The most slots there are to spread the counters over */
+#define STATS_SLOT_MAX 256
+
+/* The most that server_stats_format writes */
+#define STATS_FORMAT_MAX (8*1024) /* 8 KB */
+
+
+/*
+ * A latency histogram, in microseconds.
+ */
+struct stats_histogram {
+	uint64_t buckets[STATS_BUCKETS];
+	uint64_t sum;
+};
+
+/*
+ * A set of the counters. Each CPU updates it's own, on a cache line of it's
+ * own, so they are hardly ever contended, and the totals are only added up
+ * when they're asked for.
+ */
+struct stats_slot {
+	uint64_t requests[STATS_STATUS_COUNT + 1];
+	uint64_t bytes_sent;
+	uint64_t connections_opened;
+	uint64_t connections_closed;
+	struct stats_histogram accept_latency;
+	struct stats_histogram request_latency;
+} __attribute__((aligned(64)));
+
+/*
+ * Live counters of how the server is doing, kept in shared memory so that
+ * they are shared with any processes forked after they were created, and
+ * updated without any locks.
+ */
+struct server_stats {
+	struct stats_slot *slots;
+	int slot_count;
+	size_t size;
+	time_t started;
+	const char *path; /* The URL they're served at */
+};
+
+
+/*
+ * Initialize a set of stats, served at the URL |path|. Must be called
+ * before forking any processes that will count in them.
+ * Returns: STATS_OKAY on success, or STATS_ERROR on failure.
+ */
+int server_stats_create(struct server_stats *stats, const char *path);
+
+
+/*
+ * Get the time in microseconds, for the latencies, as they are measured.
+ * Only the differences between them mean anything.
+ */
+uint64_t server_stats_now();
+
+
+/*
+ * Count a newly opened connection, and how long it waited after being
+ * accepted at |accepted| (from server_stats_now) to be picked up.
+ * All of the server_stats_ counting functions do nothing given NULL, if
+ * there are no stats being kept.
+ */
+void server_stats_open(struct server_stats *stats, uint64_t accepted);
+
+
+/*
+ * Count a connection being closed.
+ */
+void server_stats_close(struct server_stats *stats);
+
+
+/*
+ * Count a finished response with a given |status|, that sent |bytes| bytes,
+ * for a request that started arriving at |started|.
+ */
+void server_stats_request(struct server_stats *stats, int status,
+	size_t bytes, uint64_t started);
+
+
+/*
+ * Add up all of the counters into |total|.
+ */
+void server_stats_sum(struct server_stats *stats, struct stats_slot *total);
+
+
+/*
+ * Format the totals of the counters in the Prometheus text format, one
+ * counter per line, into a |buffer| of |len| bytes.
+ * Returns: The length written, which is cut short at |len| - 1.
+ */
+size_t server_stats_format(struct server_stats *stats, char *buffer,
+	size_t len);
+
+
+/*
+ * Destroy a set of stats, should only be called on one that was
+ * successfully server_stats_create'd.
+ */
+void server_stats_destroy(struct server_stats *stats);
+
+
+#endif
@@ -0,0 +1,1092 @@
+#define _GNU_SOURCE
+#include "args.h"
+#include "server_filesystem.h"
+#include "server_common.h"
+#include "server_http.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <memory.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* How many operations may be submitted to the ring at once */
+#define URING_ENTRIES 256
+
+/*
+ * How many completions the ring has room for, each connection has at most
+ * one operation in flight (or two linked splices), so about this many
+ * connections can finish at once.
+ * Any more are held by the kernel until there's room, which makes
+ * io_uring_enter fail with EBUSY until the completions are reaped.
+ */
+#define URING_CQ_ENTRIES 16384
+
+/*
+ * How long a connection may go without making any progress before it is
+ * dropped, the same as the read / write timeouts of the blocking servers.
+ */
+#define CONNECTION_TIMEOUT 10 /* seconds */
+
+/*
+ * How big to make the pipes that files are spliced through, which is how
+ * much is sent at a time, if the system lets us.
+ */
+#define URING_PIPE_SIZE (256*1024) /* 256 KB */
+
+/* States for a connection in the event loop to be in */
+#define CONN_STATE_READING 0
+#define CONN_STATE_WRITING 1
+
+/* The operation that a connection is waiting on the ring for */
+#define CONN_OP_NONE 0
+#define CONN_OP_RECV 1 /* Reading more of the request */
+#define CONN_OP_SEND 2 /* Sending the responses' headers and bodies */
+#define CONN_OP_POLL 3 /* Waiting for room to send the rest */
+#define CONN_OP_PART   4 /* Sending a part header of a multipart body */
+#define CONN_OP_SPLICE 5 /* Splicing the file to the pipe, then the socket */
+#define CONN_OP_DRAIN  6 /* Splicing what's left in the pipe to the socket */
+
+/*
+ * The user_data of the operations that aren't a connection's, which has
+ * the connection's address.
+ */
+#define USER_DATA_ACCEPT  1 /* Accepting connections */
+#define USER_DATA_TICK    2 /* The timeout to check connections' timeouts */
+#define USER_DATA_IGNORED 3 /* Anything else, closing connections */
+
+/*
+ * Set in the user_data of the splice of a file into a connection's pipe,
+ * which is linked to the splice out of it. A connection's address is never
+ * odd, so this can't be mistaken for it, only for the values above.
+ */
+#define USER_DATA_SPLICE_IN 1
+
+/* Loctation to jump to on inturrepted */
+sigjmp_buf before_exit;
+
+/*
+ * Our interrupt handler
+ * We handle SIGINT for breaking out of the handler loop when not in daemonized
+ * mode. There are no child processes to reap.
+ */
+struct sigaction server_int_sigaction;
+
+
+/*
+ * An io_uring, the submission and completion queues shared with the
+ * kernel. Submissions are added after |sq_local_tail|, and only handed to
+ * the kernel by uring_enter.
+ */
+struct uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* The mappings, to unmap */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+
+/*
+ * A connection being served by the event loop. As with server_e's, they're
+ * kept in a list ordered by when they last made progress. A connection has
+ * at most one operation in flight on the ring at a time, and isn't freed
+ * until it's finished.
+ */
+struct uring_conn {
+	struct http_conn http;
+	int state;
+	int op;
+	int closing;
+	time_t last_active;
+	struct uring_conn *prev;
+	struct uring_conn *next;
+
+	/* What's being sent by the CONN_OP_SEND in flight */
+	struct iovec iov[HTTP_GATHER_MAX];
+	struct msghdr msg;
+
+	/*
+	 * The pipe that the file is spliced through, made when it's first
+	 * needed, and how much of it is waiting in there. Then how many of the
+	 * splices in flight have yet to complete, and their results so far.
+	 */
+	int pipe_fds[2];
+	size_t pipe_size;
+	size_t piped;
+	int splices;
+	int spliced_in;
+	int spliced_out;
+	int wait_writable; /* The socket was full, poll it before sending */
+};
+
+
+/*
+ * The state of the event loop
+ */
+struct uring_loop {
+	struct uring ring;
+	struct server_filesystem *fs;
+	struct server_state *server;
+	struct uring_conn *oldest;
+	struct uring_conn *newest;
+	int no_multishot; /* The kernel can only accept one at a time */
+	struct __kernel_timespec tick;
+};
+
+
+/* Forward declarations of functions */
+void sig_int_handler(int);
+void install_sig_handler();
+int uring_create(struct uring *ring, unsigned int entries,
+	unsigned int cq_entries);
+int uring_reserve(struct uring *ring, unsigned int count);
+struct io_uring_sqe *uring_sqe(struct uring *ring, int opcode, int fd,
+	uint64_t user_data);
+int uring_enter(struct uring *ring, unsigned int wait);
+void uring_destroy(struct uring *ring);
+void submit_accept(struct uring_loop*);
+void submit_tick(struct uring_loop*);
+void submit_close(struct uring_loop*, int fd);
+struct uring_conn *conn_open(struct uring_loop*, int fd);
+void conn_close(struct uring_loop*, struct uring_conn*);
+void conn_free(struct uring_loop*, struct uring_conn*);
+void conn_touch(struct uring_loop*, struct uring_conn*);
+int conn_is_idle(struct uring_conn*);
+int conn_splice(struct uring_loop*, struct uring_conn*, int fd,
+	off_t offset, size_t size);
+int conn_spliced(struct uring_conn*, int op);
+void conn_handle(struct uring_loop*, struct uring_conn*);
+void conn_complete(struct uring_loop*, struct uring_conn*, int res);
+void accept_complete(struct uring_loop*, struct io_uring_cqe*);
+void expire_connections(struct uring_loop*);
+void serve_requests(struct server_filesystem*, struct server_state*);
+
+
+/* Signal handler for SIGINT */
+void sig_int_handler(int sig) {
+	/* On inturrupted, break out to the break-out-of-handler-loop jump point */
+	siglongjmp(before_exit, 1);
+}
+
+
+/* Install the signal handlers */
+void install_sig_handler() {
+	/* Install SIGINT */
+	memset(&server_int_sigaction, 0x0, sizeof(sigaction));
+	server_int_sigaction.sa_handler = sig_int_handler;
+	server_int_sigaction.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &server_int_sigaction, NULL);
+
+	/* Don't die when a client hangs up on us */
+	server_ignore_sigpipe();
+}
+
+
+/*
+ * Set up an io_uring with room for |entries| submissions and |cq_entries|
+ * completions (or as many as the kernel allows), and map it's queues.
+ * Returns 0 -> The kernel doesn't have io_uring, or it failed
+ *         1 -> Okay
+ */
+int uring_create(struct uring *ring, unsigned int entries,
+	unsigned int cq_entries)
+{
+	struct io_uring_params params;
+	unsigned int i;
+
+	memset(ring, 0x0, sizeof(struct uring));
+	memset(&params, 0x0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = cq_entries;
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return 0;
+
+	/*
+	 * Map the queues, which newer kernels let us do with the one mapping,
+	 * and the submissions themselves.
+	 */
+	ring->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) &&
+		ring->cq_ring_size > ring->sq_ring_size)
+	{
+		ring->sq_ring_size = ring->cq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto error;
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			goto error;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		goto error;
+	}
+
+	/* Find our way around them */
+	ring->sq_head = (unsigned int*)((char*)ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (unsigned int*)((char*)ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask =
+		(unsigned int*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array =
+		(unsigned int*)((char*)ring->sq_ring + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned int*)((char*)ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned int*)((char*)ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask =
+		(unsigned int*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes =
+		(struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+
+	/* Each slot of the queue always holds the submission of the same index */
+	for (i = 0; i < ring->sq_entries; ++i)
+		ring->sq_array[i] = i;
+
+	return 1;
+
+error:
+	close(ring->fd);
+	return 0;
+}
+
+
+/*
+ * Make sure there's room for |count| more submissions, submitting what's
+ * in the queue if there isn't. So that linked submissions can be added
+ * without the queue being submitted part way through them.
+ * Returns 0 -> There's no room even so
+ *         1 -> Okay
+ */
+int uring_reserve(struct uring *ring, unsigned int count) {
+	if (ring->sq_local_tail - __atomic_load_n(ring->sq_head,
+		__ATOMIC_ACQUIRE) + count <= ring->sq_entries)
+	{
+		return 1;
+	}
+	uring_enter(ring, 0);
+	return ring->sq_local_tail - __atomic_load_n(ring->sq_head,
+		__ATOMIC_ACQUIRE) + count <= ring->sq_entries;
+}
+
+
+/*
+ * Get the next free submission, cleared, with it's operation, file
+ * descriptor and user_data filled in. If the queue is full, what's in it
+ * is submitted first to make room.
+ * Returns: The submission, or NULL if there's no room even so.
+ */
+struct io_uring_sqe *uring_sqe(struct uring *ring, int opcode, int fd,
+	uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!uring_reserve(ring, 1))
+		return NULL;
+
+	sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+	memset(sqe, 0x0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	++ring->sq_local_tail;
+	return sqe;
+}
+
+
+/*
+ * Hand the kernel what's been added to the submission queue, along with
+ * anything it didn't take last time, and wait for at least |wait|
+ * completions.
+ * Returns: As io_uring_enter
+ */
+int uring_enter(struct uring *ring, unsigned int wait) {
+	unsigned int submit;
+
+	submit = ring->sq_local_tail -
+		__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	return syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+
+/*
+ * Unmap and close an io_uring made by uring_create.
+ */
+void uring_destroy(struct uring *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+
+/*
+ * Start accepting connections, all of them with the one submission if the
+ * kernel can, or one at a time if it can't. Each comes in non-blocking.
+ */
+void submit_accept(struct uring_loop *loop) {
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(&loop->ring, IORING_OP_ACCEPT, loop->server->socketfd,
+		USER_DATA_ACCEPT);
+	if (!sqe)
+		return;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	if (!loop->no_multishot)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+
+/*
+ * Wake up in a second, to check the connections' timeouts.
+ */
+void submit_tick(struct uring_loop *loop) {
+	struct io_uring_sqe *sqe;
+
+	loop->tick.tv_sec = 1;
+	loop->tick.tv_nsec = 0;
+	sqe = uring_sqe(&loop->ring, IORING_OP_TIMEOUT, -1, USER_DATA_TICK);
+	if (!sqe)
+		return;
+	sqe->addr = (uintptr_t)&loop->tick;
+	sqe->len = 1;
+}
+
+
+/*
+ * Close a file descriptor through the ring, or straight away if the ring
+ * is full.
+ */
+void submit_close(struct uring_loop *loop, int fd) {
+	if (!uring_sqe(&loop->ring, IORING_OP_CLOSE, fd, USER_DATA_IGNORED))
+		close(fd);
+}
+
+
+/*
+ * Start tracking a newly accepted connection.
+ * Returns: The connection.
+ */
+struct uring_conn *conn_open(struct uring_loop *loop, int fd) {
+	struct uring_conn *conn;
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+
+	/* Multishot accepts all land in the same place, so ask who it is */
+	addr_len = sizeof(addr);
+	memset(&addr, 0x0, sizeof(addr));
+	getpeername(fd, (struct sockaddr*)&addr, &addr_len);
+
+	/* Set up the connection state */
+	conn = malloc(sizeof(struct uring_conn));
+	http_conn_init(&conn->http, fd, inet_ntoa(addr.sin_addr));
+	conn->http.accepted = server_stats_now();
+	conn->http.external_reads = 1;
+	conn->state = CONN_STATE_READING;
+	conn->op = CONN_OP_NONE;
+	conn->closing = 0;
+	conn->pipe_fds[0] = -1;
+	conn->pipe_fds[1] = -1;
+	conn->piped = 0;
+	conn->splices = 0;
+	conn->wait_writable = 0;
+	conn->prev = NULL;
+	conn->next = NULL;
+
+	/* Put it at the back of the timeout list */
+	conn_touch(loop, conn);
+	server_stats_open(loop->fs->stats, conn->http.accepted);
+	return conn;
+}
+
+
+/*
+ * Stop tracking a connection, and close it. If it has an operation in
+ * flight on the ring, the socket is shut down to make that finish, and the
+ * connection is only freed when it does.
+ */
+void conn_close(struct uring_loop *loop, struct uring_conn *conn) {
+	/* Unlink from the timeout list */
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		loop->oldest = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	else
+		loop->newest = conn->prev;
+	server_stats_close(loop->fs->stats);
+
+	shutdown(conn->http.fd, SHUT_RDWR);
+	if (conn->op != CONN_OP_NONE) {
+		conn->closing = 1;
+		return;
+	}
+	conn_free(loop, conn);
+}
+
+
+/*
+ * Close a connection's socket, and free it's state, once it's closed and
+ * has nothing in flight.
+ */
+void conn_free(struct uring_loop *loop, struct uring_conn *conn) {
+	submit_close(loop, conn->http.fd);
+	if (conn->pipe_fds[0] >= 0) {
+		close(conn->pipe_fds[0]);
+		close(conn->pipe_fds[1]);
+	}
+	http_conn_destroy(&conn->http);
+	free(conn);
+}
+
+
+/*
+ * Mark a connection as having made progress, moving it to the back of the
+ * timeout list.
+ */
+void conn_touch(struct uring_loop *loop, struct uring_conn *conn) {
+	conn->last_active = time(NULL);
+
+	/* Already at the back? */
+	if (loop->newest == conn)
+		return;
+
+	/* Unlink it if it's in the list */
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else if (loop->oldest == conn)
+		loop->oldest = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+
+	/* Link it in at the back */
+	conn->prev = loop->newest;
+	conn->next = NULL;
+	if (loop->newest)
+		loop->newest->next = conn;
+	else
+		loop->oldest = conn;
+	loop->newest = conn;
+}
+
+
+/*
+ * Is a connection sitting idle between requests?
+ */
+int conn_is_idle(struct uring_conn *conn) {
+	return (conn->state == CONN_STATE_READING) &&
+		(conn->http.request_count > 0) && (conn->http.buffer_size == 0);
+}
+
+
+/*
+ * Send up to |size| bytes of the file |fd| from |offset| to a connection
+ * without them passing through this thread: Spliced into the connection's
+ * pipe, and linked to that, out of it to the socket. The kernel does both
+ * in it's own workers, so a file that has to be read from disk doesn't
+ * hold up the other connections. If the socket didn't take all of what
+ * was in the pipe last time, that's sent on it's own first.
+ * Returns 0 -> The pipe couldn't be made, or the ring is full
+ *         1 -> The splices were submitted
+ */
+int conn_splice(struct uring_loop *loop, struct uring_conn *conn, int fd,
+	off_t offset, size_t size)
+{
+	struct io_uring_sqe *sqe;
+	int pipe_size;
+
+	/* Make the pipe, as big as we're allowed */
+	if (conn->pipe_fds[0] < 0) {
+		if (pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+			conn->pipe_fds[0] = -1;
+			return 0;
+		}
+		pipe_size = fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+		if (pipe_size <= 0)
+			pipe_size = fcntl(conn->pipe_fds[1], F_GETPIPE_SZ);
+		conn->pipe_size = (pipe_size > 0) ? pipe_size : 4096;
+	}
+	if (!uring_reserve(&loop->ring, 2))
+		return 0;
+
+	/*
+	 * Fill the pipe from the file, unless there's still some in it. Both
+	 * splices are non-blocking, so that a worker never sits on a full pipe
+	 * or socket. If the pipe takes less than was asked for, the splice out
+	 * is cancelled, and what it did take is sent on it's own next time.
+	 */
+	conn->spliced_in = 0;
+	conn->spliced_out = 0;
+	if (conn->piped == 0) {
+		if (size > conn->pipe_size)
+			size = conn->pipe_size;
+		sqe = uring_sqe(&loop->ring, IORING_OP_SPLICE, conn->pipe_fds[1],
+			(uintptr_t)conn | USER_DATA_SPLICE_IN);
+		sqe->splice_fd_in = fd;
+		sqe->splice_off_in = offset;
+		sqe->off = (uint64_t)-1;
+		sqe->len = size;
+		sqe->splice_flags = SPLICE_F_NONBLOCK;
+		sqe->flags = IOSQE_IO_LINK;
+		conn->op = CONN_OP_SPLICE;
+		conn->splices = 2;
+	} else {
+		size = conn->piped;
+		conn->op = CONN_OP_DRAIN;
+		conn->splices = 1;
+	}
+
+	/* Then empty it into the socket */
+	sqe = uring_sqe(&loop->ring, IORING_OP_SPLICE, conn->http.fd,
+		(uintptr_t)conn);
+	sqe->splice_fd_in = conn->pipe_fds[0];
+	sqe->splice_off_in = (uint64_t)-1;
+	sqe->off = (uint64_t)-1;
+	sqe->len = size;
+	sqe->splice_flags = SPLICE_F_NONBLOCK;
+	return 1;
+}
+
+
+/*
+ * Account for the splices submitted by conn_splice, with |op|, once they
+ * have all completed.
+ * Returns 0 -> Sending the file failed
+ *         1 -> Okay, carry on with conn_handle. If the socket was full,
+ *              spliced_out is -EAGAIN
+ */
+int conn_spliced(struct uring_conn *conn, int op) {
+	/* What made it into the pipe, the file ending early is a failure */
+	if (op == CONN_OP_SPLICE) {
+		if (conn->spliced_in > 0)
+			conn->piped += conn->spliced_in;
+		else if (conn->spliced_in != -EAGAIN && conn->spliced_in != -EINTR)
+			return 0;
+	}
+
+	/*
+	 * What made it out of the pipe. It's cancelled if the splice in came
+	 * up short, and there's nothing to do but send the rest.
+	 */
+	if (conn->spliced_out > 0) {
+		conn->piped -= conn->spliced_out;
+		http_conn_segment_sent(&conn->http, conn->spliced_out);
+	} else if (conn->spliced_out != -ECANCELED &&
+		conn->spliced_out != -EAGAIN && conn->spliced_out != -EINTR)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * Advance a connection as far as it can go without waiting: Lex what's
+ * been read of it's request and / or send more of it's response, going on
+ * to the next request on a persistent connection, and closing it when
+ * it's done. When it has to wait, submit what it's waiting for to the
+ * ring: Reading more of the request, sending the responses' headers and
+ * bodies, splicing a file's contents, or waiting for room to send them.
+ */
+void conn_handle(struct uring_loop *loop, struct uring_conn *conn) {
+	struct io_uring_sqe *sqe;
+	const char *data;
+	char *space;
+	size_t size;
+	off_t offset;
+	int count;
+	int status;
+	int op;
+	int fd;
+
+	for (;;) {
+		/* Lex more of the request */
+		if (conn->state == CONN_STATE_READING) {
+			status = http_conn_recv(&conn->http);
+			if (status == HTTP_CONN_AGAIN && conn->http.response_count == 0) {
+				/* Still waiting on more of the request, read it */
+				size = http_conn_read_space(&conn->http, &space);
+				sqe = NULL;
+				if (size > 0) {
+					sqe = uring_sqe(&loop->ring, IORING_OP_RECV,
+						conn->http.fd, (uintptr_t)conn);
+				}
+				if (!sqe) {
+					conn_close(loop, conn);
+					return;
+				}
+				sqe->addr = (uintptr_t)space;
+				sqe->len = size;
+				conn->op = CONN_OP_RECV;
+				return;
+			} else if (status == HTTP_CONN_CLOSED) {
+				/* The client hung up between requests */
+				conn_close(loop, conn);
+				return;
+			}
+
+			/*
+			 * Request is complete (or bad), decide on a response, then go on
+			 * to any more pipelined requests that are already here. Once
+			 * there are no more, send the responses.
+			 */
+			if (status != HTTP_CONN_AGAIN) {
+				if (status == HTTP_CONN_DONE)
+					http_conn_dispatch(loop->fs, &conn->http);
+				else
+					http_conn_bad_request(&conn->http);
+				if (http_conn_next(&conn->http) &&
+					http_conn_batching(&conn->http))
+				{
+					continue;
+				}
+			}
+			conn->state = CONN_STATE_WRITING;
+		}
+
+		/*
+		 * Send the headers and bodies through the ring, then the last
+		 * response's segments: The file's contents spliced from it, with
+		 * any part headers of a multipart body sent in between.
+		 */
+		count = http_conn_gather(&conn->http, conn->iov);
+		op = CONN_OP_SEND;
+		size = 0;
+		if (count == 0) {
+			size = http_conn_segment(&conn->http, &data, &fd, &offset);
+			if (size > 0 && data) {
+				conn->iov[0].iov_base = (char*)data;
+				conn->iov[0].iov_len = size;
+				count = 1;
+				op = CONN_OP_PART;
+			}
+		}
+		if (conn->wait_writable) {
+			/* The socket was full, wait until it can take more */
+			conn->wait_writable = 0;
+			sqe = uring_sqe(&loop->ring, IORING_OP_POLL_ADD,
+				conn->http.fd, (uintptr_t)conn);
+			if (sqe) {
+				sqe->poll32_events = POLLOUT;
+				conn->op = CONN_OP_POLL;
+				return;
+			}
+			status = HTTP_CONN_ERROR;
+		} else if (count > 0) {
+			sqe = uring_sqe(&loop->ring, IORING_OP_SENDMSG, conn->http.fd,
+				(uintptr_t)conn);
+			if (sqe) {
+				memset(&conn->msg, 0x0, sizeof(conn->msg));
+				conn->msg.msg_iov = conn->iov;
+				conn->msg.msg_iovlen = count;
+				sqe->addr = (uintptr_t)&conn->msg;
+				sqe->len = 1;
+				sqe->msg_flags = MSG_NOSIGNAL;
+				conn->op = op;
+				return;
+			}
+			status = HTTP_CONN_ERROR;
+		} else if (size > 0) {
+			if (conn_splice(loop, conn, fd, offset, size))
+				return;
+			status = HTTP_CONN_ERROR;
+		} else {
+			status = HTTP_CONN_DONE;
+		}
+
+		/* Done (or failed), log the result */
+		http_conn_finish(loop->fs, &conn->http);
+
+		/* Close the connection, unless it's persistent */
+		if (status != HTTP_CONN_DONE || !conn->http.keep_alive) {
+			conn_close(loop, conn);
+			return;
+		}
+
+		/*
+		 * Go on to the next request, which may already be sitting in the
+		 * buffer.
+		 */
+		conn->state = CONN_STATE_READING;
+	}
+}
+
+
+/*
+ * Carry on with a connection once the operation it was waiting on has
+ * completed with result |res|.
+ */
+void conn_complete(struct uring_loop *loop, struct uring_conn *conn,
+	int res)
+{
+	int op;
+	int status;
+
+	op = conn->op;
+	conn->op = CONN_OP_NONE;
+	if (conn->closing) {
+		/* It was only waiting for this to be freed */
+		conn_free(loop, conn);
+		return;
+	}
+	conn_touch(loop, conn);
+
+	/* The splices are accounted for together, once both are done */
+	if (op == CONN_OP_SPLICE || op == CONN_OP_DRAIN) {
+		if (!conn_spliced(conn, op)) {
+			/* The connection (or the file) failed, log how far it got */
+			http_conn_finish(loop->fs, &conn->http);
+			conn_close(loop, conn);
+			return;
+		}
+		if (conn->spliced_out == -EAGAIN)
+			conn->wait_writable = 1;
+		conn_handle(loop, conn);
+		return;
+	}
+
+	/* Interrupted, just try again */
+	if (res == -EAGAIN || res == -EINTR) {
+		conn_handle(loop, conn);
+		return;
+	}
+
+	if (op == CONN_OP_RECV) {
+		/* Add what was read, to be lexed */
+		status = http_conn_read_done(&conn->http, res < 0 ? -1 : res);
+		if (status == HTTP_CONN_CLOSED) {
+			conn_close(loop, conn);
+			return;
+		} else if (status == HTTP_CONN_ERROR) {
+			/* Cut off part way through a request */
+			http_conn_bad_request(&conn->http);
+			conn->state = CONN_STATE_WRITING;
+		}
+	} else if (op == CONN_OP_SEND || op == CONN_OP_PART) {
+		if (res < 0) {
+			/* The connection failed, log how far it got */
+			http_conn_finish(loop->fs, &conn->http);
+			conn_close(loop, conn);
+			return;
+		}
+		if (op == CONN_OP_SEND)
+			http_conn_sent(&conn->http, res);
+		else
+			http_conn_segment_sent(&conn->http, res);
+	}
+
+	conn_handle(loop, conn);
+}
+
+
+/*
+ * Start serving a connection that has been accepted, and keep accepting.
+ */
+void accept_complete(struct uring_loop *loop, struct io_uring_cqe *cqe) {
+	struct uring_conn *conn;
+
+	if (cqe->res >= 0) {
+		conn = conn_open(loop, cqe->res);
+		conn_handle(loop, conn);
+	} else if (cqe->res == -EINVAL && !loop->no_multishot) {
+		/* The kernel can't accept more than one at a time */
+		loop->no_multishot = 1;
+	} else if (cqe->res != -EAGAIN && cqe->res != -EINTR &&
+		cqe->res != -ECONNABORTED)
+	{
+		printf("Error trying to accept a connection.\n");
+	}
+
+	/*
+	 * Ask for the next if this accept is over: It only accepted the one,
+	 * or the multishot one stopped.
+	 */
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		submit_accept(loop);
+}
+
+
+/*
+ * Drop any connections that have gone too long without making progress, or
+ * that have sat idle between requests for too long.
+ */
+void expire_connections(struct uring_loop *loop) {
+	struct uring_conn *conn;
+	struct uring_conn *next;
+	time_t now;
+
+	/*
+	 * Idle connections have the shorter timeout, so everything after the
+	 * first connection that is still within it can be skipped.
+	 */
+	now = time(NULL);
+	for (conn = loop->oldest; conn &&
+		conn->last_active < now - HTTP_KEEPALIVE_TIMEOUT; conn = next)
+	{
+		next = conn->next;
+		if (!conn_is_idle(conn) &&
+			conn->last_active >= now - CONNECTION_TIMEOUT)
+		{
+			continue;
+		}
+
+		/* If it got as far as responding, log how that went */
+		if (conn->state == CONN_STATE_WRITING)
+			http_conn_finish(loop->fs, &conn->http);
+		conn_close(loop, conn);
+	}
+}
+
+
+/*
+ * Main function to serve requests to the client, using a given server_state
+ * serving documents from a given server_filesystem.
+ * All connections are served from this one thread, as with server_e, but
+ * through an io_uring: Accepting, reading the requests, sending the headers
+ * and bodies of the responses, and closing are all submitted to it, so one
+ * system call submits all of them for every connection that's ready and
+ * waits for the next to finish.
+ */
+void serve_requests(struct server_filesystem *fs, struct server_state *state) {
+	struct uring_loop loop;
+	struct io_uring_cqe cqe;
+	unsigned int head;
+	struct uring_conn *conn;
+
+	/* Set up the loop */
+	memset(&loop, 0x0, sizeof(loop));
+	loop.fs = fs;
+	loop.server = state;
+	if (!uring_create(&loop.ring, URING_ENTRIES, URING_CQ_ENTRIES)) {
+		printf("io_uring_setup() error\n");
+		return;
+	}
+	if (server_set_nonblocking(state) != SERVER_OKAY) {
+		printf("Could not listen for connections, terminating...\n");
+		uring_destroy(&loop.ring);
+		return;
+	}
+	submit_accept(&loop);
+	submit_tick(&loop);
+
+	for (;;) {
+		/* Submit everything, and wait for something to finish */
+		if (uring_enter(&loop.ring, 1) < 0) {
+			/*
+			 * Interrupted by a signal is okay. So is EBUSY, the kernel
+			 * has completions it can't fit in the queue, which reaping the
+			 * ones that are there makes room for. Anything else is fatal.
+			 */
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			if (errno != EBUSY) {
+				printf("Error waiting for completions, terminating...\n");
+				break;
+			}
+		}
+
+		/* Handle everything that finished */
+		head = *loop.ring.cq_head;
+		while (head != __atomic_load_n(loop.ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			/* Take it off the queue before handling it, which may submit */
+			cqe = loop.ring.cqes[head & *loop.ring.cq_mask];
+			++head;
+			__atomic_store_n(loop.ring.cq_head, head, __ATOMIC_RELEASE);
+
+			if (cqe.user_data == USER_DATA_ACCEPT) {
+				accept_complete(&loop, &cqe);
+			} else if (cqe.user_data == USER_DATA_TICK) {
+				/* Drop the connections that have timed out */
+				expire_connections(&loop);
+				submit_tick(&loop);
+			} else if (cqe.user_data == USER_DATA_IGNORED) {
+				/* Nothing is waiting on it */
+			} else if (cqe.user_data & USER_DATA_SPLICE_IN) {
+				/* A splice into a pipe, the one out of it is linked */
+				conn = (struct uring_conn*)(uintptr_t)
+					(cqe.user_data & ~(uint64_t)USER_DATA_SPLICE_IN);
+				conn->spliced_in = cqe.res;
+				if (--conn->splices == 0)
+					conn_complete(&loop, conn, 0);
+			} else {
+				/* A connection's, with both its splices done if it has two */
+				conn = (struct uring_conn*)(uintptr_t)cqe.user_data;
+				if (conn->op == CONN_OP_SPLICE || conn->op == CONN_OP_DRAIN)
+					conn->spliced_out = cqe.res;
+				if (conn->splices == 0 || --conn->splices == 0)
+					conn_complete(&loop, conn, cqe.res);
+			}
+		}
+	}
+
+	/* Close any connections still open */
+	while (loop.oldest)
+		conn_close(&loop, loop.oldest);
+	uring_destroy(&loop.ring);
+}
+
+
+/* Main program entry point */
+int main(int argc, char *argv[]) {
+	struct server_args args;
+	struct server_filesystem fs;
+	int fs_status;
+	struct server_state server;
+	int i;
+
+	/* Get the server arguments */
+	if (parse_args(&args, argc, argv) != ARGS_OKAY) {
+		print_usage("server_u");
+		return -1;
+	}
+
+	/*
+	 * Open the server filesystem (0 -> don't use flock, there is only one
+	 * process writing to the log)
+	 */
+	if ((fs_status = server_fs_create(&fs, args.server_root, args.log_file, 0))
+		!= FS_OKAY)
+	{
+		/* Failed to open the server filesystem, report and exit */
+		switch (fs_status) {
+		case FS_BADROOT:
+			printf("Could not access server root directory.\n");
+			break;
+		case FS_BADLOG:
+			printf("Could not open log file for writing.\n");
+			break;
+		case FS_INITERROR:
+			printf("Error initializing the file system access.\n");
+			break;
+		default:
+			printf("Unknown Error during startup.\n");
+		}
+		return -1;
+	}
+
+	/* Write a binary log if asked (-b) */
+	if (args.log_binary)
+		server_fs_enable_binary_log(&fs);
+
+	/* Let clients cache the files under some paths for a while (-e) */
+	for (i = 0; i < args.expires_count; ++i) {
+		server_fs_add_cache_policy(&fs, args.expires_prefix[i],
+			args.expires_max_age[i]);
+	}
+
+	/* Keep live stats, served at a URL of their own, if asked (-S) */
+	if (args.stats_path && server_fs_enable_stats(&fs, args.stats_path)
+		!= FS_OKAY)
+	{
+		printf("Could not start keeping stats, serving without them.\n");
+	}
+
+	/* Log the phases of each request (-t), and the slow ones (-l) */
+	if (args.log_timing)
+		server_fs_enable_timing_log(&fs);
+	if (args.slow_ms >= 0 &&
+		server_fs_enable_slow_log(&fs, args.slow_ms) != FS_OKAY)
+	{
+		printf("Could not open the slow request log, serving without it.\n");
+	}
+
+	/* Log asynchronously, dropping lines instead of waiting if asked (-d) */
+	if (server_fs_enable_async_log(&fs,
+		args.log_drop ? LOG_FULL_DROP : LOG_FULL_BLOCK) != FS_OKAY)
+	{
+		printf("Could not start the log flusher, logging directly.\n");
+	}
+
+	/* Cache frequently requested files in memory (-c) */
+	if (args.cache_mb > 0 && server_fs_enable_cache(&fs,
+		(size_t)args.cache_mb * 1024 * 1024) != FS_OKAY)
+	{
+		printf("Could not start the file cache, serving without it.\n");
+	}
+
+	/* Create the server state */
+	if (server_create(&server, args.port, 0, &args.tuning) != SERVER_OKAY) {
+		/*
+		 * Failed to create the server on the port requested, report
+		 * and exit
+		 */
+		printf("Could not start the server on port %d.\n", args.port);
+
+		/*
+		 * We already opened the filesystem, so before exiting, destroy
+		 * destroy the server_fs
+		 */
+		server_fs_destroy(&fs);
+
+		return -1;
+	}
+
+	/* Listen and serve new connections */
+	if (sigsetjmp(before_exit, 1) == 0) {
+		/*
+		 * With the jump point installed, now we can safely install the
+		 * signal handlers.
+		 */
+		install_sig_handler();
+
+		/* Go into the main handler loop */
+		serve_requests(&fs, &server);
+	} else {
+		/* User Ctrl-C requested exit (if not daemonized) */
+		printf("\nShutdown Requested, terminating...\n");
+	}
+
+	/* Close the server and fs */
+	server_destroy(&server);
+	if (server_fs_log_dropped(&fs) > 0)
+		printf("%lu log lines were dropped.\n", server_fs_log_dropped(&fs));
+	server_fs_destroy(&fs);
+
+	/* Done */
+	return 0;
+}
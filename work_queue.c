@@ -0,0 +1,110 @@
+#include "work_queue.h"
+
+#include <stdlib.h>
+
+/*
+ * The algorithm is Dmitry Vyukov's bounded MPMC queue:
+ *   http://www.1024cores.net/home/lock-free-algorithms/queues/
+ *     bounded-mpmc-queue
+ * Each cell's sequence number is equal to the position that may next push
+ * into it, or that position + 1 once it holds an item ready to be popped.
+ */
+
+
+int work_queue_create(struct work_queue *queue, unsigned int capacity) {
+	unsigned int i;
+
+	/* Capacity must be a power of two so that positions can be masked */
+	if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+		return WORK_QUEUE_ERROR;
+
+	queue->cells = malloc(capacity * sizeof(struct work_queue_cell));
+	if (!queue->cells)
+		return WORK_QUEUE_ERROR;
+
+	/* Every cell starts out ready to be pushed into at it's own position */
+	for (i = 0; i < capacity; ++i) {
+		queue->cells[i].sequence = i;
+		queue->cells[i].item = NULL;
+	}
+	queue->mask = capacity - 1;
+	queue->push_pos = 0;
+	queue->pop_pos = 0;
+
+	return WORK_QUEUE_OKAY;
+}
+
+
+int work_queue_push(struct work_queue *queue, void *item) {
+	struct work_queue_cell *cell;
+	unsigned int pos;
+	unsigned int seq;
+	int diff;
+
+	pos = __atomic_load_n(&queue->push_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &queue->cells[pos & queue->mask];
+		seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		diff = (int)seq - (int)pos;
+		if (diff == 0) {
+			/* The cell is free, try to claim this position */
+			if (__atomic_compare_exchange_n(&queue->push_pos, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+			/* Lost the race, pos has been reloaded, try again */
+		} else if (diff < 0) {
+			/* The cell still holds an item from a lap ago, we're full */
+			return 0;
+		} else {
+			/* Another producer got here first, catch up */
+			pos = __atomic_load_n(&queue->push_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* Fill the cell and publish it to consumers */
+	cell->item = item;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+int work_queue_pop(struct work_queue *queue, void **item) {
+	struct work_queue_cell *cell;
+	unsigned int pos;
+	unsigned int seq;
+	int diff;
+
+	pos = __atomic_load_n(&queue->pop_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &queue->cells[pos & queue->mask];
+		seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		diff = (int)seq - (int)(pos + 1);
+		if (diff == 0) {
+			/* The cell holds an item, try to claim this position */
+			if (__atomic_compare_exchange_n(&queue->pop_pos, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		} else if (diff < 0) {
+			/* Nothing has been pushed here yet, we're empty */
+			return 0;
+		} else {
+			/* Another consumer got here first, catch up */
+			pos = __atomic_load_n(&queue->pop_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* Take the item, and free the cell up for the next lap's producer */
+	*item = cell->item;
+	__atomic_store_n(&cell->sequence, pos + queue->mask + 1,
+		__ATOMIC_RELEASE);
+	return 1;
+}
+
+
+void work_queue_destroy(struct work_queue *queue) {
+	free(queue->cells);
+}
@@ -0,0 +1,69 @@
+#ifndef WORK_QUEUE_H_
+#define WORK_QUEUE_H_
+
+
+/* Status codes returned by work_queue_create */
+#define WORK_QUEUE_OKAY   0
+#define WORK_QUEUE_ERROR -1
+
+
+/*
+ * A slot in a work_queue. The sequence number says whether the slot is
+ * ready to be pushed into or popped from for a given queue position.
+ */
+struct work_queue_cell {
+	unsigned int sequence;
+	void *item;
+};
+
+
+/*
+ * A bounded, lock-free, multi-producer multi-consumer queue of pointers.
+ * Producers and consumers each claim a position with a compare-and-swap,
+ * so no thread ever waits on a lock held by another.
+ * The positions are padded apart so that producers and consumers don't
+ * fight over the same cache line.
+ */
+struct work_queue {
+	struct work_queue_cell *cells;
+	unsigned int mask;
+	char pad0[64];
+	unsigned int push_pos;
+	char pad1[64];
+	unsigned int pop_pos;
+	char pad2[64];
+};
+
+
+/*
+ * Initialize a work_queue able to hold |capacity| items, which must be a
+ * power of two.
+ * Returns: WORK_QUEUE_OKAY on success, or WORK_QUEUE_ERROR on failure.
+ */
+int work_queue_create(struct work_queue *queue, unsigned int capacity);
+
+
+/*
+ * Push an item onto the back of the queue.
+ * Returns: 1 -> The item was pushed
+ *          0 -> The queue is full
+ */
+int work_queue_push(struct work_queue *queue, void *item);
+
+
+/*
+ * Pop an item off the front of the queue into |item|.
+ * Returns: 1 -> An item was popped
+ *          0 -> The queue is empty
+ */
+int work_queue_pop(struct work_queue *queue, void **item);
+
+
+/*
+ * Destroy a work_queue, should only be called on a work_queue that was
+ * successfully work_queue_create'd. Any items left in it are not freed.
+ */
+void work_queue_destroy(struct work_queue *queue);
+
+
+#endif